@@ -0,0 +1,316 @@
+#!/usr/bin/env python3
+"""Offline benchmark for sip.
+
+Generates a synthetic repository, serves it from local stand-ins for GitHub
+(file:// and smart HTTP for git, plain HTTP for raw files) and times sip's
+clone, directory and file downloads with a cold and a warm cache. Results are
+printed as JSON: p50/p95 wall time, child processes per run (from --trace)
+and bytes written per run.
+
+    python3 bench/bench.py --sip ./sip --files 2000 --depth 3 --blob-size 4096
+"""
+
+import argparse
+import http.server
+import json
+import os
+import random
+import shutil
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+OWNER = "bench"
+REPO = "synthetic"
+LFS_AUTH = "RemoteAuth bench"
+
+
+def git(*args, **kwargs):
+    return subprocess.run(["git", *args], check=True, stdout=subprocess.PIPE, **kwargs).stdout
+
+
+def generate_repo(root, files, depth, blob_size, seed):
+    """Creates ROOT/OWNER/REPO.git with FILES blobs spread over a tree DEPTH
+    levels deep under src/, plus a README. Returns a sample file path and the
+    directory used for directory downloads."""
+    rng = random.Random(seed)
+    bare = os.path.join(root, OWNER, REPO + ".git")
+    git("init", "-q", "--bare", "-b", "main", bare)
+
+    paths = []
+    for i in range(files):
+        parts = ["src"] + ["d%d" % rng.randrange(4) for _ in range(depth)]
+        paths.append("/".join(parts + ["f%05d.txt" % i]))
+
+    # fast-import keeps generation quick for large file counts
+    stream = [b"commit refs/heads/main\n",
+              b"committer bench <bench@example.com> 1700000000 +0000\n",
+              b"data 5\nbench\n"]
+    for path in ["README.md"] + paths:
+        size = max(1, int(rng.expovariate(1.0 / blob_size)))
+        data = rng.randbytes(size // 2).hex().encode()[:size]
+        stream.append(b"M 100644 inline %s\ndata %d\n%s\n" % (path.encode(), len(data), data))
+    stream.append(b"\n")
+    git("--git-dir", bare, "fast-import", "--quiet", input=b"".join(stream))
+    git("--git-dir", bare, "config", "uploadpack.allowFilter", "true")
+    git("--git-dir", bare, "config", "uploadpack.allowAnySHA1InWant", "true")
+    git("--git-dir", bare, "config", "http.receivepack", "false")
+
+    sample_dir = os.path.dirname(paths[0]).split("/")
+    return bare, paths[len(paths) // 2], "/".join(sample_dir[:2])
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    """Serves /git/ through git-http-backend and /raw/OWNER/REPO/REF/PATH
+    and /codeload/OWNER/REPO/tar.gz/REF straight from the bare repository.
+    The LFS batch API of /git/OWNER/REPO.git answers for objects stored in
+    the bare repository's lfs/objects/, served from /lfs/OWNER/REPO/OID."""
+
+    root = None
+    lock = threading.Lock()
+    bytes_served = 0
+
+    def log_message(self, *args):
+        pass
+
+    def send(self, status, body, content_type="application/octet-stream"):
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+        with Handler.lock:
+            Handler.bytes_served += len(body)
+
+    def do_GET(self):
+        self.route()
+
+    def do_POST(self):
+        self.route()
+
+    def route(self):
+        path, _, query = self.path.partition("?")
+        if path.startswith("/git/") and path.endswith(".git/info/lfs/objects/batch"):
+            return self.lfs_batch(path[len("/git/"):-len(".git/info/lfs/objects/batch")])
+        if path.startswith("/git/"):
+            return self.backend(path[len("/git"):], query)
+        parts = path.split("/")
+        if path.startswith("/raw/") and len(parts) >= 6:
+            owner, repo, ref, file = parts[2], parts[3], parts[4], "/".join(parts[5:])
+            bare = os.path.join(self.root, owner, repo + ".git")
+            result = subprocess.run(["git", "--git-dir", bare, "cat-file", "blob", ref + ":" + file],
+                                    stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+            if result.returncode != 0:
+                return self.send(404, b"404: Not Found\n", "text/plain")
+            return self.send(200, result.stdout)
+        if path.startswith("/codeload/") and len(parts) == 6 and parts[4] == "tar.gz":
+            owner, repo, ref = parts[2], parts[3], parts[5]
+            bare = os.path.join(self.root, owner, repo + ".git")
+            result = subprocess.run(["git", "--git-dir", bare, "archive", "--format=tar.gz",
+                                     "--prefix=%s-%s/" % (repo, ref), ref],
+                                    stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+            if result.returncode != 0:
+                return self.send(404, b"404: Not Found\n", "text/plain")
+            return self.send(200, result.stdout, "application/x-gzip")
+        if path.startswith("/lfs/") and len(parts) == 5:
+            # hrefs carry a header, as GitHub's do, that must come back
+            if self.headers.get("Authorization") != LFS_AUTH:
+                return self.send(401, b"401: Unauthorized\n", "text/plain")
+            owner, repo, oid = parts[2], parts[3], parts[4]
+            try:
+                with open(self.lfs_object(owner, repo, oid), "rb") as f:
+                    return self.send(200, f.read())
+            except OSError:
+                pass
+        self.send(404, b"404: Not Found\n", "text/plain")
+
+    def lfs_object(self, owner, repo, oid):
+        return os.path.join(self.root, owner, repo + ".git", "lfs", "objects", oid[:2], oid[2:4], oid)
+
+    def lfs_batch(self, name):
+        length = int(self.headers.get("Content-Length") or 0)
+        request = json.loads(self.rfile.read(length) or b"{}")
+        owner, _, repo = name.partition("/")
+        objects = []
+        for item in request.get("objects", []):
+            oid, size = item["oid"], item["size"]
+            if os.path.isfile(self.lfs_object(owner, repo, oid)):
+                href = "http://%s/lfs/%s/%s/%s" % (self.headers["Host"], owner, repo, oid)
+                actions = {"download": {"href": href, "header": {"Authorization": LFS_AUTH}}}
+                objects.append({"oid": oid, "size": size, "actions": actions})
+            else:
+                objects.append({"oid": oid, "size": size,
+                                "error": {"code": 404, "message": "Object does not exist"}})
+        body = json.dumps({"transfer": "basic", "objects": objects}).encode()
+        self.send(200, body, "application/vnd.git-lfs+json")
+
+    def backend(self, path_info, query):
+        length = int(self.headers.get("Content-Length") or 0)
+        body = self.rfile.read(length) if length else b""
+        env = dict(os.environ,
+                   GIT_PROJECT_ROOT=self.root, GIT_HTTP_EXPORT_ALL="1", PATH_INFO=path_info,
+                   QUERY_STRING=query, REQUEST_METHOD=self.command,
+                   CONTENT_TYPE=self.headers.get("Content-Type", ""), CONTENT_LENGTH=str(len(body)),
+                   REMOTE_ADDR="127.0.0.1", GIT_PROTOCOL=self.headers.get("Git-Protocol", ""))
+        if self.headers.get("Content-Encoding") == "gzip":
+            env["HTTP_CONTENT_ENCODING"] = "gzip"
+        result = subprocess.run(["git", "http-backend"], input=body, env=env,
+                                stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        head, _, payload = result.stdout.partition(b"\r\n\r\n")
+        status, headers = 200, []
+        for line in head.decode("latin-1").split("\r\n"):
+            key, _, value = line.partition(":")
+            if key.lower() == "status":
+                status = int(value.split()[0])
+            elif key:
+                headers.append((key, value.strip()))
+        self.send_response(status)
+        for key, value in headers:
+            self.send_header(key, value)
+        self.send_header("Content-Length", str(len(payload)))
+        self.end_headers()
+        self.wfile.write(payload)
+        with Handler.lock:
+            Handler.bytes_served += len(payload)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def tree_size(path):
+    if os.path.isfile(path):
+        return os.path.getsize(path)
+    total = 0
+    for dirpath, dirnames, filenames in os.walk(path):
+        if ".git" in dirnames:
+            dirnames.remove(".git")
+        total += sum(os.path.getsize(os.path.join(dirpath, f)) for f in filenames)
+    return total
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    index = min(len(ordered) - 1, max(0, int(round(fraction * (len(ordered) - 1)))))
+    return ordered[index]
+
+
+def run_case(sip, env, args, work, runs, warm, cache_dir):
+    """Runs sip RUNS times and returns timing, child and byte statistics.
+    A warm case keeps the object and ref caches across runs and discards a
+    first run that fills them; a cold case starts every run empty."""
+    times, children, written, served = [], [], [], []
+    for i in range(runs + (1 if warm else 0)):
+        out = os.path.join(work, "out")
+        shutil.rmtree(out, ignore_errors=True)
+        if not warm:
+            shutil.rmtree(cache_dir, ignore_errors=True)
+        trace = os.path.join(work, "trace.json")
+        cmd = [sip, "-q", "--trace=" + trace, "-o", out]
+        if warm:
+            cmd.append("--cache-dir=" + os.path.join(cache_dir, "objects"))
+        served_before = Handler.bytes_served
+        start = time.perf_counter()
+        result = subprocess.run(cmd + args, env=env, cwd=work, stdout=subprocess.DEVNULL,
+                                stderr=subprocess.PIPE)
+        elapsed = time.perf_counter() - start
+        if result.returncode != 0:
+            sys.exit("bench: %s failed:\n%s" % (" ".join(cmd + args), result.stderr.decode()))
+        if warm and i == 0:
+            continue
+        with open(trace) as f:
+            events = json.load(f)["traceEvents"]
+        times.append(elapsed * 1000)
+        children.append(sum(1 for e in events if e.get("cat") == "process"))
+        written.append(tree_size(out))
+        served.append(Handler.bytes_served - served_before)
+    return {
+        "runs": runs,
+        "p50_ms": round(percentile(times, 0.5), 2),
+        "p95_ms": round(percentile(times, 0.95), 2),
+        "children": percentile(children, 0.5),
+        "bytes_written": percentile(written, 0.5),
+        "http_bytes_served": percentile(served, 0.5),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--sip", default="./sip", help="sip binary to benchmark")
+    parser.add_argument("--files", type=int, default=500, help="files in the synthetic repo")
+    parser.add_argument("--depth", type=int, default=3, help="directory depth under src/")
+    parser.add_argument("--blob-size", type=int, default=2048, help="mean blob size in bytes")
+    parser.add_argument("--runs", type=int, default=5, help="timed runs per case")
+    parser.add_argument("--seed", type=int, default=1, help="seed for the generated content")
+    parser.add_argument("--output", help="write JSON here instead of stdout")
+    options = parser.parse_args()
+
+    sip = os.path.abspath(options.sip)
+    base = tempfile.mkdtemp(prefix="sip-bench-")
+    try:
+        root = os.path.join(base, "repos")
+        bare, sample_file, sample_dir = generate_repo(root, options.files, options.depth,
+                                                      options.blob_size, options.seed)
+
+        Handler.root = root
+        server = Server(("127.0.0.1", 0), Handler)
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        http_base = "http://127.0.0.1:%d" % server.server_address[1]
+
+        transports = {
+            "file": "file://" + root,
+            "http": http_base + "/git",
+        }
+        cases = [
+            ("clone", []),
+            ("directory", [sample_dir + "/"]),
+            ("file", [sample_file]),
+        ]
+
+        results = []
+        for transport, git_base in transports.items():
+            for case, paths in cases:
+                for warm in (False, True):
+                    work = os.path.join(base, "work")
+                    shutil.rmtree(work, ignore_errors=True)
+                    os.makedirs(work)
+                    cache_dir = os.path.join(base, "cache")
+                    shutil.rmtree(cache_dir, ignore_errors=True)
+                    env = dict(os.environ,
+                               SIP_GIT_BASE_URL=git_base,
+                               SIP_RAW_BASE_URL=http_base + "/raw",
+                               SIP_TARBALL_BASE_URL=http_base + "/codeload",
+                               XDG_CACHE_HOME=cache_dir,
+                               GIT_TERMINAL_PROMPT="0")
+                    env.pop("SIP_CACHE_DIR", None)
+                    env.pop("GITHUB_TOKEN", None)
+                    stats = run_case(sip, env, [OWNER + "/" + REPO] + paths, work, options.runs,
+                                     warm, cache_dir)
+                    stats.update({
+                        "case": case,
+                        "transport": transport,
+                        "cache": "warm" if warm else "cold",
+                    })
+                    results.append(stats)
+        server.shutdown()
+
+        report = {
+            "repo": {"files": options.files, "depth": options.depth,
+                     "blob_size": options.blob_size, "pack_bytes": tree_size(bare)},
+            "results": results,
+        }
+        text = json.dumps(report, indent=2) + "\n"
+        if options.output:
+            with open(options.output, "w") as f:
+                f.write(text)
+        else:
+            sys.stdout.write(text)
+    finally:
+        shutil.rmtree(base, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,47 +1,142 @@
 // sip - https://github.com/allocata/sip
 
 #include <getopt.h>
+#ifdef SIP_WITH_LIBCURL
+    #include <curl/curl.h>
+#endif
 #ifdef _WIN32
     #include <windows.h>
+    #include <fcntl.h>
+    #include <io.h>
     #include <process.h>
 #else
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <spawn.h>
+    #include <sys/file.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
     #include <sys/wait.h>
     #include <unistd.h>
+    #ifdef __linux__
+        #include <linux/fs.h>
+        #include <sys/ioctl.h>
+    #endif
+
+extern char** environ;
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
 #include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 const char* PROGRAM_NAME = "sip";
 const char* PROGRAM_VERSION = "1.0.1";
 const int DEFAULT_TIMEOUT = 10;
+const int DEFAULT_JOBS = 4;
+const unsigned long long DEFAULT_CACHE_SIZE = 2ULL << 30;
+const long DEFAULT_REF_TTL = 300;
+const long DEFAULT_STORE_GC_AGE = 7 * 24 * 3600;
+const long DEFAULT_PREFETCH_BATCH = 20000;
+// --segments: no range is made smaller than this
+const std::uint64_t MIN_SEGMENT_SIZE = 1 << 20;
+// --strategy=auto: directories this small go over raw requests, and ones
+// holding this share of the repository's files over an unfiltered fetch
+const std::size_t AUTO_RAW_MAX_FILES = 8;
+const double AUTO_FULL_FETCH_SHARE = 0.9;
+
+// how directories are downloaded
+enum class Engine { Git, Tarball, Objects };
+// Path: the trailing slash decides; Auto: sized from the tree (directories)
+enum class Strategy { Path, Auto };
+// All: a directory download fetches every tree of the commit; Path: only
+// those on the way to it and below it
+enum class Trees { All, Path };
+// compression of -o - tar streams
+enum class Compress { None, Zstd };
+
+// Everything the command line sets. A --daemon request starts from a fresh
+// copy, so nothing one request asks for carries over into the next.
+struct Options {
+    bool verbose = false;
+    bool quiet = false;
+    int timeout = DEFAULT_TIMEOUT;
+    std::string output_dir = "./";
+    std::string branch = "";
+    std::string manifest = "";
+    int jobs = DEFAULT_JOBS;
+    bool jobs_set = false;  // -j also sizes checkout and copy workers
+    std::vector<std::string> paths;
+    std::vector<std::string> includes;  // --include globs
+    std::vector<std::string> excludes;  // --exclude globs
+    Engine engine = Engine::Git;
+    Strategy strategy = Strategy::Path;
+    Trees trees = Trees::All;
+    Compress compress = Compress::None;
+    int segments = 1;         // byte ranges fetched at once per file
+    std::string sha256 = "";  // expected digest of a single file
+    bool lfs = true;          // replace LFS pointers with their objects
+    std::string trace = "";   // empty: no trace written
+    bool sync = false;
+    long prefetch_batch = DEFAULT_PREFETCH_BATCH;  // 0: leave blobs to lazy fetch
+    std::string store_dir = "";                    // empty: no blob store
+    bool store_links = false;                      // hardlink store objects where reflinks fail
+    std::string cache_dir = "";                    // empty: object cache disabled
+    std::string git_base_url = "";                 // empty: SIP_GIT_BASE_URL or GitHub
+    std::string raw_base_url = "";                 // empty: SIP_RAW_BASE_URL or GitHub
+    std::string tarball_base_url = "";             // empty: SIP_TARBALL_BASE_URL or GitHub
+    unsigned long long cache_size = DEFAULT_CACHE_SIZE;
+    long ref_ttl = DEFAULT_REF_TTL;
+    bool refresh = false;
+    std::string daemon = "";  // --daemon socket path
+};
 
 // globals
-static bool opt_verbose = false;
-static bool opt_quiet = false;
-static int opt_timeout = DEFAULT_TIMEOUT;
-static std::string opt_output_dir = "./";
-static std::string opt_branch = "";
+static Options opt;
+
+// set while several downloads run concurrently (a manifest or several paths):
+// per-entry chatter and progress bars are replaced by the final report
+static bool batch_mode = false;
+
+// -o -: the download itself goes to stdout
+static bool output_to_stdout() {
+    return opt.output_dir == "-";
+}
+
+static bool chatty() {
+    return !opt.quiet && !batch_mode && !output_to_stdout();
+}
 
 static std::string rtrim(const std::string& str) {
     auto end = str.find_last_not_of(" \n\r\t");
     return end == std::string::npos ? "" : str.substr(0, end + 1);
 }
 
-static std::string dev_null() {
-#ifdef _WIN32
-    return " >nul 2>&1";
-#else
-    return " >/dev/null 2>&1";
-#endif
-}
-
 static int exit_status_of(int rc) {
     if (rc == -1)
         return -1;
@@ -56,12 +151,1049 @@ static int exit_status_of(int rc) {
 #endif
 }
 
-static std::string make_git_command(const std::string& git_args) {
+// --- process runner ---
+//
+// Children are started directly from an argv vector (posix_spawn, or
+// CreateProcess on Windows) instead of through a shell, with optional pipes
+// for stdin/stdout/stderr. Every child's wall time is accounted for and shown
+// in verbose mode.
+
+enum class Stream { Inherit, Capture, Discard };
+
+struct RunOptions {
+    // child output is only shown in verbose mode, as with the old " >/dev/null",
+    // and never on a stdout that carries the download
+    Stream out = opt.verbose && !output_to_stdout() ? Stream::Inherit : Stream::Discard;
+    Stream err = opt.verbose ? Stream::Inherit : Stream::Discard;
+    std::vector<std::pair<std::string, std::string>> env;  // overrides for the child
+    std::string input;                                     // fed to stdin, else /dev/null
+    // instead of INPUT, writes stdin through a stream as the child runs, on a
+    // thread of its own; the stream is closed when it returns
+    std::function<void(std::FILE*)> feed;
+    // with out == Stream::Capture, receives stdout as it arrives instead of
+    // RunResult::out; returning false closes the pipe on the child
+    std::function<bool(const char*, std::size_t)> on_out;
+};
+
+struct RunResult {
+    int status = -1;  // exit code, 128+signal, or -1 if the child never started
+    std::string out;
+    std::string err;
+    double seconds = 0.0;
+};
+
+// --trace: spans are collected in memory and written at exit as Chrome
+// trace-event JSON ("X" complete events, microseconds since start), which
+// chrome://tracing and Perfetto load directly.
+struct TraceEvent {
+    std::string name;
+    const char* category;
+    long long start_us;
+    long long duration_us;
+    int tid;
+    std::string args;  // JSON object members, without the braces
+};
+
+static auto trace_epoch = std::chrono::steady_clock::now();  // the run's start; per --daemon request
+static std::mutex trace_mutex;
+static std::vector<TraceEvent> trace_events;
+
+static long long trace_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                 trace_epoch)
+        .count();
+}
+
+// Small stable per-thread ids, so workers show up as separate tracks
+static int trace_thread_id() {
+    static std::atomic<int> next{1};
+    thread_local int id = next++;
+    return id;
+}
+
+static std::string json_escape(const std::string& text) {
+    std::string out;
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    return out;
+}
+
+// Records the time from construction to finish() or destruction as one span.
+// Costs nothing beyond a flag test unless --trace was given.
+class TraceSpan {
+public:
+    TraceSpan(const char* category, const std::string& name) : enabled_(!opt.trace.empty()) {
+        if (!enabled_)
+            return;
+        category_ = category;
+        name_ = name;
+        start_us_ = trace_now_us();
+    }
+
+    ~TraceSpan() { finish(); }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    void arg(const char* key, const std::string& value) {
+        if (enabled_)
+            add(key, "\"" + json_escape(value) + "\"");
+    }
+
+    void arg(const char* key, long long value) {
+        if (enabled_)
+            add(key, std::to_string(value));
+    }
+
+    void finish() {
+        if (!enabled_)
+            return;
+        enabled_ = false;
+        TraceEvent event{name_, category_, start_us_, trace_now_us() - start_us_, trace_thread_id(), args_};
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace_events.push_back(std::move(event));
+    }
+
+private:
+    void add(const char* key, const std::string& json) {
+        args_ += (args_.empty() ? "\"" : ",\"") + std::string(key) + "\":" + json;
+    }
+
+    bool enabled_;
+    const char* category_ = "";
+    std::string name_;
+    long long start_us_ = 0;
+    std::string args_;
+};
+
+// Writes the collected spans to the --trace file
+static bool write_trace() {
+    if (opt.trace.empty())
+        return true;
+    std::ofstream out(opt.trace, std::ios::trunc);
+    if (!out) {
+        std::fprintf(stderr, "%s: cannot write trace %s: %s\n", PROGRAM_NAME, opt.trace.c_str(),
+                     std::strerror(errno));
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\""
+        << PROGRAM_NAME << "\"}}";
+    for (const auto& event : trace_events) {
+        out << ",\n{\"name\":\"" << json_escape(event.name) << "\",\"cat\":\"" << event.category
+            << "\",\"ph\":\"X\",\"ts\":" << event.start_us << ",\"dur\":" << event.duration_us
+            << ",\"pid\":1,\"tid\":" << event.tid << ",\"args\":{" << event.args << "}}";
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+static std::mutex process_stats_mutex;
+static unsigned process_count = 0;
+static double process_seconds = 0.0;
+
+// Renders argv for verbose output; bearer tokens are masked
+static std::string describe_argv(const std::vector<std::string>& argv) {
+    std::string text;
+    for (const auto& arg : argv) {
+        std::string shown = arg;
+        auto pos = shown.find("Bearer ");
+        if (pos != std::string::npos)
+            shown = shown.substr(0, pos + 7) + "***";
+        if (!text.empty())
+            text += ' ';
+        if (shown.empty() || shown.find_first_of(" \t\"'\\$") != std::string::npos)
+            text += '\'' + shown + '\'';
+        else
+            text += shown;
+    }
+    return text;
+}
+
+// Reports a program that could not be started at all, once per program
+static void report_missing_program(const std::string& program) {
+    static std::mutex mutex;
+    static std::vector<std::string> reported;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (std::find(reported.begin(), reported.end(), program) != reported.end())
+        return;
+    reported.push_back(program);
+    std::fprintf(stderr, "%s: %s not found - please install %s\n", PROGRAM_NAME, program.c_str(),
+                 program.c_str());
+}
+
 #ifdef _WIN32
-    return "set GIT_TERMINAL_PROMPT=0 && git " + git_args;
+// Quotes one argument following the MSVCRT command-line parsing rules
+static std::string windows_quote(const std::string& arg) {
+    if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string::npos)
+        return arg;
+    std::string quoted = "\"";
+    std::size_t backslashes = 0;
+    for (char c : arg) {
+        if (c == '\\') {
+            backslashes++;
+        } else if (c == '"') {
+            quoted.append(backslashes * 2 + 1, '\\');
+            quoted += '"';
+            backslashes = 0;
+        } else {
+            quoted.append(backslashes, '\\');
+            quoted += c;
+            backslashes = 0;
+        }
+    }
+    quoted.append(backslashes * 2, '\\');
+    quoted += '"';
+    return quoted;
+}
+
+static void drain_handle(HANDLE handle,
+                         std::string& sink,
+                         const std::function<bool(const char*, std::size_t)>& on_data = nullptr) {
+    char buf[65536];
+    DWORD got;
+    while (ReadFile(handle, buf, sizeof(buf), &got, nullptr) && got > 0) {
+        if (!on_data)
+            sink.append(buf, got);
+        else if (!on_data(buf, got))
+            break;
+    }
+}
+
+static RunResult spawn_and_wait(const std::vector<std::string>& argv, const RunOptions& options) {
+    // handles are made inheritable only while this child is created, so
+    // concurrent spawns never leak pipe ends into each other
+    static std::mutex spawn_mutex;
+    RunResult result;
+
+    std::string command_line;
+    for (const auto& arg : argv)
+        command_line += (command_line.empty() ? "" : " ") + windows_quote(arg);
+
+    // environment block: current variables with overrides replaced
+    std::string env_block;
+    bool custom_env = !options.env.empty();
+    if (custom_env) {
+        LPCH current = GetEnvironmentStringsA();
+        for (LPCH var = current; *var; var += std::strlen(var) + 1) {
+            std::string entry = var;
+            bool overridden = false;
+            for (const auto& kv : options.env) {
+                if (_strnicmp(entry.c_str(), (kv.first + "=").c_str(), kv.first.size() + 1) == 0)
+                    overridden = true;
+            }
+            if (!overridden)
+                env_block += entry + '\0';
+        }
+        FreeEnvironmentStringsA(current);
+        for (const auto& kv : options.env)
+            env_block += kv.first + "=" + kv.second + '\0';
+        env_block += '\0';
+    }
+
+    SECURITY_ATTRIBUTES sa = {sizeof(sa), nullptr, FALSE};
+    HANDLE in_read = INVALID_HANDLE_VALUE, in_write = INVALID_HANDLE_VALUE;
+    HANDLE out_read = INVALID_HANDLE_VALUE, out_write = INVALID_HANDLE_VALUE;
+    HANDLE err_read = INVALID_HANDLE_VALUE, err_write = INVALID_HANDLE_VALUE;
+    HANDLE nul = CreateFileA("NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             &sa, OPEN_EXISTING, 0, nullptr);
+
+    CreatePipe(&in_read, &in_write, &sa, 0);
+    if (options.out == Stream::Capture)
+        CreatePipe(&out_read, &out_write, &sa, 0);
+    if (options.err == Stream::Capture)
+        CreatePipe(&err_read, &err_write, &sa, 0);
+
+    STARTUPINFOA si = {};
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = options.input.empty() && !options.feed ? nul : in_read;
+    si.hStdOutput = options.out == Stream::Capture ? out_write
+                    : options.out == Stream::Discard ? nul
+                                                     : GetStdHandle(STD_OUTPUT_HANDLE);
+    si.hStdError = options.err == Stream::Capture ? err_write
+                   : options.err == Stream::Discard ? nul
+                                                    : GetStdHandle(STD_ERROR_HANDLE);
+
+    PROCESS_INFORMATION pi = {};
+    BOOL started;
+    {
+        std::lock_guard<std::mutex> lock(spawn_mutex);
+        for (HANDLE h : {si.hStdInput, si.hStdOutput, si.hStdError})
+            SetHandleInformation(h, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        started = CreateProcessA(nullptr, &command_line[0], nullptr, nullptr, TRUE, 0,
+                                 custom_env ? &env_block[0] : nullptr, nullptr, &si, &pi);
+        for (HANDLE h : {in_read, out_write, err_write, nul}) {
+            if (h != INVALID_HANDLE_VALUE)
+                CloseHandle(h);
+        }
+    }
+    if (!started) {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            report_missing_program(argv[0]);
+        for (HANDLE h : {in_write, out_read, err_read}) {
+            if (h != INVALID_HANDLE_VALUE)
+                CloseHandle(h);
+        }
+        return result;
+    }
+
+    std::thread err_reader;
+    if (err_read != INVALID_HANDLE_VALUE)
+        err_reader = std::thread([&]() { drain_handle(err_read, result.err); });
+    std::thread writer([&]() {
+        if (options.feed) {
+            int fd = _open_osfhandle(reinterpret_cast<intptr_t>(in_write), 0);
+            std::FILE* in = fd >= 0 ? _fdopen(fd, "wb") : nullptr;
+            if (in) {
+                options.feed(in);
+                std::fclose(in);
+            } else if (fd >= 0) {
+                _close(fd);
+            } else {
+                CloseHandle(in_write);
+            }
+            return;
+        }
+        DWORD written;
+        WriteFile(in_write, options.input.data(), static_cast<DWORD>(options.input.size()), &written, nullptr);
+        CloseHandle(in_write);
+    });
+    if (out_read != INVALID_HANDLE_VALUE) {
+        drain_handle(out_read, result.out, options.on_out);
+        // a consumer that stopped early must not leave the child blocked
+        CloseHandle(out_read);
+        out_read = INVALID_HANDLE_VALUE;
+    }
+    writer.join();
+    if (err_reader.joinable())
+        err_reader.join();
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    DWORD code = 0;
+    GetExitCodeProcess(pi.hProcess, &code);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+    for (HANDLE h : {out_read, err_read}) {
+        if (h != INVALID_HANDLE_VALUE)
+            CloseHandle(h);
+    }
+    result.status = static_cast<int>(code);
+    return result;
+}
 #else
-    return "GIT_TERMINAL_PROMPT=0 git " + git_args;
+static bool make_pipe(int fds[2]) {
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+    return pipe2(fds, O_CLOEXEC) == 0;
+#else
+    // no pipe2 (macOS): a concurrent spawn may briefly inherit these
+    if (pipe(fds) != 0)
+        return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+static RunResult spawn_and_wait(const std::vector<std::string>& argv, const RunOptions& options) {
+    RunResult result;
+
+    std::vector<char*> args;
+    for (const auto& arg : argv)
+        args.push_back(const_cast<char*>(arg.c_str()));
+    args.push_back(nullptr);
+
+    // environment: current variables with overrides replaced
+    std::vector<std::string> env_strings;
+    for (char** var = environ; *var; var++) {
+        bool overridden = false;
+        for (const auto& kv : options.env) {
+            if (std::strncmp(*var, kv.first.c_str(), kv.first.size()) == 0 && (*var)[kv.first.size()] == '=')
+                overridden = true;
+        }
+        if (!overridden)
+            env_strings.push_back(*var);
+    }
+    for (const auto& kv : options.env)
+        env_strings.push_back(kv.first + "=" + kv.second);
+    std::vector<char*> envp;
+    for (auto& entry : env_strings)
+        envp.push_back(const_cast<char*>(entry.c_str()));
+    envp.push_back(nullptr);
+
+    int in_pipe[2] = {-1, -1}, out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+    if (((!options.input.empty() || options.feed) && !make_pipe(in_pipe)) ||
+        (options.out == Stream::Capture && !make_pipe(out_pipe)) ||
+        (options.err == Stream::Capture && !make_pipe(err_pipe))) {
+        for (int fd : {in_pipe[0], in_pipe[1], out_pipe[0], out_pipe[1], err_pipe[0], err_pipe[1]}) {
+            if (fd >= 0)
+                close(fd);
+        }
+        std::fprintf(stderr, "%s: pipe failed: %s\n", PROGRAM_NAME, std::strerror(errno));
+        return result;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_pipe[0] >= 0)
+        posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (options.out == Stream::Capture)
+        posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    else if (options.out == Stream::Discard)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    if (options.err == Stream::Capture)
+        posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+    else if (options.err == Stream::Discard)
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    int rc = posix_spawnp(&pid, args[0], &actions, nullptr, args.data(), envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    for (int fd : {in_pipe[0], out_pipe[1], err_pipe[1]}) {
+        if (fd >= 0)
+            close(fd);
+    }
+    if (rc != 0) {
+        for (int fd : {in_pipe[1], out_pipe[0], err_pipe[0]}) {
+            if (fd >= 0)
+                close(fd);
+        }
+        if (rc == ENOENT)
+            report_missing_program(argv[0]);
+        else
+            std::fprintf(stderr, "%s: cannot run %s: %s\n", PROGRAM_NAME, argv[0].c_str(), std::strerror(rc));
+        return result;
+    }
+
+    // shuttle stdin/stdout/stderr until the child closes its ends
+    std::size_t input_sent = 0;
+    int in_fd = in_pipe[1], out_fd = out_pipe[0], err_fd = err_pipe[0];
+    std::thread feeder;
+    if (options.feed) {
+        feeder = std::thread([&options, fd = in_fd]() {
+            std::FILE* in = fdopen(fd, "wb");
+            if (!in) {
+                close(fd);
+                return;
+            }
+            options.feed(in);
+            std::fclose(in);
+        });
+        in_fd = -1;
+    }
+    if (in_fd >= 0)
+        fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+    char buf[65536];
+    while (in_fd >= 0 || out_fd >= 0 || err_fd >= 0) {
+        std::vector<pollfd> fds;
+        if (in_fd >= 0)
+            fds.push_back({in_fd, POLLOUT, 0});
+        if (out_fd >= 0)
+            fds.push_back({out_fd, POLLIN, 0});
+        if (err_fd >= 0)
+            fds.push_back({err_fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (const auto& p : fds) {
+            if (!p.revents)
+                continue;
+            if (p.fd == in_fd) {
+                ssize_t n = write(in_fd, options.input.data() + input_sent, options.input.size() - input_sent);
+                if (n > 0)
+                    input_sent += static_cast<std::size_t>(n);
+                if ((n < 0 && errno != EAGAIN && errno != EINTR) || input_sent == options.input.size()) {
+                    close(in_fd);
+                    in_fd = -1;
+                }
+            } else {
+                ssize_t n = read(p.fd, buf, sizeof(buf));
+                if (n > 0 && p.fd == out_fd && options.on_out) {
+                    if (!options.on_out(buf, static_cast<std::size_t>(n))) {
+                        close(out_fd);
+                        out_fd = -1;
+                    }
+                } else if (n > 0) {
+                    (p.fd == out_fd ? result.out : result.err).append(buf, static_cast<std::size_t>(n));
+                } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    close(p.fd);
+                    (p.fd == out_fd ? out_fd : err_fd) = -1;
+                }
+            }
+        }
+    }
+
+    if (feeder.joinable())
+        feeder.join();
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return result;
+    }
+    result.status = exit_status_of(status);
+    return result;
+}
+#endif
+
+// Runs ARGV to completion. Never goes through a shell.
+static RunResult run_process(const std::vector<std::string>& argv, const RunOptions& options = RunOptions()) {
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, describe_argv(argv).c_str());
+
+    // spans are named after the program and its subcommand, e.g. "git fetch"
+    std::string label = argv[0];
+    for (std::size_t i = 1; i < argv.size(); i++) {
+        if (argv[i] == "-C" || argv[i] == "-c") {
+            i++;
+        } else if (argv[i][0] != '-' && argv[0] == "git") {
+            label += " " + argv[i];
+            break;
+        }
+    }
+    TraceSpan span("process", label);
+    span.arg("command", describe_argv(argv));
+
+    std::size_t streamed = 0;
+    RunOptions counted = options;
+    if (options.on_out) {
+        counted.on_out = [&](const char* data, std::size_t size) {
+            streamed += size;
+            return options.on_out(data, size);
+        };
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    RunResult result = spawn_and_wait(argv, counted);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    span.arg("status", result.status);
+    if (options.out == Stream::Capture)
+        span.arg("stdout_bytes", static_cast<long long>(options.on_out ? streamed : result.out.size()));
+
+    {
+        std::lock_guard<std::mutex> lock(process_stats_mutex);
+        process_count++;
+        process_seconds += result.seconds;
+    }
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: %s exited %d after %.3fs\n", PROGRAM_NAME, argv[0].c_str(), result.status,
+                     result.seconds);
+    return result;
+}
+
+// Summarizes child-process wall time for verbose runs
+static void report_process_stats() {
+    if (!opt.verbose)
+        return;
+    std::lock_guard<std::mutex> lock(process_stats_mutex);
+    std::fprintf(stderr, "%s: %u child process%s, %.3fs total wall time\n", PROGRAM_NAME, process_count,
+                 process_count == 1 ? "" : "es", process_seconds);
+}
+
+// Starts the trace and the child-process totals afresh for a --daemon request
+static void reset_run_stats() {
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace_events.clear();
+        trace_epoch = std::chrono::steady_clock::now();
+    }
+    std::lock_guard<std::mutex> lock(process_stats_mutex);
+    process_count = 0;
+    process_seconds = 0.0;
+}
+
+// The scheme, host and port of URL, lowercased
+static std::string url_origin(const std::string& url) {
+    std::size_t scheme = url.find("://");
+    std::size_t end = url.find_first_of("/?#", scheme == std::string::npos ? 0 : scheme + 3);
+    std::string origin = url.substr(0, end);
+    std::transform(origin.begin(), origin.end(), origin.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return origin;
+}
+
+// GITHUB_TOKEN, if it is set and URL is on one of GitHub's own servers or an
+// origin listed in SIP_TOKEN_ORIGINS: a mirror named by a base URL does not
+// see the token unless it is listed there
+static const char* github_token(const std::string& url) {
+    const char* token = std::getenv("GITHUB_TOKEN");
+    if (!token || !*token)
+        return nullptr;
+    std::string origin = url_origin(url);
+    for (const char* github : {"https://github.com", "https://api.github.com", "https://raw.githubusercontent.com",
+                               "https://codeload.github.com"}) {
+        if (origin == github)
+            return token;
+    }
+    const char* listed = std::getenv("SIP_TOKEN_ORIGINS");
+    std::istringstream origins(listed ? listed : "");
+    std::string allowed;
+    while (origins >> allowed) {
+        if (url_origin(allowed) == origin)
+            return token;
+    }
+    return nullptr;
+}
+
+// `-H Authorization: ...` for a curl run against URL, when it gets the token
+static std::vector<std::string> curl_auth_args(const std::string& url) {
+    const char* token = github_token(url);
+    if (!token)
+        return {};
+    return {"-H", std::string("Authorization: Bearer ") + token};
+}
+
+// Threads for file-level work (copying, hashing, git's checkout workers):
+// -j when given, else the core count capped at 8
+static std::size_t io_workers() {
+    if (opt.jobs_set)
+        return static_cast<std::size_t>(opt.jobs);
+    return std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, 8);
+}
+
+// `-c checkout.workers=N` with -j, so that git writes the checked-out files
+// on N workers instead of one
+static std::vector<std::string> git_checkout_args() {
+    if (!opt.jobs_set)
+        return {};
+    return {"-c", "checkout.workers=" + std::to_string(opt.jobs)};
+}
+
+// Calls FN(i) for every i < COUNT on up to WORKERS threads, the caller's
+// included. Indices are claimed one at a time from a shared cursor, so a
+// thread that finishes early keeps taking work left by slower ones.
+static void parallel_for(std::size_t count, std::size_t workers, const std::function<void(std::size_t)>& fn) {
+    std::atomic<std::size_t> next{0};
+    auto worker = [&]() {
+        for (std::size_t i = next++; i < count; i = next++)
+            fn(i);
+    };
+    workers = std::min(workers, count);
+    std::vector<std::thread> pool;
+    for (std::size_t i = 1; i < workers; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool)
+        t.join();
+}
+
+// The parts of an HTTP response head that ranged downloads look at
+struct ResponseHead {
+    long status = 0;
+    std::string etag, last_modified, content_range, location;
+
+    // Takes one header line, line break removed; a status line starts afresh
+    void add(const std::string& line) {
+        std::size_t colon = line.find(':');
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        if (name.rfind("http/", 0) == 0) {
+            *this = ResponseHead();
+            status = std::atol(line.substr(std::min(line.find(' '), line.size())).c_str());
+            return;
+        }
+        if (colon == std::string::npos)
+            return;
+        std::size_t at = line.find_first_not_of(" \t", colon + 1);
+        std::string value = at == std::string::npos ? "" : line.substr(at);
+        if (name == "etag")
+            etag = value;
+        else if (name == "last-modified")
+            last_modified = value;
+        else if (name == "content-range")
+            content_range = value;
+        else if (name == "location")
+            location = value;
+    }
+
+    // Whether this is the head of the response with the body, not of an
+    // interim response or a redirect that is followed
+    bool is_final() const { return status >= 200 && !(status >= 300 && status < 400 && !location.empty()); }
+
+    // Whether this is a 206 for the bytes from FIRST of a SIZE-byte file
+    bool range_from(std::uint64_t first, std::uint64_t size) const {
+        unsigned long long start = 0, end = 0, total = 0;
+        return status == 206 && std::sscanf(content_range.c_str(), "bytes %llu-%llu/%llu", &start, &end, &total) == 3 &&
+               start == first && total == size;
+    }
+};
+
+// Reads `curl -D -` output: the head of each response, redirects and failed
+// attempts included, then the body of the final one. ON_HEAD sees every final
+// head and may stop the transfer; a body follows one below 400 (as -f has it)
+// and goes to ON_BODY.
+class CurlHeadReader {
+public:
+    std::function<bool(const ResponseHead&)> on_head;
+    std::function<bool(const char*, std::size_t)> on_body;
+
+    bool feed(const char* data, std::size_t size) {
+        while (size > 0 && !in_body_) {
+            const char* newline = static_cast<const char*>(std::memchr(data, '\n', size));
+            std::size_t take = newline ? static_cast<std::size_t>(newline - data) + 1 : size;
+            line_.append(data, take);
+            data += take;
+            size -= take;
+            if (!newline)
+                return true;
+            std::string line = rtrim(line_);
+            line_.clear();
+            if (!line.empty()) {
+                head_.add(line);
+            } else if (head_.is_final()) {
+                if (on_head && !on_head(head_))
+                    return false;
+                in_body_ = head_.status < 400;
+            }
+        }
+        return size == 0 || !on_body || on_body(data, size);
+    }
+
+private:
+    ResponseHead head_;
+    std::string line_;
+    bool in_body_ = false;
+};
+
+#ifdef SIP_WITH_LIBCURL
+// Built-in HTTP transport (make WITH_LIBCURL=1). Raw files and the default
+// branch lookup go through one libcurl multi handle, driven by a background
+// thread, so all requests of a run share its DNS cache and keep-alive
+// connections, multiplexed over HTTP/2 where the server offers it. Without
+// it, every request is a curl or git child with its own DNS lookup, TCP
+// connect and TLS handshake.
+
+// One GET for HttpClient::fetch(). The body goes to OUTPUT ("-" is stdout),
+// or into BODY when OUTPUT is empty.
+struct HttpRequest {
+    explicit HttpRequest(std::string url, std::string output = "") : url(std::move(url)), output(std::move(output)) {}
+
+    std::string url;
+    std::string output;
+    std::string body;
+    std::string post;                  // sent as a POST when not empty
+    std::vector<std::string> headers;  // "Name: value" lines added to the request
+    bool send_token = true;            // GITHUB_TOKEN may go along (see github_token())
+    // takes the body as it arrives instead of OUTPUT; false aborts the transfer
+    std::function<bool(const char*, std::size_t)> on_data;
+    std::string range;  // "FIRST-LAST" bytes to ask for, when not empty
+    // sees the final response's head before its body; false ends the transfer
+    // there, which is not an error
+    std::function<bool(const ResponseHead&)> on_head;
+    std::string effective_url;  // URL after redirects
+    bool stall_timeout = false;        // --timeout bounds stalls, not the whole transfer
+    long status = 0;    // HTTP status of the final attempt, 0 if none arrived
+    std::string error;  // transport failure, empty once a response arrived
+    // phases of the final attempt in microseconds, each counted from its start
+    long long dns_us = 0, connect_us = 0, tls_us = 0, ttfb_us = 0, total_us = 0;
+    bool reused = false;  // went over a connection opened earlier
+
+    bool ok() const { return error.empty() && status < 400; }
+};
+
+class HttpClient {
+public:
+    static HttpClient& instance() {
+        static HttpClient client;
+        return client;
+    }
+
+    // Runs REQUESTS concurrently and returns once all are done. Timeouts and
+    // 408, 429 and 5xx answers are retried like `curl --retry 3 --retry-delay 1`.
+    void fetch(const std::vector<HttpRequest*>& requests) {
+        std::vector<Transfer> transfers(requests.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            max_host_connections_ = std::max(opt.jobs, 1);  // -j of this run; a --daemon serves many
+            for (std::size_t i = 0; i < requests.size(); i++) {
+                transfers[i].request = requests[i];
+                transfers[i].start_us = trace_now_us();
+                queue_.push_back(&transfers[i]);
+            }
+        }
+        curl_multi_wakeup(multi_);
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&]() {
+            return std::all_of(transfers.begin(), transfers.end(), [](const Transfer& t) { return t.done; });
+        });
+        lock.unlock();
+        for (const auto& transfer : transfers)
+            report(transfer);
+    }
+
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
+
+private:
+    struct Transfer {
+        HttpRequest* request = nullptr;
+        CURL* easy = nullptr;
+        std::FILE* file = nullptr;
+        curl_slist* headers = nullptr;  // when the request has its own
+        int attempts = 0;
+        std::chrono::steady_clock::time_point due;
+        long long start_us = 0;
+        long long end_us = 0;
+        bool done = false;
+        bool streamed = false;  // on_data has taken part of the body
+        bool stopped = false;   // on_head ended the transfer
+        ResponseHead head;
+    };
+
+    HttpClient() {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        multi_ = curl_multi_init();
+        curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~HttpClient() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        curl_multi_wakeup(multi_);
+        thread_.join();
+        curl_multi_cleanup(multi_);
+        curl_global_cleanup();
+    }
+
+    static std::size_t on_data(char* data, std::size_t size, std::size_t count, void* user) {
+        Transfer* transfer = static_cast<Transfer*>(user);
+        HttpRequest* request = transfer->request;
+        std::size_t bytes = size * count;
+        if (request->on_data) {
+            transfer->streamed = true;
+            return request->on_data(data, bytes) ? bytes : 0;
+        }
+        if (request->output.empty()) {
+            request->body.append(data, bytes);
+            return bytes;
+        }
+        // opened on the first byte, so a failed request leaves no file behind
+        if (!transfer->file)
+            transfer->file = request->output == "-" ? stdout : std::fopen(request->output.c_str(), "wb");
+        return transfer->file ? std::fwrite(data, 1, bytes, transfer->file) : 0;
+    }
+
+    static std::size_t on_header(char* data, std::size_t size, std::size_t count, void* user) {
+        Transfer* transfer = static_cast<Transfer*>(user);
+        std::size_t bytes = size * count;
+        std::string line = rtrim(std::string(data, bytes));
+        if (!line.empty()) {
+            transfer->head.add(line);
+        } else if (transfer->head.is_final() && !transfer->request->on_head(transfer->head)) {
+            transfer->stopped = true;
+            return 0;
+        }
+        return bytes;
+    }
+
+    void start(Transfer* transfer) {
+        transfer->attempts++;
+        transfer->head = ResponseHead();
+        transfer->easy = curl_easy_init();
+        CURL* easy = transfer->easy;
+        curl_easy_setopt(easy, CURLOPT_URL, transfer->request->url.c_str());
+        curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+        HttpRequest* request = transfer->request;
+        if (request->stall_timeout) {
+            curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, static_cast<long>(opt.timeout));
+            curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+            curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, static_cast<long>(opt.timeout));
+        } else {
+            curl_easy_setopt(easy, CURLOPT_TIMEOUT, static_cast<long>(opt.timeout));
+        }
+        curl_easy_setopt(easy, CURLOPT_USERAGENT, (std::string(PROGRAM_NAME) + "/" + PROGRAM_VERSION).c_str());
+        if (!request->post.empty()) {
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDS, request->post.c_str());
+            curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(request->post.size()));
+        }
+        const char* token = request->send_token ? github_token(request->url) : nullptr;
+        if (token)
+            transfer->headers =
+                curl_slist_append(transfer->headers, (std::string("Authorization: Bearer ") + token).c_str());
+        for (const auto& header : request->headers)
+            transfer->headers = curl_slist_append(transfer->headers, header.c_str());
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, on_data);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer);
+        if (!request->range.empty())
+            curl_easy_setopt(easy, CURLOPT_RANGE, request->range.c_str());
+        if (request->on_head) {
+            curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, on_header);
+            curl_easy_setopt(easy, CURLOPT_HEADERDATA, transfer);
+        }
+        curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+        curl_multi_add_handle(multi_, easy);
+    }
+
+    // Called on the driver thread with mutex_ held
+    void complete(Transfer* transfer, CURLcode code) {
+        HttpRequest* request = transfer->request;
+        CURL* easy = transfer->easy;
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &request->status);
+        char* effective = nullptr;
+        if (curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &effective) == CURLE_OK && effective)
+            request->effective_url = effective;
+        curl_off_t dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0;
+        long connects = 0;
+        curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+        curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &tls);
+        curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+        curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total);
+        curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+        // libcurl reports cumulative times; each phase is kept on its own
+        request->dns_us = dns;
+        request->connect_us = connect > dns ? connect - dns : 0;
+        request->tls_us = tls > connect ? tls - connect : 0;
+        request->ttfb_us = ttfb > std::max(tls, connect) ? ttfb - std::max(tls, connect) : 0;
+        request->total_us = total;
+        request->reused = connects == 0;
+        curl_multi_remove_handle(multi_, easy);
+        curl_easy_cleanup(easy);
+        transfer->easy = nullptr;
+        curl_slist_free_all(transfer->headers);
+        transfer->headers = nullptr;
+
+        bool output_file = transfer->file && transfer->file != stdout;
+        bool transient = code == CURLE_OPERATION_TIMEDOUT || request->status == 408 || request->status == 429 ||
+                         request->status == 500 || request->status == 502 || request->status == 503 ||
+                         request->status == 504;
+        if (transfer->stopped && code == CURLE_WRITE_ERROR)
+            code = CURLE_OK;
+        bool failed = code != CURLE_OK;
+        if (output_file && std::fclose(transfer->file) != 0 && !failed) {
+            code = CURLE_WRITE_ERROR;
+            failed = true;
+        }
+        transfer->file = transfer->file == stdout ? stdout : nullptr;
+        if (failed && output_file) {
+            std::error_code ec;
+            std::filesystem::remove(request->output, ec);
+        }
+        // what already went to stdout cannot be taken back
+        if (failed && transient && transfer->attempts <= 3 && transfer->file != stdout && !transfer->streamed) {
+            request->body.clear();
+            transfer->due = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            queue_.push_back(transfer);
+            return;
+        }
+        if (code != CURLE_OK && code != CURLE_HTTP_RETURNED_ERROR)
+            request->error = curl_easy_strerror(code);
+        transfer->end_us = trace_now_us();
+        transfer->done = true;
+        done_.notify_all();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        long applied_max_host_connections = 0;
+        while (!stop_) {
+            if (applied_max_host_connections != max_host_connections_) {
+                applied_max_host_connections = max_host_connections_;
+                curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS, applied_max_host_connections);
+            }
+            auto now = std::chrono::steady_clock::now();
+            long wait_ms = 1000;
+            for (auto it = queue_.begin(); it != queue_.end();) {
+                if ((*it)->due <= now) {
+                    start(*it);
+                    it = queue_.erase(it);
+                } else {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>((*it)->due - now).count();
+                    wait_ms = std::min<long>(wait_ms, static_cast<long>(left) + 1);
+                    ++it;
+                }
+            }
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+            int left = 0;
+            while (CURLMsg* message = curl_multi_info_read(multi_, &left)) {
+                if (message->msg != CURLMSG_DONE)
+                    continue;
+                char* transfer = nullptr;
+                curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &transfer);
+                complete(reinterpret_cast<Transfer*>(transfer), message->data.result);
+            }
+            lock.unlock();
+            curl_multi_poll(multi_, nullptr, 0, static_cast<int>(wait_ms), nullptr);
+            lock.lock();
+        }
+    }
+
+    // -v shows where the time of each request went; --trace gets a span
+    void report(const Transfer& transfer) {
+        const HttpRequest& request = *transfer.request;
+        const char* method = request.post.empty() ? "GET" : "POST";
+        if (opt.verbose)
+            std::fprintf(stderr,
+                         "%s: %s %s: %ld%s%s in %.1f ms (dns %.1f, connect %.1f, tls %.1f, ttfb %.1f; %s)\n",
+                         PROGRAM_NAME, method, request.url.c_str(), request.status,
+                         request.error.empty() ? "" : ", ", request.error.c_str(), request.total_us / 1000.0, request.dns_us / 1000.0,
+                         request.connect_us / 1000.0, request.tls_us / 1000.0, request.ttfb_us / 1000.0,
+                         request.reused ? "reused connection" : "new connection");
+        if (opt.trace.empty())
+            return;
+        std::string args = "\"url\":\"" + json_escape(request.url) + "\",\"status\":" +
+                           std::to_string(request.status) + ",\"dns_us\":" + std::to_string(request.dns_us) +
+                           ",\"connect_us\":" + std::to_string(request.connect_us) +
+                           ",\"tls_us\":" + std::to_string(request.tls_us) +
+                           ",\"ttfb_us\":" + std::to_string(request.ttfb_us) +
+                           ",\"attempts\":" + std::to_string(transfer.attempts) +
+                           ",\"reused\":" + (request.reused ? "true" : "false");
+        TraceEvent event{method, "http", transfer.start_us, transfer.end_us - transfer.start_us,
+                         trace_thread_id(), args};
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace_events.push_back(std::move(event));
+    }
+
+    CURLM* multi_ = nullptr;
+    std::mutex mutex_;
+    std::condition_variable done_;
+    std::deque<Transfer*> queue_;  // waiting to start, or to be retried
+    long max_host_connections_ = 1;
+    bool stop_ = false;
+    std::thread thread_;
+};
 #endif
+
+// Runs git with ARGS. Prompts are disabled: sip never runs interactively.
+static RunResult run_git(const std::vector<std::string>& args, RunOptions options = RunOptions()) {
+    std::vector<std::string> argv = {"git"};
+    argv.insert(argv.end(), args.begin(), args.end());
+    options.env.emplace_back("GIT_TERMINAL_PROMPT", "0");
+    return run_process(argv, options);
+}
+
+// Runs git and returns its trimmed stdout, or "" if it failed
+static std::string git_output(const std::vector<std::string>& args) {
+    RunOptions options;
+    options.out = Stream::Capture;
+    options.err = Stream::Discard;
+    RunResult result = run_git(args, options);
+    return result.status == 0 ? rtrim(result.out) : "";
 }
 
 static bool looks_like_commit_sha(const std::string& ref) {
@@ -78,7 +1210,8 @@ static bool path_available_for_write(const std::string& p) {
     auto dir = x.parent_path();
     if (!dir.empty() && !std::filesystem::exists(dir)) {
         std::error_code ec;
-        if (!std::filesystem::create_directories(dir, ec)) {
+        // another manifest worker may create the same parent concurrently
+        if (!std::filesystem::create_directories(dir, ec) && !std::filesystem::is_directory(dir)) {
             std::fprintf(stderr, "%s: mkdir failed: %s\n", PROGRAM_NAME, ec.message().c_str());
             return false;
         }
@@ -86,20 +1219,186 @@ static bool path_available_for_write(const std::string& p) {
     return true;
 }
 
+// --- include/exclude filters ---
+//
+// --include/--exclude globs select files inside downloaded directories, with
+// gitignore meaning: '*' and '?' stay within one path component, "**/" spans
+// any number of them, and a glob without a '/' is matched against every
+// component, so "build" also covers everything under a build directory.
+// Globs with a '/' are anchored at the downloaded directory.
+
+static bool glob_match(const char* pattern, const char* text) {
+    for (; *pattern; pattern++, text++) {
+        if (pattern[0] == '*' && pattern[1] == '*' && (pattern[2] == '/' || pattern[2] == '\0')) {
+            if (pattern[2] == '\0')
+                return true;
+            // "**/" matches nothing, or any run of whole components
+            for (const char* rest = text;; rest++) {
+                if ((rest == text || rest[-1] == '/') && glob_match(pattern + 3, rest))
+                    return true;
+                if (!*rest)
+                    return false;
+            }
+        }
+        if (*pattern == '*') {
+            for (const char* rest = text;; rest++) {
+                if (glob_match(pattern + 1, rest))
+                    return true;
+                if (!*rest || *rest == '/')
+                    return false;
+            }
+        }
+        if (!*text)
+            return false;
+        if ((*pattern == '?' || *pattern == '[') && *text == '/')
+            return false;
+        if (*pattern == '?')
+            continue;
+        if (*pattern == '[') {
+            const char* p = pattern + 1;
+            bool negate = *p == '!' || *p == '^';
+            if (negate)
+                p++;
+            bool found = false;
+            for (bool first = true; *p && (first || *p != ']'); p++, first = false) {
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                    found = found || (*text >= p[0] && *text <= p[2]);
+                    p += 2;
+                } else {
+                    found = found || *text == *p;
+                }
+            }
+            if (!*p)
+                return false;  // unterminated class
+            if (found == negate)
+                return false;
+            pattern = p;
+            continue;
+        }
+        if (*pattern == '\\' && pattern[1])
+            pattern++;
+        if (*pattern != *text)
+            return false;
+    }
+    return *text == '\0';
+}
+
+// Whether GLOB covers REL (a path relative to the downloaded directory), by
+// itself or through one of its parent directories
+static bool filter_matches(std::string glob, const std::string& rel) {
+    while (glob.size() > 1 && glob.back() == '/')
+        glob.pop_back();
+    bool anchored = glob.find('/') != std::string::npos;
+    if (anchored && glob[0] == '/')
+        glob.erase(0, 1);
+    std::size_t start = 0;
+    for (;;) {
+        std::size_t end = rel.find('/', start);
+        std::string prefix = rel.substr(0, end);
+        std::string component = prefix.substr(start);
+        if (glob_match(glob.c_str(), anchored ? prefix.c_str() : component.c_str()))
+            return true;
+        if (end == std::string::npos)
+            return false;
+        start = end + 1;
+    }
+}
+
+static bool filters_active() {
+    return !opt.includes.empty() || !opt.excludes.empty();
+}
+
+// Whether the file at REL inside a downloaded directory is kept
+static bool path_selected(const std::string& rel) {
+    bool included = opt.includes.empty();
+    for (const auto& glob : opt.includes)
+        included = included || filter_matches(glob, rel);
+    if (!included)
+        return false;
+    for (const auto& glob : opt.excludes) {
+        if (filter_matches(glob, rel))
+            return false;
+    }
+    return true;
+}
+
+// Non-cone sparse-checkout patterns selecting the same files below DIR
+static std::vector<std::string> sparse_filter_patterns(const std::string& dir) {
+    auto pattern = [&dir](std::string glob) {
+        while (glob.size() > 1 && glob.back() == '/')
+            glob.pop_back();
+        if (glob.find('/') == std::string::npos)
+            return "/" + dir + "/**/" + glob;
+        return "/" + dir + "/" + (glob[0] == '/' ? glob.substr(1) : glob);
+    };
+    std::vector<std::string> patterns;
+    if (opt.includes.empty())
+        patterns.push_back("/" + dir + "/");
+    for (const auto& glob : opt.includes)
+        patterns.push_back(pattern(glob));
+    for (const auto& glob : opt.excludes)
+        patterns.push_back("!" + pattern(glob));
+    return patterns;
+}
+
+// Server locations default to GitHub; --git-base-url, --raw-base-url and
+// --tarball-base-url, or else the SIP_*_BASE_URL variables, point sip at a
+// mirror or a local stand-in (file:// works for git and raw files).
+static std::string base_url(const std::string& option, const char* variable, const char* fallback) {
+    const char* value = std::getenv(variable);
+    std::string url = !option.empty() ? option : value && *value ? value : fallback;
+    while (!url.empty() && url.back() == '/')
+        url.pop_back();
+    return url;
+}
+
+// URL of PATH at REF on the raw file server. A base containing '{' is a
+// template whose {owner}, {repo}, {ref} and {path} are filled in; any other
+// base has /OWNER/REPO/REF/PATH appended, as raw.githubusercontent.com wants.
+static std::string raw_file_url(const std::string& owner,
+                                const std::string& repo,
+                                const std::string& ref,
+                                const std::string& path) {
+    std::string base = base_url(opt.raw_base_url, "SIP_RAW_BASE_URL", "https://raw.githubusercontent.com");
+    if (base.find('{') == std::string::npos)
+        return base + "/" + owner + "/" + repo + "/" + ref + "/" + path;
+    std::string url;
+    for (std::size_t i = 0; i < base.size(); i++) {
+        std::size_t end = base.find('}', i);
+        std::string name = base[i] == '{' && end != std::string::npos ? base.substr(i + 1, end - i - 1) : "";
+        const std::string* value = name == "owner" ? &owner
+                                   : name == "repo"  ? &repo
+                                   : name == "ref"   ? &ref
+                                   : name == "path"  ? &path
+                                                     : nullptr;
+        if (value) {
+            url += *value;
+            i = end;
+        } else {
+            url += base[i];
+        }
+    }
+    return url;
+}
+
 static bool parse_github_url(const std::string& url_or_repo, std::string& owner, std::string& repo, std::string& path, std::string& branch) {
     // Handle GitHub URLs like:
     // https://github.com/owner/repo
     // https://github.com/owner/repo/tree/branch/path
     // https://github.com/owner/repo/blob/branch/path
     // https://github.com/owner/repo.git
+    // the same below the --git-base-url mirror
     // owner/repo
     // owner/repo/path
     
     std::string input = url_or_repo;
     
     const std::string github_prefix = "https://github.com/";
+    const std::string mirror_prefix = base_url(opt.git_base_url, "SIP_GIT_BASE_URL", "https://github.com") + "/";
     if (input.rfind(github_prefix, 0) == 0) {
         input = input.substr(github_prefix.length());
+    } else if (input.rfind(mirror_prefix, 0) == 0) {
+        input = input.substr(mirror_prefix.length());
     }
     
     if (input.length() > 4 && input.substr(input.length() - 4) == ".git") {
@@ -163,86 +1462,152 @@ static bool parse_github_url(const std::string& url_or_repo, std::string& owner,
     return true;
 }
 
-void usage(int status) {
+// Prints the help, or the hint after a usage error; returns STATUS
+int usage(int status) {
     if (status != EXIT_SUCCESS) {
         std::fprintf(stderr, "Try '%s --help' for more information.\n", PROGRAM_NAME);
     } else {
-        std::printf("Usage: %s [OPTION]... OWNER/REPO [PATH]\n", PROGRAM_NAME);
+        std::printf("Usage: %s [OPTION]... OWNER/REPO [PATH]...\n", PROGRAM_NAME);
+        std::printf("  or:  %s [OPTION]... --manifest=FILE\n", PROGRAM_NAME);
         std::printf("Download files and directories from GitHub repositories.\n\n");
         std::printf("Options:\n");
-        std::printf("  -o, --output-dir=DIR     write output to DIR\n");
+        std::printf("  -o, --output-dir=DIR     write output to DIR ('-' streams to stdout: a file as is,\n");
+        std::printf("                           a directory or repository as tar)\n");
         std::printf(
             "  -b, --branch=REF         branch, tag, or commit (auto-detected if not specified)\n");
         std::printf("  -t, --timeout=SECONDS    download timeout (default: 10)\n");
         std::printf("  -q, --quiet              suppress output\n");
         std::printf("  -v, --verbose            verbose output (conflicts with --quiet)\n");
+        std::printf("  -m, --manifest=FILE      download every entry listed in FILE ('-' for stdin)\n");
+        std::printf("  -p, --path=PATH          add PATH to download (repeatable)\n");
+        std::printf("  -j, --jobs=N             parallel workers for manifests and multiple paths (default: 4),\n");
+        std::printf("                           git checkout and file copies (default: git 1, copies per core)\n");
+        std::printf("      --cache              keep partial clones in the default cache directory\n");
+        std::printf("      --cache-dir=DIR      keep partial clones under DIR\n");
+        std::printf("      --cache-size=SIZE    evict least-recently-used repos above SIZE (default: 2G)\n");
+        std::printf("      --ref-ttl=SECONDS    reuse resolved branches/commits this long (default: 300, 0 = off)\n");
+        std::printf("      --refresh            ignore cached ref resolutions\n");
+        std::printf("      --engine=ENGINE      download directories with git (default), tarball, or objects\n");
+        std::printf("                           (blobs written from a bare object store, no checkout)\n");
+        std::printf("      --compress=METHOD    compress '-o -' tar streams with none (default) or zstd\n");
+        std::printf("      --segments=N         fetch a large file as N byte ranges at once, resumable\n");
+        std::printf("                           (default: 1)\n");
+        std::printf("      --sha256=HEX         check the downloaded file against this SHA-256\n");
+        std::printf("      --no-lfs             keep Git LFS pointers instead of fetching their objects\n");
+        std::printf("      --strategy=STRATEGY  path (default) or auto: size directories from their trees and\n");
+        std::printf("                           fetch them by raw requests, sparse checkout or full fetch\n");
+        std::printf("      --trees=TREES        fetch all (default) trees of the commit for directories, or\n");
+        std::printf("                           only the path's: one request per level, then the subtree\n");
+        std::printf("      --include=GLOB       in directories, keep only files matching GLOB (repeatable)\n");
+        std::printf("      --exclude=GLOB       in directories, skip files matching GLOB (repeatable)\n");
+        std::printf("      --prefetch-batch=N   fetch directory blobs N per request before checkout\n");
+        std::printf("                           (default: 20000, 0 = let git fetch them lazily)\n");
+        std::printf("      --git-base-url=URL   git server for OWNER/REPO (file:// works)\n");
+        std::printf("      --raw-base-url=URL   raw file server, or a template using {owner}, {repo},\n");
+        std::printf("                           {ref} and {path}\n");
+        std::printf("      --tarball-base-url=URL\n");
+        std::printf("                           tarball server for OWNER/REPO\n");
+        std::printf("      --trace=FILE         write phase and process timings to FILE (Chrome trace JSON)\n");
+        std::printf("      --sync               update an earlier download in place, writing only changes\n");
+        std::printf("      --store=DIR          share identical files across outputs via a blob store in DIR\n");
+        std::printf("      --store-links        hardlink store files where reflinks are unsupported\n");
+        std::printf("      --store-gc           remove unused objects from the blob store and exit\n");
+        std::printf("      --store-stats        show blob store size and dedup ratio and exit\n");
+        std::printf("      --daemon=SOCKET      serve requests on a Unix socket, keeping connections warm\n");
+        std::printf("      --connect=SOCKET     run this request in the daemon at SOCKET\n");
         std::printf("      --help               show this help\n");
         std::printf("      --version            show version\n\n");
         std::printf("Environment:\n");
-        std::printf("  GITHUB_TOKEN             authenticate with private repositories\n\n");
+        std::printf("  GITHUB_TOKEN             authenticate with private repositories\n");
+        std::printf("  SIP_TOKEN_ORIGINS        origins besides GitHub's that get GITHUB_TOKEN, e.g. a\n");
+        std::printf("                           mirror named by a base URL (space-separated)\n");
+        std::printf("  SIP_CACHE_DIR            enable the object cache in this directory\n");
+        std::printf("  SIP_STORE_DIR            enable the blob store in this directory\n");
+        std::printf("  SIP_GIT_BASE_URL         git server (default: https://github.com)\n");
+        std::printf("  SIP_RAW_BASE_URL         raw file server (default: https://raw.githubusercontent.com)\n");
+        std::printf("  SIP_TARBALL_BASE_URL     tarball server (default: https://codeload.github.com)\n");
+        std::printf("  SIP_API_BASE_URL         GitHub REST API for --strategy=auto (default:\n");
+        std::printf("                           https://api.github.com, used when the git server is GitHub)\n\n");
         std::printf("Examples:\n");
         std::printf("  sip https://github.com/torvalds/linux/tree/master/LICENSES\n");
         std::printf("  sip torvalds/linux LICENSE\n");
         std::printf("  sip torvalds/linux/tree/v5.10/Documentation\n");
         std::printf("  sip -b v2.6.39 torvalds/linux Makefile\n");
         std::printf("  sip -o /tmp/linux torvalds/linux\n");
+        std::printf("  sip torvalds/linux include/ scripts/ Makefile\n");
+        std::printf("  sip -j 8 --manifest deps.txt\n\n");
+        std::printf("Manifest lines: OWNER/REPO PATH [REF] [DEST]  (REF '-' = default branch)\n");
     }
-    std::exit(status);
+    return status;
 }
 
-void print_version(void) {
+int print_version(void) {
     printf("%s %s\n", PROGRAM_NAME, PROGRAM_VERSION);
     printf("git clone alternative - MIT License\n");
-    exit(EXIT_SUCCESS);
+#ifdef SIP_WITH_LIBCURL
+    printf("built-in HTTP transport: %s\n", curl_version());
+#endif
+    return EXIT_SUCCESS;
 }
 
-std::string quote_arg(const std::string& str) {
-#ifdef _WIN32
-    std::string quoted = "\"";
-    for (char c : str) {
-        if (c == '"')
-            quoted += "\\\"";
-        else if (c == '\\')
-            quoted += "\\\\";
-        else
-            quoted += c;
+#ifndef _WIN32
+// Removes scratch directories named PREFIX<pid>_* in BASE whose process is
+// gone: a run killed by a signal cannot clean up after itself, so the next
+// run that creates a scratch directory there does. Each BASE is swept once.
+static void remove_stale_temp_dirs(const std::filesystem::path& base, const std::string& prefix) {
+    static std::mutex mutex;
+    static std::set<std::string> swept;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!swept.insert(base.string()).second)
+            return;
     }
-    quoted += "\"";
-    return quoted;
-#else
-    std::string quoted = "'";
-    for (char c : str) {
-        if (c == '\'')
-            quoted += "'\"'\"'";
-        else
-            quoted += c;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(base, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0)
+            continue;
+        char* rest = nullptr;
+        long pid = std::strtol(name.c_str() + prefix.size(), &rest, 10);
+        if (pid <= 0 || *rest != '_' || pid == getpid())
+            continue;
+        if (kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH) {
+            std::error_code remove_ec;
+            std::filesystem::remove_all(it->path(), remove_ec);
+            if (opt.verbose && !remove_ec)
+                std::fprintf(stderr, "%s: removed stale temp directory %s\n", PROGRAM_NAME, it->path().string().c_str());
+        }
     }
-    quoted += "'";
-    return quoted;
-#endif
 }
+#endif
 
-std::string create_temp_dir() {
-    std::filesystem::path temp_base = std::filesystem::temp_directory_path();
+// Creates a private scratch directory. With NEAR it is a hidden directory
+// inside NEAR, so that results can later be renamed into place instead of
+// copied; otherwise it lives in the system temp directory. Names carry the
+// pid so that leftovers of an interrupted run can be told apart and removed.
+std::string create_temp_dir(const std::filesystem::path& near = {}) {
+    std::filesystem::path temp_base = near.empty() ? std::filesystem::temp_directory_path() : near;
+    std::string prefix = near.empty() ? "sip_" : ".sip_";
     
 #ifdef _WIN32
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> dis(100000, 999999);
     
-    std::string temp_name = "sip_" + std::to_string(_getpid()) + "_" + std::to_string(dis(gen));
+    std::string temp_name = prefix + std::to_string(_getpid()) + "_" + std::to_string(dis(gen));
     std::filesystem::path temp_path = temp_base / temp_name;
     
     std::error_code ec;
     if (!std::filesystem::create_directory(temp_path, ec)) {
-        if (opt_verbose) {
+        if (opt.verbose) {
             std::fprintf(stderr, "%s: failed to create temp directory: %s\n", PROGRAM_NAME, ec.message().c_str());
         }
         return "";
     }
     return temp_path.string();
 #else
-    std::string template_path = (temp_base / "sip_XXXXXX").string();
+    remove_stale_temp_dirs(temp_base, prefix);
+    std::string template_path = (temp_base / (prefix + std::to_string(getpid()) + "_XXXXXX")).string();
     
     // mkdtemp requires a mutable C string
     std::vector<char> template_cstr(template_path.begin(), template_path.end());
@@ -253,31 +1618,200 @@ std::string create_temp_dir() {
 #endif
 }
 
-std::string discover_default_branch(const std::string& owner, const std::string& repo) {
-    const char* token = std::getenv("GITHUB_TOKEN");
-    std::string url = "https://github.com/" + owner + "/" + repo;
-    std::string auth = token ? (" -c http.extraHeader=" + 
-                              quote_arg(std::string("Authorization: Bearer ") + token)) : "";
-    std::string cmd = "git" + auth + " ls-remote --symref " + quote_arg(url) + " HEAD";
-    
-    if (!opt_verbose) {
-        cmd += dev_null();
+// --- ref resolution cache ---
+//
+// Answers from the remote (HEAD -> default branch, ref -> commit) are kept
+// for opt.ref_ttl seconds in <cache>/.refs/<owner>/<repo>, one
+// "KEY<TAB>VALUE<TAB>UNIX-TIME" line per entry, so a warm run can skip the
+// ls-remote round trip. Keys are "HEAD" (value: branch name) and "ref:NAME"
+// (value: "<sha> branch|tag|commit").
+
+static std::string default_cache_dir() {
+#ifdef _WIN32
+    const char* base = std::getenv("LOCALAPPDATA");
+    return base ? (std::filesystem::path(base) / "sip" / "cache").string() : "";
+#else
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg)
+        return (std::filesystem::path(xdg) / "sip").string();
+    const char* home = std::getenv("HOME");
+    return home ? (std::filesystem::path(home) / ".cache" / "sip").string() : "";
+#endif
+}
+
+static std::mutex ref_cache_mutex;
+
+static std::string ref_cache_file(const std::string& owner, const std::string& repo) {
+    if (opt.ref_ttl <= 0)
+        return "";
+    std::string base = opt.cache_dir.empty() ? default_cache_dir() : opt.cache_dir;
+    if (base.empty())
+        return "";
+    // owner names cannot start with '.', so this never collides with a repo
+    return (std::filesystem::path(base) / ".refs" / owner / repo).string();
+}
+
+static std::map<std::string, std::pair<std::string, long long>> ref_cache_read(const std::string& file) {
+    std::map<std::string, std::pair<std::string, long long>> entries;
+    std::ifstream in(file);
+    std::string line;
+    while (std::getline(in, line)) {
+        auto tab1 = line.find('\t');
+        auto tab2 = tab1 == std::string::npos ? tab1 : line.find('\t', tab1 + 1);
+        if (tab2 == std::string::npos)
+            continue;
+        entries[line.substr(0, tab1)] = {line.substr(tab1 + 1, tab2 - tab1 - 1),
+                                         std::atoll(line.c_str() + tab2 + 1)};
     }
-    
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) {
-        if (opt_verbose) {
-            std::fprintf(stderr, "%s: failed to run git command\n", PROGRAM_NAME);
+    return entries;
+}
+
+static bool ref_cache_get(const std::string& owner,
+                          const std::string& repo,
+                          const std::string& key,
+                          std::string& value) {
+    std::string file = ref_cache_file(owner, repo);
+    if (file.empty() || opt.refresh)
+        return false;
+
+    std::lock_guard<std::mutex> lock(ref_cache_mutex);
+    auto entries = ref_cache_read(file);
+    auto it = entries.find(key);
+    long long now = static_cast<long long>(std::time(nullptr));
+    if (it == entries.end() || now - it->second.second >= opt.ref_ttl || now < it->second.second)
+        return false;
+    value = it->second.first;
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: cached %s -> %s\n", PROGRAM_NAME, key.c_str(), value.c_str());
+    return true;
+}
+
+// Sets KEY to VALUE, or removes it when VALUE is null
+static void ref_cache_update(const std::string& owner,
+                             const std::string& repo,
+                             const std::string& key,
+                             const std::string* value) {
+    std::string file = ref_cache_file(owner, repo);
+    if (file.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(ref_cache_mutex);
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+
+    long long now = static_cast<long long>(std::time(nullptr));
+    auto entries = ref_cache_read(file);
+    if (value)
+        entries[key] = {*value, now};
+    else if (!entries.erase(key))
+        return;
+
+    // write-and-rename so concurrent sip processes never see a torn file
+    std::random_device rd;
+    std::string temp = file + ".tmp" + std::to_string(rd());
+    {
+        std::ofstream out(temp);
+        for (const auto& entry : entries) {
+            if (now - entry.second.second < opt.ref_ttl)
+                out << entry.first << '\t' << entry.second.first << '\t' << entry.second.second << '\n';
+        }
+        if (!out)
+            ec = std::make_error_code(std::errc::io_error);
+    }
+    if (!ec)
+        std::filesystem::rename(temp, file, ec);
+    if (ec)
+        std::filesystem::remove(temp, ec);
+}
+
+static void ref_cache_put(const std::string& owner,
+                          const std::string& repo,
+                          const std::string& key,
+                          const std::string& value) {
+    ref_cache_update(owner, repo, key, &value);
+}
+
+static void ref_cache_drop(const std::string& owner, const std::string& repo, const std::string& key) {
+    ref_cache_update(owner, repo, key, nullptr);
+}
+
+static std::string git_remote_url(const std::string& owner, const std::string& repo) {
+    return base_url(opt.git_base_url, "SIP_GIT_BASE_URL", "https://github.com") + "/" + owner + "/" + repo + ".git";
+}
+
+// `-c http.extraHeader=...` for git operations, when the git server gets the token
+static std::vector<std::string> git_auth_args() {
+    const char* token = github_token(base_url(opt.git_base_url, "SIP_GIT_BASE_URL", "https://github.com"));
+    if (!token)
+        return {};
+    return {"-c", std::string("http.extraHeader=Authorization: Bearer ") + token};
+}
+
+#ifdef SIP_WITH_LIBCURL
+// Reads HEAD from the ref advertisement of the smart HTTP server at URL and
+// returns it as `git ls-remote --symref URL HEAD` would print it, or "" when
+// the server does not answer as expected (the caller then runs git)
+static std::string http_head_symref(const std::string& url) {
+    HttpRequest request(url + "/info/refs?service=git-upload-pack");
+    HttpClient::instance().fetch({&request});
+    if (!request.ok())
+        return "";
+    // pkt-lines: four hex digits giving the length (their own included), then
+    // the data; "0000" is a flush. The first ref line is
+    // "<sha> HEAD\0<capabilities>", and symref=HEAD:<ref> is among them.
+    const std::string& body = request.body;
+    std::size_t pos = 0;
+    while (pos + 4 <= body.size()) {
+        std::size_t length = std::strtoul(body.substr(pos, 4).c_str(), nullptr, 16);
+        if (length < 4) {
+            pos += 4;
+            continue;
         }
-        return "main";
+        std::string line = body.substr(pos + 4, length - 4);
+        pos += length;
+        if (line.rfind("# service=", 0) == 0)
+            continue;
+        std::size_t nul = line.find('\0');
+        std::size_t symref = line.find("symref=HEAD:", nul == std::string::npos ? line.size() : nul);
+        if (nul != 45 || line.compare(40, 5, " HEAD") != 0 || symref == std::string::npos)
+            return "";
+        std::size_t start = symref + std::strlen("symref=HEAD:");
+        std::string target = line.substr(start, line.find_first_of(" \n", start) - start);
+        return "ref: " + target + "\tHEAD\n" + line.substr(0, 40) + "\tHEAD\n";
     }
+    return "";
+}
+#endif
+
+std::string discover_default_branch(const std::string& owner, const std::string& repo) {
+    TraceSpan span("phase", "branch discovery");
+    span.arg("repo", owner + "/" + repo);
+    std::string url = git_remote_url(owner, repo);
+    std::string listing;
+#ifdef SIP_WITH_LIBCURL
+    if (url.rfind("http", 0) == 0)
+        listing = http_head_symref(url);
+#endif
+    if (listing.empty()) {
+        std::vector<std::string> args = git_auth_args();
+        args.insert(args.end(), {"ls-remote", "--symref", url, "HEAD"});
 
-    char buf[512];
-    std::string first;
-    if (fgets(buf, sizeof(buf), pipe)) {
-        first = buf;
+        RunOptions options;
+        options.out = Stream::Capture;
+        RunResult result = run_git(args, options);
+        if (result.status != 0) {
+            if (opt.verbose) {
+                std::fprintf(stderr, "%s: failed to run git command\n", PROGRAM_NAME);
+            }
+            return "main";
+        }
+        listing = result.out;
     }
-    pclose(pipe);
+
+    std::istringstream lines(listing);
+    std::string first, second;
+    std::getline(lines, first);
+    std::getline(lines, second);
 
     // look for "ref: refs/heads/BRANCH" at the beginning
     if (first.rfind("ref:", 0) == 0) {
@@ -287,395 +1821,5884 @@ std::string discover_default_branch(const std::string& owner, const std::string&
             auto end = first.find_first_of(" \t\n", pos);
             std::string branch = first.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
             branch = rtrim(branch);
-            return branch.empty() ? "main" : branch;
+            if (branch.empty())
+                return "main";
+
+            // the second line carries the commit HEAD points at
+            ref_cache_put(owner, repo, "HEAD", branch);
+            std::string sha = second.substr(0, second.find('\t'));
+            if (sha.length() == 40 && looks_like_commit_sha(sha)) {
+                ref_cache_put(owner, repo, "ref:HEAD", sha + " branch");
+                ref_cache_put(owner, repo, "ref:" + branch, sha + " branch");
+            }
+            return branch;
+        }
+    }
+
+    return "main";
+}
+
+// Memoizes discover_default_branch() per repository so manifest entries for
+// the same repo share one lookup, even when their workers ask concurrently.
+// A --daemon keeps the memo across requests for --ref-ttl seconds, unless a
+// request asks for --refresh.
+std::string resolve_default_branch(const std::string& owner, const std::string& repo) {
+    using Clock = std::chrono::steady_clock;
+    static std::mutex mutex;
+    static std::map<std::string, std::pair<std::shared_future<std::string>, Clock::time_point>> resolved;
+
+    std::string key = owner + "/" + repo;
+    std::promise<std::string> promise;
+    std::shared_future<std::string> future;
+    bool owner_of_lookup = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = resolved.find(key);
+        bool fresh = it != resolved.end() &&
+                     (it->second.second >= trace_epoch ||
+                      (!opt.refresh && Clock::now() - it->second.second < std::chrono::seconds(opt.ref_ttl)));
+        if (!fresh) {
+            future = promise.get_future().share();
+            resolved[key] = {future, Clock::now()};
+            owner_of_lookup = true;
+        } else {
+            future = it->second.first;
+        }
+    }
+    if (owner_of_lookup) {
+        std::string branch;
+        if (!ref_cache_get(owner, repo, "HEAD", branch))
+            branch = discover_default_branch(owner, repo);
+        promise.set_value(branch);
+    }
+    return future.get();
+}
+
+// Resolves REF to a commit with a single ls-remote, or with no network at all
+// when the ref cache already knows the answer. Tags win over branches of the
+// same name, as they do for git itself; a SHA that names no ref is taken as a
+// commit, and "HEAD" asks for the remote's default branch. KIND is set to
+// "tag", "branch" or "commit".
+static bool resolve_ref(const std::string& owner,
+                        const std::string& repo,
+                        const std::string& ref,
+                        std::string& sha,
+                        std::string& kind) {
+    TraceSpan span("phase", "ref resolution");
+    span.arg("ref", ref);
+    std::string known;
+    if (ref_cache_get(owner, repo, "ref:" + ref, known)) {
+        std::istringstream fields(known);
+        if (fields >> sha >> kind)
+            return true;
+    }
+    if (ref.length() == 40 && looks_like_commit_sha(ref)) {
+        sha = ref;
+        kind = "commit";
+        return true;
+    }
+
+    std::string url = git_remote_url(owner, repo);
+    std::vector<std::string> args = git_auth_args();
+    if (ref == "HEAD")
+        args.insert(args.end(), {"ls-remote", url, "HEAD"});
+    else
+        args.insert(args.end(), {"ls-remote", url, "refs/tags/" + ref, "refs/tags/" + ref + "^{}",
+                                 "refs/heads/" + ref});
+    RunOptions options;
+    options.out = Stream::Capture;
+    RunResult result = run_git(args, options);
+    if (result.status != 0) {
+        std::fprintf(stderr, "%s: cannot list refs of %s/%s (exit %d)\n", PROGRAM_NAME, owner.c_str(),
+                     repo.c_str(), result.status);
+        return false;
+    }
+
+    // lines are "<sha>\t<refname>"; an annotated tag is followed by its peeled
+    // commit as "<sha>\trefs/tags/NAME^{}"
+    std::string tag, peeled, branch;
+    std::istringstream lines(result.out);
+    std::string line;
+    while (std::getline(lines, line)) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos)
+            continue;
+        std::string id = line.substr(0, tab), name = rtrim(line.substr(tab + 1));
+        if (name == "refs/tags/" + ref)
+            tag = id;
+        else if (name == "refs/tags/" + ref + "^{}")
+            peeled = id;
+        else if (name == "refs/heads/" + ref || (ref == "HEAD" && name == "HEAD"))
+            branch = id;
+    }
+
+    if (!tag.empty()) {
+        sha = peeled.empty() ? tag : peeled;
+        kind = "tag";
+    } else if (!branch.empty()) {
+        sha = branch;
+        kind = "branch";
+    } else if (looks_like_commit_sha(ref)) {
+        // an abbreviated id cannot be looked up remotely; let the fetch try it
+        sha = ref;
+        kind = "commit";
+        return true;
+    } else {
+        std::fprintf(stderr, "%s: '%s' is not a branch, tag or commit of %s/%s\n", PROGRAM_NAME,
+                     ref.c_str(), owner.c_str(), repo.c_str());
+        return false;
+    }
+    ref_cache_put(owner, repo, "ref:" + ref, sha + " " + kind);
+    return true;
+}
+
+// --- persistent object cache ---
+//
+// Bare, blob-less partial clones are kept under <cache>/<owner>/<repo>.git and
+// reused across invocations: later runs only fetch objects they do not have
+// yet, and checkouts read straight out of the cache's object store. Each repo
+// is guarded by an advisory lock on <repo>.git.lock, whose mtime doubles as
+// the last-used stamp for LRU eviction.
+
+// Parses sizes like "500M" or "2G" (binary units, no suffix = bytes)
+static bool parse_size(const char* text, unsigned long long& bytes) {
+    char* endptr;
+    unsigned long long value = std::strtoull(text, &endptr, 10);
+    if (endptr == text)
+        return false;
+    switch (*endptr) {
+        case '\0': break;
+        case 'k': case 'K': value <<= 10; endptr++; break;
+        case 'm': case 'M': value <<= 20; endptr++; break;
+        case 'g': case 'G': value <<= 30; endptr++; break;
+        case 't': case 'T': value <<= 40; endptr++; break;
+        default: return false;
+    }
+    if (*endptr == 'B' || *endptr == 'b')
+        endptr++;
+    if (*endptr != '\0')
+        return false;
+    bytes = value;
+    return true;
+}
+
+// Exclusive advisory lock on a file, released on destruction
+class CacheLock {
+public:
+    explicit CacheLock(const std::string& path, bool wait = true) {
+#ifdef _WIN32
+        handle_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle_ == INVALID_HANDLE_VALUE)
+            return;
+        OVERLAPPED overlapped = {};
+        DWORD flags = LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+        held_ = LockFileEx(handle_, flags, 0, MAXDWORD, MAXDWORD, &overlapped);
+#else
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+            return;
+        int rc;
+        do {
+            rc = flock(fd_, LOCK_EX | (wait ? 0 : LOCK_NB));
+        } while (rc != 0 && errno == EINTR);
+        held_ = rc == 0;
+#endif
+    }
+
+    ~CacheLock() {
+#ifdef _WIN32
+        if (handle_ != INVALID_HANDLE_VALUE)
+            CloseHandle(handle_);
+#else
+        if (fd_ >= 0)
+            close(fd_);
+#endif
+    }
+
+    CacheLock(const CacheLock&) = delete;
+    CacheLock& operator=(const CacheLock&) = delete;
+
+    bool held() const { return held_; }
+
+private:
+#ifdef _WIN32
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+    int fd_ = -1;
+#endif
+    bool held_ = false;
+};
+
+static std::string cache_repo_path(const std::string& owner, const std::string& repo) {
+    return (std::filesystem::path(opt.cache_dir) / owner / (repo + ".git")).string();
+}
+
+static std::uintmax_t directory_size(const std::filesystem::path& dir) {
+    std::uintmax_t total = 0;
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(dir, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        std::error_code size_ec;
+        if (it->is_regular_file(size_ec))
+            total += it->file_size(size_ec);
+    }
+    return total;
+}
+
+// Each repo's size is kept in <cache>/sizes, one "OWNER/REPO.git SIZE" line
+// per repo and rewritten under sizes.lock, so that a run measures only the
+// repo it used instead of walking the whole cache. A cache without the file
+// is measured in full once to start it.
+static std::map<std::string, std::uintmax_t> read_cache_sizes(const std::filesystem::path& file) {
+    std::map<std::string, std::uintmax_t> sizes;
+    std::ifstream in(file);
+    std::string key;
+    std::uintmax_t size;
+    while (in >> key >> size)
+        sizes[key] = size;
+    return sizes;
+}
+
+static void write_cache_sizes(const std::filesystem::path& file,
+                              const std::map<std::string, std::uintmax_t>& sizes) {
+    std::filesystem::path temp = file;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        for (const auto& [key, size] : sizes)
+            out << key << " " << size << "\n";
+        if (!out)
+            return;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, file, ec);
+}
+
+// Records the size of KEEP, the repo just used, and deletes least-recently-used
+// repos until the cache fits in opt.cache_size. Repos locked by other sip
+// processes are skipped, as is KEEP.
+static void cache_evict(const std::string& keep) {
+    TraceSpan span("phase", "cache eviction");
+    std::filesystem::path root(opt.cache_dir);
+    std::filesystem::path file = root / "sizes";
+    CacheLock sizes_lock(file.string() + ".lock");
+    if (!sizes_lock.held())
+        return;
+    auto key_of = [&root](const std::filesystem::path& repo) {
+        return repo.lexically_relative(root).generic_string();
+    };
+    std::error_code ec;
+    std::map<std::string, std::uintmax_t> sizes;
+    if (std::filesystem::exists(file, ec)) {
+        sizes = read_cache_sizes(file);
+    } else {
+        for (auto& owner_dir : std::filesystem::directory_iterator(root, ec)) {
+            if (!owner_dir.is_directory(ec))
+                continue;
+            for (auto& item : std::filesystem::directory_iterator(owner_dir.path(), ec)) {
+                if (item.is_directory(ec) && item.path().extension() == ".git")
+                    sizes[key_of(item.path())] = directory_size(item.path());
+            }
+        }
+    }
+    if (std::filesystem::is_directory(keep, ec))
+        sizes[key_of(keep)] = directory_size(keep);
+    else
+        sizes.erase(key_of(keep));
+
+    std::uintmax_t total = 0;
+    for (const auto& entry : sizes)
+        total += entry.second;
+    span.arg("bytes", static_cast<long long>(total));
+    if (total > opt.cache_size) {
+        struct Entry {
+            std::string key;
+            std::filesystem::file_time_type used;
+        };
+        std::vector<Entry> entries;
+        for (const auto& [key, size] : sizes) {
+            std::filesystem::path lock_file = (root / key).string() + ".lock";
+            Entry entry{key, std::filesystem::last_write_time(lock_file, ec)};
+            if (ec)
+                entry.used = std::filesystem::file_time_type::min();
+            entries.push_back(entry);
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        for (const auto& entry : entries) {
+            if (total <= opt.cache_size)
+                break;
+            std::filesystem::path repo = root / entry.key;
+            if (entry.key == key_of(keep))
+                continue;
+            CacheLock lock(repo.string() + ".lock", false);
+            if (!lock.held())
+                continue;
+            if (opt.verbose)
+                std::fprintf(stderr, "%s: evicting cached %s\n", PROGRAM_NAME, repo.string().c_str());
+            std::filesystem::remove_all(repo, ec);
+            if (!ec) {
+                total -= sizes[entry.key];
+                sizes.erase(entry.key);
+            }
+        }
+    }
+    write_cache_sizes(file, sizes);
+}
+
+// Creates a bare repository at GIT_DIR whose origin is URL, set up as a
+// blob-less partial clone: missing blobs are fetched from origin on demand.
+static bool init_partial_repo(const std::string& git_dir, const std::string& url) {
+    std::string gd = "--git-dir=" + git_dir;
+    std::error_code ec;
+    std::filesystem::remove_all(git_dir, ec);
+    if (run_git({"init", "-q", "--bare", git_dir}).status != 0 ||
+        run_git({gd, "config", "remote.origin.url", url}).status != 0 ||
+        run_git({gd, "config", "remote.origin.promisor", "true"}).status != 0 ||
+        run_git({gd, "config", "remote.origin.partialclonefilter", "blob:none"}).status != 0 ||
+        run_git({gd, "config", "core.repositoryformatversion", "1"}).status != 0 ||
+        run_git({gd, "config", "extensions.partialClone", "origin"}).status != 0) {
+        std::filesystem::remove_all(git_dir, ec);
+        return false;
+    }
+    return true;
+}
+
+// A cached repository keeps the remote it was created with; once the git
+// base URL changes it is pointed at the new one. The config file is read
+// directly, so the common case runs no git process.
+static bool point_remote_at(const std::string& git_dir, const std::string& url) {
+    std::ifstream in(std::filesystem::path(git_dir) / "config");
+    std::string line;
+    while (std::getline(in, line)) {
+        std::size_t start = line.find_first_not_of(" \t");
+        if (start != std::string::npos && line.compare(start, std::string::npos, "url = " + url) == 0)
+            return true;
+    }
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: pointing cache at %s\n", PROGRAM_NAME, url.c_str());
+    return run_git({"--git-dir=" + git_dir, "config", "remote.origin.url", url}).status == 0;
+}
+
+// Fetches the blobs reachable from REVS (tree-ish names such as COMMIT:PATH,
+// optionally with ^EXCLUDED ones) that the repository selected by REPO_ARGS
+// lacks, opt.prefetch_batch ids per request. The checkout that follows then
+// finds every blob locally instead of fetching them lazily. ONLY, when given,
+// limits the fetch to those ids. Revisions that do not resolve skip the
+// prefetch and leave the blobs to the lazy fetch and its error reporting.
+static bool prefetch_blobs(const std::vector<std::string>& repo_args,
+                           const std::vector<std::string>& revs,
+                           const std::set<std::string>* only = nullptr) {
+    if (opt.prefetch_batch <= 0 || revs.empty())
+        return true;
+    TraceSpan span("phase", "blob prefetch");
+    std::vector<std::string> list = repo_args;
+    list.insert(list.end(), {"rev-list", "--objects", "--missing=print"});
+    list.insert(list.end(), revs.begin(), revs.end());
+    RunOptions list_options;
+    list_options.out = Stream::Capture;
+    RunResult listed = run_git(list, list_options);
+    if (listed.status != 0)
+        return true;
+
+    // "?<oid>" marks an object that is referenced but not present
+    std::vector<std::string> missing;
+    std::istringstream lines(listed.out);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (!line.empty() && line[0] == '?' && (!only || only->count(line.substr(1))))
+            missing.push_back(line.substr(1));
+    }
+    std::size_t batches = (missing.size() + opt.prefetch_batch - 1) / opt.prefetch_batch;
+    span.arg("blobs", static_cast<long long>(missing.size()));
+    span.arg("batches", static_cast<long long>(batches));
+    if (opt.verbose && !missing.empty())
+        std::fprintf(stderr, "%s: prefetching %zu blobs in %zu request%s\n", PROGRAM_NAME, missing.size(),
+                     batches, batches == 1 ? "" : "s");
+
+    for (std::size_t start = 0; start < missing.size(); start += opt.prefetch_batch) {
+        std::size_t end = std::min(missing.size(), start + static_cast<std::size_t>(opt.prefetch_batch));
+        RunOptions fetch_options;
+        for (std::size_t i = start; i < end; i++)
+            fetch_options.input += missing[i] + "\n";
+        std::vector<std::string> args = git_auth_args();
+        args.insert(args.end(), repo_args.begin(), repo_args.end());
+        args.insert(args.end(), {"-c", "fetch.negotiationAlgorithm=noop", "-c", "http.lowSpeedLimit=1000",
+                                 "-c", "http.lowSpeedTime=10", "fetch", "-q", "--no-tags",
+                                 "--no-write-fetch-head", "--recurse-submodules=no", "--filter=blob:none",
+                                 "--stdin", "origin"});
+        int result = run_git(args, fetch_options).status;
+        if (result != 0) {
+            std::fprintf(stderr, "%s: blob fetch failed (exit %d)\n", PROGRAM_NAME, result);
+            return false;
+        }
+    }
+    return true;
+}
+
+// A file in a tree listing, path relative to the listed tree
+struct TreeBlob {
+    std::string path;
+    std::string oid;
+    std::string mode;
+};
+
+// Blob entries under TREE that pass the --include/--exclude filters, read
+// from the tree alone, so no blob needs to be present
+static std::vector<TreeBlob> selected_blobs(const std::vector<std::string>& repo_args, const std::string& tree) {
+    std::vector<std::string> args = repo_args;
+    args.insert(args.end(), {"ls-tree", "-r", "-z", tree});
+    RunOptions options;
+    options.out = Stream::Capture;
+    RunResult listed = run_git(args, options);
+    std::vector<TreeBlob> blobs;
+    // "<mode> <type> <oid>\t<path>\0"
+    std::size_t pos = 0;
+    while (listed.status == 0 && pos < listed.out.size()) {
+        std::size_t end = listed.out.find('\0', pos);
+        if (end == std::string::npos)
+            end = listed.out.size();
+        std::string entry = listed.out.substr(pos, end - pos);
+        pos = end + 1;
+        std::size_t tab = entry.find('\t');
+        std::istringstream fields(entry.substr(0, tab));
+        std::string mode, type, oid;
+        fields >> mode >> type >> oid;
+        if (tab != std::string::npos && type == "blob" && path_selected(entry.substr(tab + 1)))
+            blobs.push_back({entry.substr(tab + 1), oid, mode});
+    }
+    return blobs;
+}
+
+// A locked, freshly fetched cache repo. `commit` is the fetched ref peeled to
+// a commit; `branch` names it when the ref was a branch.
+struct CachedRef {
+    std::string git_dir;
+    std::string commit;
+    std::string branch;
+};
+
+// Creates the cache repo on first use and fetches REF (the remote HEAD when
+// empty) into it without blobs. The caller must hold the repo lock.
+static bool cache_fetch(const std::string& owner,
+                        const std::string& repo,
+                        const std::string& ref,
+                        CachedRef& cached) {
+    TraceSpan span("phase", "cache fetch");
+    span.arg("ref", ref);
+    cached.git_dir = cache_repo_path(owner, repo);
+    std::string git_url = git_remote_url(owner, repo);
+    std::string gd = "--git-dir=" + cached.git_dir;
+
+    if (!std::filesystem::exists(std::filesystem::path(cached.git_dir) / "HEAD")) {
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: creating cache repository...\n", PROGRAM_NAME);
+        if (!init_partial_repo(cached.git_dir, git_url)) {
+            std::fprintf(stderr, "%s: failed to create cache repository\n", PROGRAM_NAME);
+            return false;
+        }
+    } else if (!point_remote_at(cached.git_dir, git_url)) {
+        std::fprintf(stderr, "%s: failed to update cache repository\n", PROGRAM_NAME);
+        return false;
+    }
+
+    // a fresh ref-cache answer whose commit is already cached needs no network
+    // at all; an answer whose commit is missing is fetched by id
+    std::string want = ref.empty() ? "HEAD" : ref;
+    std::string fetch_ref = want;
+    std::string kind;
+    std::string known;
+    if (ref_cache_get(owner, repo, "ref:" + want, known)) {
+        std::istringstream fields(known);
+        std::string sha;
+        fields >> sha >> kind;
+        fetch_ref = sha;
+    } else if (want.length() == 40 && looks_like_commit_sha(want)) {
+        kind = "commit";
+    }
+    if (fetch_ref != want || kind == "commit") {
+        if (git_output({gd, "rev-list", "-n1", "--no-walk", "--missing=print", fetch_ref}) == fetch_ref) {
+            if (opt.verbose)
+                std::fprintf(stderr, "%s: '%s' already cached\n", PROGRAM_NAME, want.c_str());
+            cached.commit = fetch_ref;
+            if (kind == "branch" && want != "HEAD")
+                cached.branch = want;
+            return true;
+        }
+    }
+
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: fetching '%s' into cache...\n", PROGRAM_NAME, want.c_str());
+
+    // negotiation against what the cache already holds keeps this to new objects
+    std::vector<std::string> args = git_auth_args();
+    args.insert(args.end(), {gd, "-c", "http.lowSpeedLimit=1000", "-c", "http.lowSpeedTime=10", "fetch",
+                             "--no-tags", "--depth", "1", "--filter=blob:none",
+                             chatty() ? "--progress" : "-q", "origin", fetch_ref});
+    int result = run_git(args).status;
+    if (result != 0) {
+        std::fprintf(stderr, "%s: fetch failed for '%s' (exit %d)\n", PROGRAM_NAME, want.c_str(), result);
+        return false;
+    }
+
+    cached.commit = git_output({gd, "rev-parse", "--verify", "-q", "FETCH_HEAD^{commit}"});
+    if (cached.commit.empty()) {
+        std::fprintf(stderr, "%s: '%s' does not name a commit\n", PROGRAM_NAME, want.c_str());
+        return false;
+    }
+
+    if (fetch_ref == want) {
+        // FETCH_HEAD reads "<sha>\t\tbranch 'NAME' of URL" for branches and
+        // "<sha>\t\ttag 'NAME' of URL" for tags
+        std::ifstream fh(std::filesystem::path(cached.git_dir) / "FETCH_HEAD");
+        std::string line;
+        std::getline(fh, line);
+        if (line.find("\tbranch '") != std::string::npos || want == "HEAD")
+            kind = "branch";
+        else if (line.find("\ttag '") != std::string::npos)
+            kind = "tag";
+        else
+            kind = "commit";
+        ref_cache_put(owner, repo, "ref:" + want, cached.commit + " " + kind);
+    }
+    if (kind == "branch" && want != "HEAD")
+        cached.branch = want;
+    return true;
+}
+
+// Checks out TREE_ISH into WORK_TREE using the cache repo's object store, so
+// missing blobs are fetched into the cache in one batch and no second copy of
+// the files is made. With --include/--exclude only the selected files are
+// written.
+static bool cache_checkout(const std::string& git_dir,
+                           const std::string& tree_ish,
+                           const std::string& work_tree,
+                           const std::string& index_file) {
+    TraceSpan span("phase", "checkout");
+    span.arg("tree", tree_ish);
+    std::vector<std::string> args = git_auth_args();
+    std::vector<std::string> workers = git_checkout_args();
+    args.insert(args.end(), workers.begin(), workers.end());
+    args.insert(args.end(), {"--git-dir=" + git_dir, "--work-tree=" + work_tree});
+    RunOptions options;
+    options.env.emplace_back("GIT_INDEX_FILE", index_file);
+    int result;
+    if (!filters_active()) {
+        std::vector<std::string> read_tree = args;
+        read_tree.insert(read_tree.end(), {"read-tree", "-u", "--reset", tree_ish});
+        result = run_git(read_tree, options).status;
+    } else {
+        // the index gets the whole tree, the work tree only the selected files
+        std::vector<std::string> read_tree = args;
+        read_tree.insert(read_tree.end(), {"read-tree", "--reset", tree_ish});
+        result = run_git(read_tree, options).status;
+        for (const auto& blob : selected_blobs({"--git-dir=" + git_dir}, tree_ish)) {
+            options.input += blob.path;
+            options.input.push_back('\0');
+        }
+        if (result == 0 && !options.input.empty()) {
+            args.insert(args.end(), {"checkout-index", "-z", "--stdin"});
+            result = run_git(args, options).status;
+        }
+    }
+    if (result != 0) {
+        std::fprintf(stderr, "%s: checkout of '%s' failed (exit %d)\n", PROGRAM_NAME,
+                     tree_ish.c_str(), result);
+        return false;
+    }
+    return true;
+}
+
+// Marks a cache repo as used now, for LRU ordering
+static void cache_touch(const std::string& git_dir) {
+    std::error_code ec;
+    std::filesystem::last_write_time(git_dir + ".lock", std::filesystem::file_time_type::clock::now(), ec);
+}
+
+static bool prepare_cache_dir(const std::string& owner) {
+    std::error_code ec;
+    std::filesystem::path dir = std::filesystem::path(opt.cache_dir) / owner;
+    if (!std::filesystem::create_directories(dir, ec) && !std::filesystem::is_directory(dir)) {
+        std::fprintf(stderr, "%s: cannot create cache directory %s: %s\n", PROGRAM_NAME,
+                     dir.string().c_str(), ec.message().c_str());
+        return false;
+    }
+    return true;
+}
+
+// One directory of a multi-path download and where it goes; ok is set once
+// it has been written, missing when the repository has no such directory.
+struct DirRequest {
+    std::string path;
+    std::string output;
+    bool ok = false;
+    bool missing = false;
+    bool stored = false;  // its files already went through the --store
+    bool lfs = true;      // its files may be LFS pointers, so they are scanned for them
+};
+
+// Git LFS pointers (see resolve_lfs()) are small text files starting so
+const std::uintmax_t LFS_POINTER_MAX = 1024;  // larger files are never pointers
+const char LFS_POINTER_START[] = "version https://git-lfs.github.com/spec/v1\n";
+
+// Clears the lfs flag of DIRS unless a .gitattributes of COMMIT that applies
+// to them, inside one or in a directory above, routes anything through LFS.
+// Only then can their files be pointers; when in doubt the flag stays set.
+static void mark_lfs_dirs(const std::vector<std::string>& repo_args,
+                          const std::string& commit,
+                          std::vector<DirRequest>& dirs) {
+    if (!opt.lfs)
+        return;
+    std::set<std::string> candidates = {".gitattributes"};
+    std::vector<std::string> args = repo_args;
+    args.insert(args.end(), {"ls-tree", "-r", "-z", "--name-only", commit, "--"});
+    bool whole = false;
+    for (const auto& dir : dirs) {
+        for (std::size_t slash = dir.path.find('/'); slash != std::string::npos;
+             slash = dir.path.find('/', slash + 1))
+            candidates.insert(dir.path.substr(0, slash) + "/.gitattributes");
+        whole = whole || dir.path.empty();
+        args.push_back(dir.path);
+    }
+    if (whole)
+        args.resize(args.size() - dirs.size());
+    RunOptions options;
+    options.out = Stream::Capture;
+    RunResult listed = run_git(args, options);
+    if (listed.status != 0)
+        return;
+    std::istringstream names(listed.out);
+    for (std::string name; std::getline(names, name, '\0');) {
+        if (name == ".gitattributes" ||
+            (name.size() > 15 && name.compare(name.size() - 15, 15, "/.gitattributes") == 0))
+            candidates.insert(name);
+    }
+
+    // a path that is not there comes back as "<commit>:<path> missing"
+    std::vector<std::string> read = git_auth_args();
+    read.insert(read.end(), repo_args.begin(), repo_args.end());
+    read.insert(read.end(), {"cat-file", "--batch"});
+    RunOptions batch;
+    batch.out = Stream::Capture;
+    for (const auto& name : candidates)
+        batch.input += commit + ":" + name + "\n";
+    RunResult attributes = run_git(read, batch);
+    if (attributes.status == 0 && attributes.out.find("filter=lfs") == std::string::npos) {
+        for (auto& dir : dirs)
+            dir.lfs = false;
+    }
+}
+
+// download_directories_selective() through the object cache: each path is read
+// out of the cached tree straight into its output, all under one fetch.
+static bool download_directories_cached(const std::string& owner,
+                                        const std::string& repo,
+                                        std::vector<DirRequest>& dirs,
+                                        const std::string& ref) {
+    if (!prepare_cache_dir(owner))
+        return false;
+
+    std::string temp_dir = create_temp_dir();
+    if (temp_dir.empty()) {
+        std::fprintf(stderr, "%s: failed to create temp directory\n", PROGRAM_NAME);
+        return false;
+    }
+
+    std::string git_dir = cache_repo_path(owner, repo);
+    bool ok = false;
+    {
+        TraceSpan wait("phase", "cache lock");
+        CacheLock lock(git_dir + ".lock");
+        wait.finish();
+        if (!lock.held()) {
+            std::fprintf(stderr, "%s: failed to lock cache %s\n", PROGRAM_NAME, git_dir.c_str());
+        } else {
+            CachedRef cached;
+            std::vector<std::string> trees;
+            std::set<std::string> only;
+            if (cache_fetch(owner, repo, ref, cached)) {
+                for (const auto& dir : dirs) {
+                    trees.push_back(cached.commit + ":" + dir.path);
+                    for (const auto& blob : filters_active() ? selected_blobs({"--git-dir=" + git_dir}, trees.back())
+                                                             : std::vector<TreeBlob>())
+                        only.insert(blob.oid);
+                }
+                ok = prefetch_blobs({"--git-dir=" + git_dir}, trees, filters_active() ? &only : nullptr);
+                if (ok)
+                    mark_lfs_dirs({"--git-dir=" + git_dir}, cached.commit, dirs);
+            }
+            if (ok) {
+                std::string index = (std::filesystem::path(temp_dir) / "index").string();
+                for (auto& dir : dirs) {
+                    if (opt.verbose)
+                        std::fprintf(stderr, "%s: checking out '%s' from cache...\n", PROGRAM_NAME,
+                                     dir.path.c_str());
+                    std::error_code ec;
+                    std::string tree = cached.commit + ":" + dir.path;
+                    dir.missing = git_output({"--git-dir=" + git_dir, "cat-file", "-t", tree}) != "tree";
+                    if (dir.missing)
+                        std::fprintf(stderr, "%s: directory '%s' not found in repository\n",
+                                     PROGRAM_NAME, dir.path.c_str());
+                    dir.ok = !dir.missing && std::filesystem::create_directories(dir.output, ec) &&
+                             cache_checkout(git_dir, tree, dir.output, index);
+                    if (!dir.ok) {
+                        std::filesystem::remove_all(dir.output, ec);
+                        ok = false;
+                    }
+                }
+            }
+            cache_touch(git_dir);
+        }
+    }
+
+    TraceSpan cleanup("phase", "cleanup");
+    std::error_code ec;
+    std::filesystem::remove_all(temp_dir, ec);
+    cleanup.finish();
+    cache_evict(git_dir);
+
+    if (ok && chatty())
+        std::puts("done.");
+    return ok;
+}
+
+// clone_repository() through the object cache. OUTPUT becomes a regular
+// shallow clone: objects are borrowed from the cache for the checkout and
+// then copied in, so the clone does not depend on the cache afterwards.
+static bool clone_repository_cached(const std::string& owner,
+                                    const std::string& repo,
+                                    const std::string& ref,
+                                    const std::string& output) {
+    if (!prepare_cache_dir(owner))
+        return false;
+
+    std::string git_dir = cache_repo_path(owner, repo);
+    std::string git_url = git_remote_url(owner, repo);
+    std::filesystem::path dot_git = std::filesystem::path(output) / ".git";
+    auto in_dest = [&output](std::vector<std::string> args) {
+        args.insert(args.begin(), {"-C", output});
+        return run_git(args).status == 0;
+    };
+    std::error_code ec;
+    bool ok = false;
+    {
+        TraceSpan wait("phase", "cache lock");
+        CacheLock lock(git_dir + ".lock");
+        wait.finish();
+        CachedRef cached;
+        if (!lock.held()) {
+            std::fprintf(stderr, "%s: failed to lock cache %s\n", PROGRAM_NAME, git_dir.c_str());
+        } else if (cache_fetch(owner, repo, ref.empty() ? resolve_default_branch(owner, repo) : ref,
+                               cached) &&
+                   run_git({"init", "-q", output}).status == 0) {
+            std::filesystem::path absolute_objects =
+                std::filesystem::absolute(std::filesystem::path(git_dir) / "objects");
+            std::ofstream(dot_git / "objects" / "info" / "alternates") << absolute_objects.string() << "\n";
+            std::ofstream(dot_git / "shallow") << cached.commit << "\n";
+
+            std::string head_ref = cached.branch.empty() ? "" : "refs/heads/" + cached.branch;
+            ok = cache_checkout(git_dir, cached.commit, output, (dot_git / "index").string()) &&
+                 in_dest({"remote", "add", "origin", git_url});
+            if (ok && !head_ref.empty()) {
+                ok = in_dest({"update-ref", head_ref, cached.commit}) &&
+                     in_dest({"update-ref", "refs/remotes/origin/" + cached.branch, cached.commit}) &&
+                     in_dest({"symbolic-ref", "HEAD", head_ref}) &&
+                     in_dest({"config", "branch." + cached.branch + ".remote", "origin"}) &&
+                     in_dest({"config", "branch." + cached.branch + ".merge", head_ref});
+            } else if (ok) {
+                // tags and commits are checked out detached, like git clone does
+                ok = in_dest({"update-ref", "--no-deref", "HEAD", cached.commit});
+            }
+            // copy the borrowed objects in so the clone outlives the cache
+            ok = ok && in_dest({"repack", "-a", "-d", "-q"});
+            std::filesystem::remove(dot_git / "objects" / "info" / "alternates", ec);
+            if (!ok) {
+                std::fprintf(stderr, "%s: failed to create clone from cache\n", PROGRAM_NAME);
+                std::filesystem::remove_all(output, ec);
+            }
         }
+        if (lock.held())
+            cache_touch(git_dir);
+    }
+    cache_evict(git_dir);
+
+    if (ok && chatty())
+        std::puts("done.");
+    return ok;
+}
+
+// Materializing a checked-out tree at its destination. A rename is free when
+// the scratch clone sits on the same filesystem; otherwise files are copied by
+// a small thread pool, each with the cheapest method the kernel offers.
+enum class CopyMethod { Reflink, CopyRange, ReadWrite };
+
+struct CopyStats {
+    std::atomic<std::size_t> files[3] = {{0}, {0}, {0}};
+    std::atomic<std::uintmax_t> bytes{0};
+};
+
+static bool copy_file_fast(const std::filesystem::path& from,
+                           const std::filesystem::path& to,
+                           CopyStats& stats,
+                           std::error_code& ec) {
+#ifdef _WIN32
+    if (!std::filesystem::copy_file(from, to, ec))
+        return false;
+    stats.files[static_cast<int>(CopyMethod::ReadWrite)]++;
+    stats.bytes += std::filesystem::file_size(to, ec);
+    return !ec;
+#else
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        ec.assign(errno, std::generic_category());
+        return false;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        ec.assign(errno, std::generic_category());
+        close(in);
+        return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0) {
+        ec.assign(errno, std::generic_category());
+        close(in);
+        return false;
+    }
+
+    CopyMethod method = CopyMethod::ReadWrite;
+    off_t done = 0;
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        method = CopyMethod::Reflink;
+        done = st.st_size;
+    }
+#endif
+#ifdef __linux__
+    while (method != CopyMethod::Reflink && done < st.st_size) {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, st.st_size - done, 0);
+        if (n <= 0)
+            break;  // unsupported here, or the file shrank: finish with read/write
+        method = CopyMethod::CopyRange;
+        done += n;
+    }
+#endif
+    if (done < st.st_size) {
+        char buffer[1 << 16];
+        ssize_t n;
+        while ((n = pread(in, buffer, sizeof buffer, done)) > 0) {
+            for (ssize_t written = 0; written < n;) {
+                ssize_t w = write(out, buffer + written, n - written);
+                if (w < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    ec.assign(errno, std::generic_category());
+                    close(in);
+                    close(out);
+                    return false;
+                }
+                written += w;
+            }
+            done += n;
+        }
+        if (n < 0)
+            ec.assign(errno, std::generic_category());
+    }
+
+    close(in);
+    if (close(out) != 0 && !ec)
+        ec.assign(errno, std::generic_category());
+    if (ec)
+        return false;
+    stats.files[static_cast<int>(method)]++;
+    stats.bytes += static_cast<std::uintmax_t>(done);
+    return true;
+#endif
+}
+
+// Copies the tree at FROM to TO (which must not exist). Directories and
+// symlinks are created first, then regular files are copied in parallel.
+static bool copy_tree_parallel(const std::filesystem::path& from,
+                               const std::filesystem::path& to,
+                               CopyStats& stats,
+                               std::error_code& ec) {
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> files;
+    if (!std::filesystem::create_directory(to, ec))
+        return false;
+    for (auto it = std::filesystem::recursive_directory_iterator(from, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        std::filesystem::path target = to / it->path().lexically_relative(from);
+        if (it->is_symlink())
+            std::filesystem::copy_symlink(it->path(), target, ec);
+        else if (it->is_directory())
+            std::filesystem::create_directory(target, ec);
+        else
+            files.emplace_back(it->path(), target);
+    }
+    if (ec)
+        return false;
+
+    std::mutex error_mutex;
+    std::atomic<bool> failed{false};
+    parallel_for(files.size(), io_workers(), [&](std::size_t i) {
+        std::error_code file_ec;
+        if (failed || copy_file_fast(files[i].first, files[i].second, stats, file_ec))
+            return;
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!ec)
+            ec = file_ec;
+        failed = true;  // skip the rest
+    });
+    return !ec;
+}
+
+// Moves the checked-out directory FROM to TO, renaming when possible and
+// copying otherwise. COPY_ONLY is set when FROM must stay in place, e.g.
+// because another requested directory lives inside it.
+static bool materialize_tree(const std::filesystem::path& from,
+                             const std::filesystem::path& to,
+                             bool copy_only,
+                             std::error_code& ec) {
+    TraceSpan span("phase", "materialize");
+    span.arg("path", to.string());
+    if (!copy_only) {
+        std::filesystem::rename(from, to, ec);
+        if (!ec) {
+            span.arg("strategy", "rename");
+            if (opt.verbose)
+                std::fprintf(stderr, "%s: moved '%s' into place (rename)\n", PROGRAM_NAME,
+                             to.string().c_str());
+            return true;
+        }
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: rename not possible (%s), copying\n", PROGRAM_NAME,
+                         ec.message().c_str());
+        ec.clear();
+    }
+
+    CopyStats stats;
+    auto start = std::chrono::steady_clock::now();
+    bool copied = copy_tree_parallel(from, to, stats, ec);
+    span.arg("strategy", "copy");
+    span.arg("bytes", static_cast<long long>(stats.bytes.load()));
+    span.arg("files_reflinked", static_cast<long long>(stats.files[0].load()));
+    span.arg("files_copy_range", static_cast<long long>(stats.files[1].load()));
+    span.arg("files_read_write", static_cast<long long>(stats.files[2].load()));
+    if (!copied)
+        return false;
+    if (opt.verbose) {
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::fprintf(stderr,
+                     "%s: copied '%s': %ju bytes in %.3fs (%zu reflinked, %zu copy_file_range, "
+                     "%zu read/write)\n",
+                     PROGRAM_NAME, to.string().c_str(), stats.bytes.load(), seconds,
+                     stats.files[0].load(), stats.files[1].load(), stats.files[2].load());
+    }
+    return true;
+}
+
+// --- content-addressed blob store ---
+//
+// With --store=DIR, every file sip writes is keyed by its git blob id under
+// DIR/objects/xx/yyyy... (".x" appended for executables, since links share
+// mode bits). A file whose blob is already there is replaced by a reflink of
+// the stored copy where the filesystem supports it, or with --store-links a
+// hardlink, so repeated extractions of the same content share disk blocks;
+// where neither works the file keeps its own copy and is not counted as
+// deduplicated. Where blob ids are known before writing (--engine=objects and
+// --sync), a stored blob is linked in instead of being written at all.
+// Each output linked to an object is recorded in DIR/refs, under the object's
+// own relative path, since a reflinked output leaves no trace on the object.
+// Objects are touched when used; --store-gc removes ones that no recorded
+// output still holds and that have not been used for DEFAULT_STORE_GC_AGE.
+
+class Sha1 {
+public:
+    void update(const void* data, std::size_t size) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        length_ += size;
+        while (size > 0) {
+            std::size_t take = std::min(size, sizeof block_ - used_);
+            std::memcpy(block_ + used_, p, take);
+            used_ += take;
+            p += take;
+            size -= take;
+            if (used_ == sizeof block_) {
+                compress();
+                used_ = 0;
+            }
+        }
+    }
+
+    std::string hex() {
+        std::uint64_t bits = length_ * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used_ != 56)
+            update(&pad, 1);
+        unsigned char tail[8];
+        for (int i = 0; i < 8; i++)
+            tail[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        update(tail, 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (std::uint32_t word : state_) {
+            for (int shift = 28; shift >= 0; shift -= 4)
+                out += digits[(word >> shift) & 0xf];
+        }
+        return out;
+    }
+
+private:
+    static std::uint32_t rol(std::uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    void compress() {
+        std::uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = std::uint32_t(block_[4 * i]) << 24 | std::uint32_t(block_[4 * i + 1]) << 16 |
+                   std::uint32_t(block_[4 * i + 2]) << 8 | block_[4 * i + 3];
+        for (int i = 16; i < 80; i++)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        std::uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3], e = state_[4];
+        for (int i = 0; i < 80; i++) {
+            std::uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            std::uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+        state_[4] += e;
+    }
+
+    std::uint32_t state_[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    unsigned char block_[64];
+    std::size_t used_ = 0;
+    std::uint64_t length_ = 0;
+};
+
+// The git blob id of FILE's content, or "" if it cannot be read
+static std::string git_blob_id(const std::filesystem::path& file) {
+    std::ifstream in(file, std::ios::binary);
+    std::error_code ec;
+    std::uintmax_t size = std::filesystem::file_size(file, ec);
+    if (!in || ec)
+        return "";
+    Sha1 sha;
+    std::string header = "blob " + std::to_string(size);
+    sha.update(header.c_str(), header.size() + 1);  // with the NUL
+    char buffer[1 << 16];
+    while (in.read(buffer, sizeof buffer) || in.gcount() > 0)
+        sha.update(buffer, static_cast<std::size_t>(in.gcount()));
+    return in.bad() ? "" : sha.hex();
+}
+
+// SHA-256, for --sha256
+class Sha256 {
+public:
+    void update(const void* data, std::size_t size) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        length_ += size;
+        while (size > 0) {
+            std::size_t take = std::min(size, sizeof block_ - used_);
+            std::memcpy(block_ + used_, p, take);
+            used_ += take;
+            p += take;
+            size -= take;
+            if (used_ == sizeof block_) {
+                compress();
+                used_ = 0;
+            }
+        }
+    }
+
+    std::string hex() {
+        std::uint64_t bits = length_ * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used_ != 56)
+            update(&pad, 1);
+        unsigned char tail[8];
+        for (int i = 0; i < 8; i++)
+            tail[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        update(tail, 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (std::uint32_t word : state_) {
+            for (int shift = 28; shift >= 0; shift -= 4)
+                out += digits[(word >> shift) & 0xf];
+        }
+        return out;
+    }
+
+private:
+    static std::uint32_t ror(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress() {
+        static const std::uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = std::uint32_t(block_[4 * i]) << 24 | std::uint32_t(block_[4 * i + 1]) << 16 |
+                   std::uint32_t(block_[4 * i + 2]) << 8 | block_[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            std::uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            std::uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        std::uint32_t v[8];
+        std::memcpy(v, state_, sizeof v);
+        for (int i = 0; i < 64; i++) {
+            std::uint32_t s1 = ror(v[4], 6) ^ ror(v[4], 11) ^ ror(v[4], 25);
+            std::uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            std::uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+            std::uint32_t s0 = ror(v[0], 2) ^ ror(v[0], 13) ^ ror(v[0], 22);
+            std::uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+            std::memmove(v + 1, v, 7 * sizeof v[0]);
+            v[4] += t1;
+            v[0] = t1 + s0 + maj;
+        }
+        for (int i = 0; i < 8; i++)
+            state_[i] += v[i];
+    }
+
+    std::uint32_t state_[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                               0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char block_[64];
+    std::size_t used_ = 0;
+    std::uint64_t length_ = 0;
+};
+
+// The SHA-256 of FILE's content, or "" if it cannot be read
+static std::string file_sha256(const std::filesystem::path& file) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in)
+        return "";
+    Sha256 sha;
+    char buffer[1 << 16];
+    while (in.read(buffer, sizeof buffer) || in.gcount() > 0)
+        sha.update(buffer, static_cast<std::size_t>(in.gcount()));
+    return in.bad() ? "" : sha.hex();
+}
+
+// A file write_blob_files() creates: blob OID at DEST, with git's MODE
+struct BlobFile {
+    std::filesystem::path dest;
+    std::string mode;
+    std::string oid;
+};
+
+struct StoreStats {
+    std::atomic<std::size_t> files{0};  // regular files seen
+    std::atomic<std::size_t> linked{0};  // of which served from the store
+    std::atomic<std::uintmax_t> bytes{0};
+    std::atomic<std::uintmax_t> linked_bytes{0};
+};
+
+static std::filesystem::path store_object_path(const std::string& oid, bool exec) {
+    return std::filesystem::path(opt.store_dir) / "objects" / oid.substr(0, 2) /
+           (oid.substr(2) + (exec ? ".x" : ""));
+}
+
+// The file listing the outputs that were linked to OBJECT
+static std::filesystem::path store_refs_path(const std::filesystem::path& object) {
+    return std::filesystem::path(opt.store_dir) / "refs" / object.parent_path().filename() / object.filename();
+}
+
+// Records FILE as linked to OBJECT. Lines are appended in one short write,
+// so concurrent runs do not interleave them.
+static void store_add_ref(const std::filesystem::path& object, const std::filesystem::path& file) {
+    std::error_code ec;
+    std::string line = std::filesystem::absolute(file, ec).string();
+    if (ec || line.find('\n') != std::string::npos)
+        return;
+    std::filesystem::path refs = store_refs_path(object);
+    std::filesystem::create_directories(refs.parent_path(), ec);
+    std::ofstream out(refs, std::ios::app | std::ios::binary);
+    out << line + "\n" << std::flush;
+}
+
+// Creates TO, which must not exist, sharing FROM's blocks: a reflink where the
+// filesystem allows, or with --store-links a hardlink, which keeps FROM's
+// mode. Creates nothing and returns false where neither is possible.
+static bool store_share(const std::filesystem::path& from,
+                        const std::filesystem::path& to,
+                        std::filesystem::perms mode,
+                        std::error_code& ec) {
+#ifdef FICLONE
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in >= 0) {
+        int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        bool cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+        if (out >= 0)
+            close(out);
+        close(in);
+        if (cloned) {
+            std::filesystem::permissions(to, mode, ec);
+            if (!ec)
+                return true;
+        }
+        if (out >= 0)
+            unlink(to.c_str());
+    }
+#endif
+    if (!opt.store_links) {
+        ec = std::make_error_code(std::errc::operation_not_supported);
+        return false;
+    }
+    std::filesystem::create_hard_link(from, to, ec);
+    return !ec;
+}
+
+// Creates TO, which must not exist, as a copy of FROM with MODE: a reflink
+// where the filesystem allows, else a copy_file_range or read/write copy, so
+// that writing to one never changes the other. With --store-links a hardlink
+// stands in for the copy, and TO keeps FROM's mode.
+static bool store_copy(const std::filesystem::path& from,
+                       const std::filesystem::path& to,
+                       std::filesystem::perms mode,
+                       std::error_code& ec) {
+    if (opt.store_links)
+        return store_share(from, to, mode, ec);
+    CopyStats stats;
+    if (copy_file_fast(from, to, stats, ec))
+        std::filesystem::permissions(to, mode, ec);
+    if (ec) {
+        std::error_code ignored;
+        std::filesystem::remove(to, ignored);
+    }
+    return !ec;
+}
+
+// Whether the stored OBJECT still holds blob OID. One that does not (edited
+// through a hardlink, say) is removed, so that it is stored afresh.
+static bool store_object_valid(const std::filesystem::path& object, const std::string& oid) {
+    if (git_blob_id(object) == oid)
+        return true;
+    std::error_code ec;
+    if (std::filesystem::remove(object, ec) && opt.verbose)
+        std::fprintf(stderr, "%s: store: removed corrupt object %s\n", PROGRAM_NAME, object.string().c_str());
+    return false;
+}
+
+// Unique name next to PATH for a link that is then renamed over it
+static std::filesystem::path store_temp_path(const std::filesystem::path& path) {
+    static std::atomic<unsigned> counter{0};
+    std::filesystem::path temp = path;
+    temp += ".sip-" + std::to_string(counter++) + "-" + std::to_string(
+#ifdef _WIN32
+                                                            GetCurrentProcessId()
+#else
+                                                            getpid()
+#endif
+                                                        );
+    return temp;
+}
+
+// Points FILE (existing or not) at the stored OBJECT, writable by its owner,
+// if the two can share storage; FILE is left alone otherwise
+static bool store_link(const std::filesystem::path& object, const std::filesystem::path& file) {
+    std::error_code ec;
+    std::filesystem::path temp = store_temp_path(file);
+    std::filesystem::perms mode = std::filesystem::status(object, ec).permissions() |
+                                  std::filesystem::perms::owner_write;
+    if (ec || !store_share(object, temp, mode, ec))
+        return false;
+    std::filesystem::rename(temp, file, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    std::filesystem::last_write_time(object, std::filesystem::file_time_type::clock::now(), ec);
+    store_add_ref(object, file);
+    return true;
+}
+
+// Serves FILE from the store when OID (computed if empty) is already there,
+// or adds it to the store otherwise. Failures, and a stored blob that FILE
+// cannot share blocks with, leave FILE as written.
+static void store_file(const std::filesystem::path& file, std::string oid, StoreStats& stats) {
+    std::error_code ec;
+    auto status = std::filesystem::symlink_status(file, ec);
+    if (ec || !std::filesystem::is_regular_file(status))
+        return;
+    std::uintmax_t size = std::filesystem::file_size(file, ec);
+    if (oid.empty())
+        oid = git_blob_id(file);
+    if (ec || oid.size() != 40)
+        return;
+    bool exec = (status.permissions() & std::filesystem::perms::owner_exec) != std::filesystem::perms::none;
+    std::filesystem::path object = store_object_path(oid, exec);
+    stats.files++;
+    stats.bytes += size;
+
+    if (std::filesystem::file_size(object, ec) == size && !ec && store_object_valid(object, oid)) {
+        if (store_link(object, file)) {
+            stats.linked++;
+            stats.linked_bytes += size;
+        }
+        return;
+    }
+    ec.clear();
+    std::filesystem::create_directories(object.parent_path(), ec);
+    // objects are read-only, so that a hardlinked output is not edited in place
+    std::filesystem::path temp = store_temp_path(object);
+    std::filesystem::perms mode = status.permissions() & ~(std::filesystem::perms::owner_write |
+                                                           std::filesystem::perms::group_write |
+                                                           std::filesystem::perms::others_write);
+    if (store_copy(file, temp, mode, ec)) {
+        // a hardlink took FILE's mode, which the object must not keep
+        if (opt.store_links)
+            std::filesystem::permissions(temp, mode, ec);
+        std::filesystem::rename(temp, object, ec);
+        if (ec)
+            std::filesystem::remove(temp, ec);
+        else
+            store_add_ref(object, file);
+    }
+}
+
+// Links those of FILES that the store already holds into place instead of
+// writing them, counting each in STATS, and returns the rest to be written.
+// Symbolic links are always among the rest.
+static std::vector<BlobFile> store_serve_files(const std::vector<BlobFile>& files, StoreStats& stats) {
+    std::vector<BlobFile> rest;
+    for (const auto& entry : files) {
+        std::error_code ec;
+        std::filesystem::path object = store_object_path(entry.oid, entry.mode == "100755");
+        std::uintmax_t size = entry.mode == "120000" ? 0 : std::filesystem::file_size(object, ec);
+        if (entry.mode != "120000" && !ec && store_object_valid(object, entry.oid)) {
+            std::filesystem::create_directories(entry.dest.parent_path(), ec);
+            if (std::filesystem::is_directory(entry.dest, ec) && !std::filesystem::is_symlink(entry.dest, ec))
+                std::filesystem::remove_all(entry.dest, ec);
+            if (store_link(object, entry.dest)) {
+                stats.files++;
+                stats.linked++;
+                stats.bytes += size;
+                stats.linked_bytes += size;
+                continue;
+            }
+        }
+        rest.push_back(entry);
+    }
+    return rest;
+}
+
+// Runs store_file over every regular file below ROOT on io_workers() threads
+static void store_tree(const std::filesystem::path& root, StoreStats& stats) {
+    std::vector<std::filesystem::path> files;
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(root, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file() && !it->is_symlink())
+            files.push_back(it->path());
+    }
+
+    parallel_for(files.size(), io_workers(), [&](std::size_t i) { store_file(files[i], "", stats); });
+}
+
+// Adds one run's STATS to the running totals in DIR/stats, which
+// --store-stats reports as the dedup ratio
+static void store_record(const StoreStats& stats, const std::string& what) {
+    if (stats.files == 0)
+        return;
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: store: %zu of %zu files in '%s' deduplicated (%ju of %ju bytes)\n",
+                     PROGRAM_NAME, stats.linked.load(), stats.files.load(), what.c_str(),
+                     stats.linked_bytes.load(), stats.bytes.load());
+    std::filesystem::path file = std::filesystem::path(opt.store_dir) / "stats";
+    CacheLock lock(file.string() + ".lock");
+    if (!lock.held())
+        return;
+    std::map<std::string, unsigned long long> totals;
+    {
+        std::ifstream in(file);
+        std::string key;
+        unsigned long long value;
+        while (in >> key >> value)
+            totals[key] = value;
+    }
+    totals["files"] += stats.files;
+    totals["linked"] += stats.linked;
+    totals["bytes"] += stats.bytes;
+    totals["linked_bytes"] += stats.linked_bytes;
+    // write-and-rename, so that an interrupted run cannot lose the totals
+    std::filesystem::path temp = file.string() + ".tmp";
+    std::error_code ec;
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        for (const auto& [key, value] : totals)
+            out << key << " " << value << "\n";
+        if (!out.flush())
+            ec = std::make_error_code(std::errc::io_error);
+    }
+    if (!ec)
+        std::filesystem::rename(temp, file, ec);
+    if (ec)
+        std::filesystem::remove(temp, ec);
+}
+
+// --store-stats: what the store holds and how much writing it has saved
+static bool store_print_stats() {
+    std::filesystem::path objects = std::filesystem::path(opt.store_dir) / "objects";
+    std::uintmax_t count = 0, size = 0, links = 0;
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(objects, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file())
+            continue;
+        count++;
+        size += it->file_size();
+        links += it->hard_link_count() - 1;
+    }
+    std::map<std::string, unsigned long long> totals;
+    std::ifstream in(std::filesystem::path(opt.store_dir) / "stats");
+    std::string key;
+    unsigned long long value;
+    while (in >> key >> value)
+        totals[key] = value;
+
+    unsigned long long written = totals["bytes"] - totals["linked_bytes"];
+    std::printf("store:          %s\n", opt.store_dir.c_str());
+    std::printf("objects:        %ju (%ju bytes, %ju hardlinked outputs)\n", count, size, links);
+    std::printf("files:          %llu (%llu bytes)\n", totals["files"], totals["bytes"]);
+    std::printf("deduplicated:   %llu (%llu bytes)\n", totals["linked"], totals["linked_bytes"]);
+    std::printf("dedup ratio:    %.2f\n", written ? static_cast<double>(totals["bytes"]) / written : 1.0);
+    return true;
+}
+
+// Rewrites the refs of OBJECT (blob OID) to the outputs that still hold it:
+// a hardlink, or a file with the blob's content. Returns whether any does.
+static bool store_live_refs(const std::filesystem::path& object, const std::string& oid, std::uintmax_t size) {
+    std::filesystem::path refs = store_refs_path(object);
+    std::vector<std::string> recorded, live;
+    {
+        std::ifstream in(refs);
+        std::string line;
+        while (std::getline(in, line))
+            recorded.push_back(line);
+    }
+    std::set<std::string> seen;
+    for (const auto& path : recorded) {
+        std::error_code ec;
+        if (!seen.insert(path).second)
+            continue;
+        bool holds = std::filesystem::equivalent(object, path, ec);
+        if (!holds && !ec && std::filesystem::is_regular_file(path, ec) &&
+            std::filesystem::file_size(path, ec) == size && !ec)
+            holds = git_blob_id(path) == oid;
+        if (holds)
+            live.push_back(path);
+    }
+    std::error_code ec;
+    if (live.empty()) {
+        std::filesystem::remove(refs, ec);
+    } else if (live.size() != recorded.size()) {
+        // appends racing this rewrite only matter to the next gc: outputs
+        // never depend on the store object they were linked to
+        std::filesystem::path temp = store_temp_path(refs);
+        {
+            std::ofstream out(temp, std::ios::trunc | std::ios::binary);
+            for (const auto& path : live)
+                out << path << "\n";
+        }
+        std::filesystem::rename(temp, refs, ec);
+        if (ec)
+            std::filesystem::remove(temp, ec);
+    }
+    return !live.empty();
+}
+
+// --store-gc: removes objects that were last used more than
+// DEFAULT_STORE_GC_AGE ago and that neither a hardlink nor a recorded output
+// still holds, plus leftovers of interrupted runs
+static bool store_gc() {
+    TraceSpan span("phase", "store gc");
+    std::filesystem::path objects = std::filesystem::path(opt.store_dir) / "objects";
+    auto cutoff = std::filesystem::file_time_type::clock::now() - std::chrono::seconds(DEFAULT_STORE_GC_AGE);
+    std::vector<std::filesystem::path> doomed;
+    std::uintmax_t kept = 0, freed = 0;
+    std::error_code ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(objects, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file())
+            continue;
+        std::string name = it->path().filename().string();
+        bool temp = name.find(".sip-") != std::string::npos;
+        bool exec = name.size() > 2 && name.compare(name.size() - 2, 2, ".x") == 0;
+        std::string oid = it->path().parent_path().filename().string() + name.substr(0, name.size() - (exec ? 2 : 0));
+        if (temp || (it->last_write_time() < cutoff && it->hard_link_count() == 1 &&
+                     !store_live_refs(it->path(), oid, it->file_size()))) {
+            doomed.push_back(it->path());
+            freed += it->file_size();
+        } else {
+            kept++;
+        }
+    }
+    if (ec) {
+        std::fprintf(stderr, "%s: cannot read store %s: %s\n", PROGRAM_NAME, objects.string().c_str(),
+                     ec.message().c_str());
+        return false;
+    }
+    for (const auto& path : doomed)
+        std::filesystem::remove(path, ec);
+    if (!opt.quiet)
+        std::printf("%s: removed %zu objects (%ju bytes), kept %ju\n", PROGRAM_NAME, doomed.size(), freed,
+                    kept);
+    span.arg("removed", static_cast<long long>(doomed.size()));
+    return true;
+}
+
+// Downloads the listed files of DIRS (LISTINGS[i] for DIRS[i]) at commit REV
+// with raw requests, all made at once by one curl run (or the built-in
+// transport) that transfers them in parallel over shared connections. Used
+// by --strategy=auto for small directories, where this beats a clone.
+static bool download_directories_raw(const std::string& owner,
+                                     const std::string& repo,
+                                     const std::string& rev,
+                                     std::vector<DirRequest>& dirs,
+                                     const std::vector<std::vector<TreeBlob>>& listings) {
+    TraceSpan span("phase", "raw download");
+    std::vector<std::pair<std::string, std::string>> transfers;  // output, url
+    for (std::size_t i = 0; i < dirs.size(); i++) {
+        for (const auto& blob : listings[i]) {
+            // a symlink's blob is its target, read back once downloaded
+            std::filesystem::path dest = std::filesystem::path(dirs[i].output) / blob.path;
+            std::error_code ec;
+            std::filesystem::create_directories(dest.parent_path(), ec);  // curl's would be 0750
+            transfers.emplace_back(dest.string() + (blob.mode == "120000" ? ".sip-link" : ""),
+                                   raw_file_url(owner, repo, rev, dirs[i].path + "/" + blob.path));
+        }
+    }
+    span.arg("files", static_cast<long long>(transfers.size()));
+
+#ifdef SIP_WITH_LIBCURL
+    std::vector<HttpRequest> requests;
+    for (const auto& transfer : transfers)
+        requests.emplace_back(transfer.second, transfer.first);
+    std::vector<HttpRequest*> pending;
+    for (auto& request : requests)
+        pending.push_back(&request);
+    HttpClient::instance().fetch(pending);
+    bool ok = true;
+    for (const auto& request : requests) {
+        if (!request.ok()) {
+            std::fprintf(stderr, "%s: raw download of %s failed: %s\n", PROGRAM_NAME, request.url.c_str(),
+                         request.error.empty() ? ("HTTP " + std::to_string(request.status)).c_str()
+                                               : request.error.c_str());
+            ok = false;
+        }
+    }
+#else
+    // every URL is on the raw file server, so one header serves them all
+    std::vector<std::string> args = {"curl", chatty() ? "--progress-bar" : "-s"};
+    std::vector<std::string> auth = curl_auth_args(transfers.empty() ? "" : transfers.front().second);
+    args.insert(args.end(), auth.begin(), auth.end());
+    args.insert(args.end(), {"-f", "-L", "--retry", "3", "--retry-delay", "1", "--max-time",
+                             std::to_string(opt.timeout), "--parallel", "--parallel-max",
+                             std::to_string(opt.jobs)});
+    for (const auto& transfer : transfers)
+        args.insert(args.end(), {"-o", transfer.first, transfer.second});
+
+    int result = run_process(args).status;
+    bool ok = result == 0;
+    if (!ok)
+        std::fprintf(stderr, "%s: raw download failed (exit %d)\n", PROGRAM_NAME, result);
+#endif
+    for (std::size_t i = 0; ok && i < dirs.size(); i++) {
+        for (const auto& blob : listings[i]) {
+            std::filesystem::path dest = std::filesystem::path(dirs[i].output) / blob.path;
+            std::error_code ec;
+            if (blob.mode == "120000") {
+                std::filesystem::path link = dest;
+                link += ".sip-link";
+                std::ifstream in(link, std::ios::binary);
+                std::string target((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                in.close();
+                std::filesystem::remove(link, ec);
+                std::filesystem::create_symlink(target, dest, ec);
+            } else if (blob.mode == "100755") {
+                std::filesystem::permissions(dest,
+                                             std::filesystem::perms::owner_exec |
+                                                 std::filesystem::perms::group_exec |
+                                                 std::filesystem::perms::others_exec,
+                                             std::filesystem::perm_options::add, ec);
+            }
+            if (ec) {
+                std::fprintf(stderr, "%s: cannot create %s: %s\n", PROGRAM_NAME, dest.string().c_str(),
+                             ec.message().c_str());
+                ok = false;
+            }
+        }
+    }
+    for (auto& dir : dirs) {
+        std::error_code ec;
+        dir.ok = ok;
+        if (!ok)
+            std::filesystem::remove_all(dir.output, ec);
+    }
+    return ok;
+}
+
+// A JSON value, parsed just far enough for the GitHub tree and LFS batch APIs
+struct JsonValue {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+    Type type = Type::Null;
+    std::string text;               // String contents; Number and Bool as written
+    std::vector<JsonValue> items;   // Array elements, or Object values
+    std::vector<std::string> keys;  // Object member names, matching items
+
+    const JsonValue* get(const std::string& key) const {
+        for (std::size_t i = 0; i < keys.size(); i++) {
+            if (keys[i] == key)
+                return &items[i];
+        }
+        return nullptr;
+    }
+};
+
+static bool parse_json(const char*& p, const char* end, JsonValue& value, int depth = 0) {
+    auto skip = [&]() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            p++;
+    };
+    auto parse_string = [&](std::string& out) {
+        p++;  // the opening quote
+        while (p < end && *p != '"') {
+            if (*p != '\\') {
+                out += *p++;
+                continue;
+            }
+            if (++p == end)
+                return false;
+            char c = *p++;
+            if (c == 'u') {
+                if (end - p < 4)
+                    return false;
+                unsigned code = static_cast<unsigned>(std::strtoul(std::string(p, 4).c_str(), nullptr, 16));
+                p += 4;
+                // a surrogate pair is one code point
+                if (code >= 0xd800 && code < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    unsigned low = static_cast<unsigned>(std::strtoul(std::string(p + 2, 4).c_str(), nullptr, 16));
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    p += 6;
+                }
+                if (code < 0x80) {
+                    out += static_cast<char>(code);
+                } else if (code < 0x800) {
+                    out += static_cast<char>(0xc0 | code >> 6);
+                    out += static_cast<char>(0x80 | (code & 0x3f));
+                } else if (code < 0x10000) {
+                    out += static_cast<char>(0xe0 | code >> 12);
+                    out += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+                    out += static_cast<char>(0x80 | (code & 0x3f));
+                } else {
+                    out += static_cast<char>(0xf0 | code >> 18);
+                    out += static_cast<char>(0x80 | (code >> 12 & 0x3f));
+                    out += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+                    out += static_cast<char>(0x80 | (code & 0x3f));
+                }
+            } else {
+                const char* from = "\"\\/bfnrt";
+                const char* to = "\"\\/\b\f\n\r\t";
+                const char* at = std::strchr(from, c);
+                if (!at || c == '\0')
+                    return false;
+                out += to[at - from];
+            }
+        }
+        if (p == end)
+            return false;
+        p++;  // the closing quote
+        return true;
+    };
+
+    skip();
+    if (p == end || depth > 64)
+        return false;
+    if (*p == '{' || *p == '[') {
+        bool object = *p++ == '{';
+        value.type = object ? JsonValue::Type::Object : JsonValue::Type::Array;
+        skip();
+        if (p < end && *p == (object ? '}' : ']')) {
+            p++;
+            return true;
+        }
+        while (true) {
+            if (object) {
+                skip();
+                if (p == end || *p != '"')
+                    return false;
+                value.keys.emplace_back();
+                if (!parse_string(value.keys.back()))
+                    return false;
+                skip();
+                if (p == end || *p++ != ':')
+                    return false;
+            }
+            value.items.emplace_back();
+            if (!parse_json(p, end, value.items.back(), depth + 1))
+                return false;
+            skip();
+            if (p == end)
+                return false;
+            char c = *p++;
+            if (c == (object ? '}' : ']'))
+                return true;
+            if (c != ',')
+                return false;
+        }
+    }
+    if (*p == '"') {
+        value.type = JsonValue::Type::String;
+        return parse_string(value.text);
+    }
+    const char* start = p;
+    while (p < end && std::strchr(",}] \t\r\n", *p) == nullptr)
+        p++;
+    value.text.assign(start, p);
+    if (value.text == "null")
+        value.type = JsonValue::Type::Null;
+    else if (value.text == "true" || value.text == "false")
+        value.type = JsonValue::Type::Bool;
+    else if (!value.text.empty() && std::strchr("-0123456789", value.text[0]))
+        value.type = JsonValue::Type::Number;
+    else
+        return false;
+    return true;
+}
+
+// --strategy=auto: how a directory download proceeds
+enum class Plan { Sparse, Raw, FullFetch };
+
+// What the plan is made from: the selected files of each directory, and how
+// much of the commit they are. Byte counts are known only from the tree API.
+struct PlanInput {
+    std::vector<std::vector<TreeBlob>> listings;  // selected files, per directory
+    bool all_found = true;                        // every directory exists
+    std::size_t files = 0, total_files = 0;
+    std::uint64_t bytes = 0, total_bytes = 0;
+    bool sized = false;
+};
+
+// Lists DIRS at COMMIT with blob sizes from GitHub's REST tree API, which
+// knows them before any blob is fetched. Used when the git server is GitHub,
+// or SIP_API_BASE_URL names a compatible API; false when it is not in use or
+// cannot list the commit in full (a truncated listing, a rate limit).
+static bool plan_input_from_api(const std::string& owner,
+                                const std::string& repo,
+                                const std::string& commit,
+                                const std::vector<DirRequest>& dirs,
+                                PlanInput& input) {
+    const char* api = std::getenv("SIP_API_BASE_URL");
+    std::string git = base_url(opt.git_base_url, "SIP_GIT_BASE_URL", "https://github.com");
+    if ((!api || !*api) && git != "https://github.com")
+        return false;
+    std::string url = base_url("", "SIP_API_BASE_URL", "https://api.github.com") + "/repos/" + owner + "/" +
+                      repo + "/git/trees/" + commit + "?recursive=1";
+    TraceSpan span("phase", "tree listing");
+    const std::string accept = "Accept: application/vnd.github+json";
+#ifdef SIP_WITH_LIBCURL
+    HttpRequest request(url);
+    request.headers = {accept};
+    HttpClient::instance().fetch({&request});
+    bool fetched = request.ok();
+    std::string answer = request.body;
+#else
+    std::vector<std::string> args = {"curl", "-s"};
+    std::vector<std::string> auth = curl_auth_args(url);
+    args.insert(args.end(), auth.begin(), auth.end());
+    args.insert(args.end(), {"-H", accept, "-f", "-L", "--retry", "3", "--retry-delay", "1", "--max-time",
+                             std::to_string(opt.timeout), url});
+    RunOptions options;
+    options.out = Stream::Capture;
+    RunResult result = run_process(args, options);
+    bool fetched = result.status == 0;
+    std::string answer = result.out;
+#endif
+    JsonValue reply;
+    const char* p = answer.data();
+    const JsonValue* tree =
+        fetched && parse_json(p, answer.data() + answer.size(), reply) ? reply.get("tree") : nullptr;
+    const JsonValue* truncated = reply.get("truncated");
+    if (!tree || (truncated && truncated->text == "true")) {
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: no complete tree listing from %s, planning from file counts\n", PROGRAM_NAME,
+                         url.c_str());
+        return false;
+    }
+
+    std::vector<std::string> prefixes;
+    std::vector<bool> found(dirs.size(), false);
+    for (const auto& dir : dirs)
+        prefixes.push_back(dir.path.empty() ? "" : dir.path + "/");
+    input.listings.assign(dirs.size(), {});
+    for (const auto& item : tree->items) {
+        const JsonValue* type = item.get("type");
+        const JsonValue* path = item.get("path");
+        const JsonValue* mode = item.get("mode");
+        const JsonValue* sha = item.get("sha");
+        const JsonValue* size = item.get("size");
+        if (!type || !path)
+            continue;
+        for (std::size_t i = 0; i < dirs.size(); i++) {
+            if (type->text == "tree" && path->text == dirs[i].path)
+                found[i] = true;
+        }
+        if (type->text != "blob" || !mode || !sha || !size)
+            continue;
+        std::uint64_t bytes = std::strtoull(size->text.c_str(), nullptr, 10);
+        input.total_files++;
+        input.total_bytes += bytes;
+        for (std::size_t i = 0; i < dirs.size(); i++) {
+            if (path->text.compare(0, prefixes[i].size(), prefixes[i]) != 0)
+                continue;
+            std::string rel = path->text.substr(prefixes[i].size());
+            if (!path_selected(rel))
+                continue;
+            input.listings[i].push_back({rel, sha->text, mode->text});
+            input.files++;
+            input.bytes += bytes;
+        }
+    }
+    for (std::size_t i = 0; i < dirs.size(); i++)
+        input.all_found = input.all_found && (found[i] || dirs[i].path.empty()) && !input.listings[i].empty();
+    input.sized = true;
+    return true;
+}
+
+// Lists DIRS at REV from the trees of the blob-less repository at TEMP_DIR,
+// where only file counts are known
+static void plan_input_from_trees(const std::string& temp_dir,
+                                  const std::string& rev,
+                                  const std::vector<DirRequest>& dirs,
+                                  PlanInput& input) {
+    for (const auto& dir : dirs) {
+        input.listings.push_back(selected_blobs({"-C", temp_dir}, rev + ":" + dir.path));
+        input.files += input.listings.back().size();
+        input.all_found = input.all_found && !input.listings.back().empty();
+    }
+    RunOptions options;
+    options.out = Stream::Capture;
+    std::string all = run_git({"-C", temp_dir, "ls-tree", "-r", "-z", "--name-only", rev}, options).out;
+    input.total_files = static_cast<std::size_t>(std::count(all.begin(), all.end(), '\0'));
+}
+
+// Picks the cheapest way to fetch the directories INPUT describes, and says
+// why when chatty. A full fetch is weighed by bytes, so only a sized listing
+// can lead to one.
+static Plan plan_directories(const PlanInput& input) {
+    TraceSpan span("phase", "strategy");
+    double wanted = input.sized ? static_cast<double>(input.bytes) : static_cast<double>(input.files);
+    double total = input.sized ? static_cast<double>(input.total_bytes) : static_cast<double>(input.total_files);
+    double share = total > 0 ? wanted / total : 0.0;
+    Plan plan = Plan::Sparse;
+    std::string why;
+    if (input.all_found && input.files <= AUTO_RAW_MAX_FILES) {
+        plan = Plan::Raw;
+        why = "at most " + std::to_string(AUTO_RAW_MAX_FILES) + " files are cheaper as parallel raw requests";
+    } else if (input.all_found && input.sized && share >= AUTO_FULL_FETCH_SHARE) {
+        plan = Plan::FullFetch;
+        why = "most of the repository's bytes are wanted, so one unfiltered fetch beats listing every blob";
+    } else if (input.sized) {
+        why = "a sparse checkout fetches only the blobs wanted";
+    } else {
+        why = "a sparse checkout fetches only the blobs wanted (blob sizes unknown, so no full fetch)";
+    }
+    const char* name = plan == Plan::Raw ? "raw" : plan == Plan::FullFetch ? "full fetch" : "sparse";
+    span.arg("plan", name);
+    span.arg("files", static_cast<long long>(input.files));
+    span.arg("repository_files", static_cast<long long>(input.total_files));
+    if (input.sized) {
+        span.arg("bytes", static_cast<long long>(input.bytes));
+        span.arg("repository_bytes", static_cast<long long>(input.total_bytes));
+    }
+    if (chatty() || opt.verbose) {
+        if (input.sized)
+            std::fprintf(stderr, "Strategy: %s (%zu files, %ju of %ju bytes, %.0f%%): %s\n", name, input.files,
+                         static_cast<std::uintmax_t>(input.bytes), static_cast<std::uintmax_t>(input.total_bytes),
+                         share * 100, why.c_str());
+        else
+            std::fprintf(stderr, "Strategy: %s (%zu of %zu files, %.0f%%): %s\n", name, input.files,
+                         input.total_files, share * 100, why.c_str());
+    }
+    return plan;
+}
+
+static bool download_directories_objects(const std::string& owner,
+                                         const std::string& repo,
+                                         std::vector<DirRequest>& dirs,
+                                         const std::string& ref);
+
+// Sparse-checkout download of DIRS, whose outputs are known to be free.
+static bool download_directories_sparse(const std::string& owner,
+                                        const std::string& repo,
+                                        std::vector<DirRequest>& dirs,
+                                        const std::string& ref) {
+    if (opt.trees == Trees::Path)
+        return download_directories_objects(owner, repo, dirs, ref);
+    if (!opt.cache_dir.empty())
+        return download_directories_cached(owner, repo, dirs, ref);
+
+    // cone mode takes directories; --include/--exclude need gitignore-style
+    // patterns, which only non-cone mode understands
+    std::vector<std::string> sparse_set = {"sparse-checkout", "set", filters_active() ? "--no-cone" : "--cone",
+                                           "--"};
+    for (const auto& dir : dirs) {
+        if (!filters_active()) {
+            sparse_set.push_back(dir.path);
+            continue;
+        }
+        std::vector<std::string> patterns = sparse_filter_patterns(dir.path);
+        sparse_set.insert(sparse_set.end(), patterns.begin(), patterns.end());
+    }
+
+    // clone next to the destination so the result can be renamed into place
+    std::filesystem::path near = std::filesystem::absolute(dirs.front().output).parent_path();
+    std::string temp_dir = create_temp_dir(near);
+    if (temp_dir.empty())
+        temp_dir = create_temp_dir();
+    if (temp_dir.empty()) {
+        std::fprintf(stderr, "%s: failed to create temp directory\n", PROGRAM_NAME);
+        return false;
+    }
+
+    std::string git_url = git_remote_url(owner, repo);
+    std::vector<std::string> auth = git_auth_args();
+
+    // git -C TEMP_DIR [auth] ARGS...
+    auto in_temp = [&](std::vector<std::string> args, bool with_auth = false) {
+        if (with_auth)
+            args.insert(args.begin(), auth.begin(), auth.end());
+        args.insert(args.begin(), {"-C", temp_dir});
+        return run_git(args).status;
+    };
+
+    // a ref is resolved first so that exactly one fetch, by commit id, follows;
+    // the default branch comes with the clone itself, unless --strategy=auto
+    // needs the commit to plan before anything is fetched
+    std::string sha, kind;
+    bool automatic = opt.strategy == Strategy::Auto;
+    if ((!ref.empty() || automatic) && !resolve_ref(owner, repo, ref.empty() ? "HEAD" : ref, sha, kind)) {
+        std::filesystem::remove_all(temp_dir);
+        return false;
+    }
+
+    // with the tree API the plan is made here, so that a raw download skips
+    // the clone and a full fetch is an unfiltered one from the start
+    PlanInput input;
+    auto download_raw = [&]() {
+        std::error_code ec;
+        std::filesystem::remove_all(temp_dir, ec);
+        bool ok = download_directories_raw(owner, repo, sha, dirs, input.listings);
+        if (ok && chatty())
+            std::puts("done.");
+        return ok;
+    };
+    bool planned = automatic && plan_input_from_api(owner, repo, sha, dirs, input);
+    Plan plan = planned ? plan_directories(input) : Plan::Sparse;
+    if (plan == Plan::Raw)
+        return download_raw();
+
+    int result;
+    TraceSpan transfer("phase", sha.empty() ? "clone" : "fetch");
+    if (sha.empty()) {
+        std::vector<std::string> clone_args = auth;
+        clone_args.insert(clone_args.end(), {"-c", "http.lowSpeedLimit=1000", "-c", "http.lowSpeedTime=10",
+                                             "clone", "--filter=blob:none", "--no-checkout", "--depth", "1"});
+        if (chatty())
+            clone_args.push_back("--progress");
+        clone_args.insert(clone_args.end(), {git_url, temp_dir});
+
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: cloning repository...\n", PROGRAM_NAME);
+
+        result = run_git(clone_args).status;
+        if (result != 0) {
+            std::fprintf(stderr, "%s: clone failed (exit %d)\n", PROGRAM_NAME, result);
+            std::filesystem::remove_all(temp_dir);
+            return false;
+        }
+    } else {
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: fetching %s '%s' (%s)...\n", PROGRAM_NAME, kind.c_str(),
+                         ref.empty() ? "HEAD" : ref.c_str(), sha.c_str());
+
+        // a filtered fetch registers origin as the promisor remote, which the
+        // checkout then lazily fetches the selected blobs from
+        result = in_temp({"init", "-q"});
+        if (result == 0)
+            result = in_temp({"remote", "add", "origin", git_url});
+        if (result == 0) {
+            // a full fetch takes every blob of the commit in one pack, with no
+            // id list to send
+            std::vector<std::string> fetch_args = {"-c", "http.lowSpeedLimit=1000", "-c", "http.lowSpeedTime=10",
+                                                   "fetch", "--no-tags", "--depth", "1"};
+            if (plan != Plan::FullFetch)
+                fetch_args.push_back("--filter=blob:none");
+            fetch_args.insert(fetch_args.end(), {chatty() ? "--progress" : "-q", "origin", sha});
+            result = in_temp(fetch_args, true);
+        }
+        if (result != 0) {
+            std::fprintf(stderr, "%s: fetch failed for '%s' (exit %d)\n", PROGRAM_NAME,
+                         ref.empty() ? "HEAD" : ref.c_str(), result);
+            std::filesystem::remove_all(temp_dir);
+            return false;
+        }
+    }
+
+    transfer.finish();
+
+    // elsewhere it is made from the fetched trees, by file count
+    if (automatic && !planned) {
+        plan_input_from_trees(temp_dir, sha, dirs, input);
+        if (plan_directories(input) == Plan::Raw)
+            return download_raw();
+    }
+
+    TraceSpan setup("phase", "sparse-checkout setup");
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: initializing sparse checkout...\n", PROGRAM_NAME);
+
+    result = in_temp({"sparse-checkout", "init", filters_active() ? "--no-cone" : "--cone"});
+    if (result != 0) {
+        std::fprintf(stderr, "%s: sparse-checkout init failed (exit %d)\n", PROGRAM_NAME, result);
+        std::filesystem::remove_all(temp_dir);
+        return false;
+    }
+
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: setting sparse checkout pattern...\n", PROGRAM_NAME);
+
+    result = in_temp(sparse_set);
+    if (result != 0) {
+        std::fprintf(stderr, "%s: sparse-checkout set failed (exit %d)\n", PROGRAM_NAME, result);
+        std::filesystem::remove_all(temp_dir);
+        return false;
+    }
+
+    setup.finish();
+
+    std::vector<std::string> trees;
+    std::set<std::string> only;
+    for (const auto& dir : dirs) {
+        trees.push_back((sha.empty() ? "HEAD" : sha) + ":" + dir.path);
+        for (const auto& blob : filters_active() ? selected_blobs({"-C", temp_dir}, trees.back())
+                                                 : std::vector<TreeBlob>())
+            only.insert(blob.oid);
+    }
+    if (!prefetch_blobs({"-C", temp_dir}, trees, filters_active() ? &only : nullptr)) {
+        std::filesystem::remove_all(temp_dir);
+        return false;
+    }
+
+    TraceSpan checkout("phase", "checkout");
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: checking out '%s'...\n", PROGRAM_NAME,
+                     ref.empty() ? "default branch" : ref.c_str());
+
+    std::vector<std::string> checkout_args = git_checkout_args();
+    if (sha.empty())
+        checkout_args.push_back("checkout");
+    else
+        checkout_args.insert(checkout_args.end(), {"checkout", "-q", "--detach", sha});
+    result = in_temp(checkout_args);
+    if (result != 0) {
+        std::fprintf(stderr, "%s: checkout failed (exit %d)\n", PROGRAM_NAME, result);
+        std::filesystem::remove_all(temp_dir);
+        return false;
+    }
+    checkout.finish();
+    mark_lfs_dirs({"-C", temp_dir}, sha.empty() ? "HEAD" : sha, dirs);
+
+    // a directory that contains, or sits inside, another requested one is
+    // needed by both and has to be copied rather than moved
+    auto overlaps = [&dirs](const DirRequest& dir) {
+        for (const auto& other : dirs) {
+            if (&other == &dir)
+                continue;
+            const std::string& a = other.path.size() < dir.path.size() ? other.path : dir.path;
+            const std::string& b = other.path.size() < dir.path.size() ? dir.path : other.path;
+            if (b == a || b.compare(0, a.size() + 1, a + "/") == 0)
+                return true;
+        }
+        return false;
+    };
+
+    bool ok = true;
+    for (auto& dir : dirs) {
+        std::filesystem::path src_path = std::filesystem::path(temp_dir) / dir.path;
+        std::filesystem::path dest_path = std::filesystem::current_path() / dir.output;
+
+        std::error_code copy_ec;
+        if (!std::filesystem::is_directory(src_path, copy_ec) && filters_active() &&
+            git_output({"-C", temp_dir, "cat-file", "-t", (sha.empty() ? "HEAD" : sha) + ":" + dir.path}) ==
+                "tree") {
+            // present, but the filters left nothing in it
+            if (chatty())
+                std::fprintf(stderr, "%s: no files in '%s' match the filters\n", PROGRAM_NAME, dir.path.c_str());
+            dir.ok = std::filesystem::create_directories(dest_path, copy_ec);
+            ok = ok && dir.ok;
+            continue;
+        }
+        if (!std::filesystem::is_directory(src_path, copy_ec)) {
+            std::fprintf(stderr, "%s: directory '%s' not found in repository\n", PROGRAM_NAME,
+                         dir.path.c_str());
+            dir.missing = true;
+            ok = false;
+            continue;
+        }
+        materialize_tree(src_path, dest_path, overlaps(dir), copy_ec);
+        dir.ok = !copy_ec;
+        if (copy_ec) {
+            std::fprintf(stderr, "%s: copy failed for '%s': %s\n", PROGRAM_NAME, dir.path.c_str(),
+                         copy_ec.message().c_str());
+            ok = false;
+        }
+    }
+
+    TraceSpan cleanup("phase", "cleanup");
+    std::error_code ec;
+    std::filesystem::remove_all(temp_dir, ec);
+    if (ec && opt.verbose) {
+        std::fprintf(stderr, "%s: warning: failed to remove temp dir: %s\n", PROGRAM_NAME,
+                     ec.message().c_str());
+    }
+
+    if (ok && chatty())
+        std::puts("done.");
+    return ok;
+}
+
+// Tarball engine: the codeload archive of REF is streamed from curl through
+// an in-process gzip and tar decoder, and only entries under the requested
+// directories are written. Nothing else touches the disk.
+
+// Bounded hand-off from the thread reading curl's output to the decoder, so
+// the archive is decoded as it arrives without ever being held whole.
+class ByteChannel {
+public:
+    // producer side; false once the consumer has given up
+    bool push(const char* data, std::size_t size) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_.wait(lock, [this]() { return closed_ || chunks_.size() < MAX_CHUNKS; });
+        if (closed_)
+            return false;
+        chunks_.emplace_back(data, size);
+        ready_.notify_one();
+        return true;
+    }
+
+    // producer side: no more data will follow
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+        ready_.notify_all();
+    }
+
+    // consumer side: stop accepting data
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        space_.notify_all();
+    }
+
+    // consumer side: the next byte, or -1 at the end of the input
+    int get() {
+        if (pos_ == current_.size() && !refill())
+            return -1;
+        return static_cast<unsigned char>(current_[pos_++]);
+    }
+
+private:
+    static const std::size_t MAX_CHUNKS = 16;
+
+    bool refill() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return !chunks_.empty() || finished_; });
+        if (chunks_.empty())
+            return false;
+        current_ = std::move(chunks_.front());
+        chunks_.pop_front();
+        pos_ = 0;
+        space_.notify_one();
+        return true;
+    }
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable space_;
+    std::deque<std::string> chunks_;
+    bool finished_ = false;
+    bool closed_ = false;
+    std::string current_;
+    std::size_t pos_ = 0;
+};
+
+static std::uint32_t crc32_update(std::uint32_t crc, const unsigned char* data, std::size_t size) {
+    static const auto table = []() {
+        std::vector<std::uint32_t> t(256);
+        for (std::uint32_t i = 0; i < 256; i++) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Streaming gzip decoder (RFC 1952 around RFC 1951 deflate). Input is pulled
+// from a ByteChannel and output handed to the sink in chunks as it is
+// produced; only the 32K back-reference window is kept in memory.
+class GzipDecoder {
+public:
+    using Sink = std::function<bool(const unsigned char*, std::size_t)>;
+
+    GzipDecoder(ByteChannel& in, Sink sink) : in_(in), sink_(std::move(sink)) {}
+
+    // Decodes every gzip member in the input. On failure error() says why.
+    bool run() {
+        do {
+            if (!member())
+                return false;
+        } while (!at_end());
+        return true;
+    }
+
+    const std::string& error() const { return error_; }
+
+private:
+    static const std::size_t WINDOW = 32768;
+    static const std::size_t FLUSH = 65536;
+
+    // Canonical Huffman code as a lookup table indexed by the next `bits`
+    // input bits; entries are symbol << 4 | code length, 0 if invalid.
+    struct Huffman {
+        std::vector<std::uint16_t> table;
+        int bits = 0;
+    };
+
+    bool fail(const char* what) {
+        if (error_.empty())
+            error_ = what;
+        return false;
+    }
+
+    bool need(int n) {
+        while (bitcnt_ < n) {
+            int c = in_.get();
+            if (c < 0)
+                return fail("truncated gzip stream");
+            bitbuf_ |= static_cast<std::uint64_t>(c) << bitcnt_;
+            bitcnt_ += 8;
+        }
+        return true;
+    }
+
+    // N bits, least significant first; 0 once the decoder has failed
+    std::uint32_t bits(int n) {
+        if (!need(n))
+            return 0;
+        std::uint32_t value = static_cast<std::uint32_t>(bitbuf_ & ((1u << n) - 1));
+        bitbuf_ >>= n;
+        bitcnt_ -= n;
+        return value;
+    }
+
+    void align() {
+        bitbuf_ >>= bitcnt_ % 8;
+        bitcnt_ -= bitcnt_ % 8;
+    }
+
+    bool at_end() {
+        if (bitcnt_ >= 8)
+            return false;
+        int c = in_.get();
+        if (c < 0)
+            return true;
+        bitbuf_ |= static_cast<std::uint64_t>(c) << bitcnt_;
+        bitcnt_ += 8;
+        return false;
+    }
+
+    bool build(Huffman& h, const std::uint8_t* lengths, int n) {
+        int count[16] = {0};
+        for (int i = 0; i < n; i++)
+            count[lengths[i]]++;
+        count[0] = 0;
+        int left = 1;
+        h.bits = 0;
+        for (int len = 1; len < 16; len++) {
+            left = (left << 1) - count[len];
+            if (left < 0)
+                return fail("invalid Huffman code");
+            if (count[len])
+                h.bits = len;
+        }
+        int next[16] = {0};
+        for (int len = 1, code = 0; len < 16; len++) {
+            code = (code + count[len - 1]) << 1;
+            next[len] = code;
+        }
+        h.table.assign(std::size_t(1) << h.bits, 0);
+        for (int sym = 0; sym < n; sym++) {
+            int len = lengths[sym];
+            if (!len)
+                continue;
+            int code = next[len]++, reversed = 0;
+            for (int i = 0; i < len; i++)
+                reversed |= ((code >> i) & 1) << (len - 1 - i);
+            for (std::size_t r = reversed; r < h.table.size(); r += std::size_t(1) << len)
+                h.table[r] = static_cast<std::uint16_t>(sym << 4 | len);
+        }
+        return true;
+    }
+
+    int decode(const Huffman& h) {
+        if (h.bits == 0 || !need(h.bits))
+            return fail("invalid Huffman code"), -1;
+        std::uint16_t entry = h.table[bitbuf_ & ((1u << h.bits) - 1)];
+        if (!entry)
+            return fail("invalid Huffman code"), -1;
+        bitbuf_ >>= entry & 15;
+        bitcnt_ -= entry & 15;
+        return entry >> 4;
+    }
+
+    void put(unsigned char byte) {
+        window_[total_++ % WINDOW] = byte;
+        pending_.push_back(byte);
+    }
+
+    bool flush() {
+        if (pending_.empty())
+            return true;
+        crc_ = crc32_update(crc_, pending_.data(), pending_.size());
+        bool ok = sink_(pending_.data(), pending_.size());
+        pending_.clear();
+        return ok || fail("output rejected");
+    }
+
+    bool stored() {
+        align();
+        std::uint32_t len = bits(16), nlen = bits(16);
+        if (!error_.empty())
+            return false;
+        if ((len ^ 0xffff) != nlen)
+            return fail("corrupt stored block");
+        while (len--) {
+            put(static_cast<unsigned char>(bits(8)));
+            if (!error_.empty())
+                return false;
+            if (pending_.size() >= FLUSH && !flush())
+                return false;
+        }
+        return true;
+    }
+
+    bool codes(const Huffman& lit, const Huffman& dist) {
+        static const std::uint16_t length_base[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,
+                                                      15, 17, 19, 23, 27, 31, 35, 43, 51,  59,
+                                                      67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const std::uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                      2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const std::uint16_t dist_base[30] = {
+            1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+            193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const std::uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,  4,  4,  5,  5,  6,
+                                                    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        for (;;) {
+            int sym = decode(lit);
+            if (sym < 0)
+                return false;
+            if (sym < 256) {
+                put(static_cast<unsigned char>(sym));
+            } else if (sym == 256) {
+                return true;
+            } else {
+                sym -= 257;
+                if (sym >= 29)
+                    return fail("invalid length code");
+                std::size_t len = length_base[sym] + bits(length_extra[sym]);
+                int d = decode(dist);
+                if (d < 0)
+                    return false;
+                if (d >= 30)
+                    return fail("invalid distance code");
+                std::size_t distance = dist_base[d] + bits(dist_extra[d]);
+                if (!error_.empty())
+                    return false;
+                if (distance > total_ || distance > WINDOW)
+                    return fail("distance too far back");
+                while (len--)
+                    put(window_[(total_ - distance) % WINDOW]);
+            }
+            if (pending_.size() >= FLUSH && !flush())
+                return false;
+        }
+    }
+
+    bool fixed() {
+        static Huffman lit, dist;
+        static std::once_flag once;
+        std::call_once(once, [this]() {
+            std::uint8_t lengths[288];
+            std::fill(lengths, lengths + 144, 8);
+            std::fill(lengths + 144, lengths + 256, 9);
+            std::fill(lengths + 256, lengths + 280, 7);
+            std::fill(lengths + 280, lengths + 288, 8);
+            build(lit, lengths, 288);
+            std::fill(lengths, lengths + 30, 5);
+            build(dist, lengths, 30);
+        });
+        return codes(lit, dist);
+    }
+
+    bool dynamic() {
+        static const std::uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                               11, 4,  12, 3, 13, 2, 14, 1, 15};
+        int nlen = bits(5) + 257, ndist = bits(5) + 1, ncode = bits(4) + 4;
+        if (!error_.empty())
+            return false;
+        if (nlen > 286 || ndist > 30)
+            return fail("bad code counts");
+
+        std::uint8_t lengths[320] = {0};
+        for (int i = 0; i < ncode; i++)
+            lengths[order[i]] = static_cast<std::uint8_t>(bits(3));
+        Huffman lencode;
+        if (!error_.empty() || !build(lencode, lengths, 19))
+            return false;
+
+        std::fill(lengths, lengths + 19, 0);
+        for (int i = 0; i < nlen + ndist;) {
+            int sym = decode(lencode);
+            if (sym < 0)
+                return false;
+            if (sym < 16) {
+                lengths[i++] = static_cast<std::uint8_t>(sym);
+                continue;
+            }
+            std::uint8_t value = 0;
+            int repeat;
+            if (sym == 16) {
+                if (i == 0)
+                    return fail("repeat with no previous length");
+                value = lengths[i - 1];
+                repeat = 3 + bits(2);
+            } else if (sym == 17) {
+                repeat = 3 + bits(3);
+            } else {
+                repeat = 11 + bits(7);
+            }
+            if (i + repeat > nlen + ndist)
+                return fail("too many code lengths");
+            while (repeat--)
+                lengths[i++] = value;
+        }
+        if (lengths[256] == 0)
+            return fail("missing end-of-block code");
+
+        Huffman lit, dist;
+        if (!build(lit, lengths, nlen) || !build(dist, lengths + nlen, ndist))
+            return false;
+        return codes(lit, dist);
+    }
+
+    bool member() {
+        align();
+        unsigned char header[10];
+        for (auto& byte : header)
+            byte = static_cast<unsigned char>(bits(8));
+        if (!error_.empty())
+            return false;
+        if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8)
+            return fail("not a gzip stream");
+        int flags = header[3];
+        if (flags & 4) {  // FEXTRA
+            std::uint32_t extra = bits(16);
+            while (extra-- && error_.empty())
+                bits(8);
+        }
+        for (int field : {8, 16}) {  // FNAME, FCOMMENT
+            if (flags & field) {
+                while (bits(8) != 0 && error_.empty()) {
+                }
+            }
+        }
+        if (flags & 2)  // FHCRC
+            bits(16);
+        if (!error_.empty())
+            return false;
+
+        crc_ = 0;
+        std::uint64_t start = total_;
+        for (bool last = false; !last;) {
+            last = bits(1);
+            std::uint32_t type = bits(2);
+            bool ok = !error_.empty() ? false
+                      : type == 0     ? stored()
+                      : type == 1     ? fixed()
+                      : type == 2     ? dynamic()
+                                      : fail("invalid block type");
+            if (!ok)
+                return false;
+        }
+        if (!flush())
+            return false;
+
+        align();
+        std::uint32_t crc = bits(16);
+        crc |= bits(16) << 16;
+        std::uint32_t size = bits(16);
+        size |= bits(16) << 16;
+        if (!error_.empty())
+            return false;
+        if (crc != crc_ || size != static_cast<std::uint32_t>(total_ - start))
+            return fail("gzip checksum mismatch");
+        return true;
+    }
+
+    ByteChannel& in_;
+    Sink sink_;
+    std::uint64_t bitbuf_ = 0;
+    int bitcnt_ = 0;
+    std::vector<unsigned char> window_ = std::vector<unsigned char>(WINDOW);
+    std::vector<unsigned char> pending_;
+    std::uint64_t total_ = 0;
+    std::uint32_t crc_ = 0;
+    std::string error_;
+};
+
+// Extracts the entries of a tar stream that lie under the requested
+// directories, writing each file as its data arrives. The archive's top-level
+// directory (codeload's "<repo>-<sha>/") is dropped before matching. Handles
+// ustar, pax extended headers and GNU long names.
+class TarExtractor {
+public:
+    struct Target {
+        std::string prefix;  // directory inside the repository, no slashes at the ends
+        std::filesystem::path output;
+        std::size_t entries = 0;
+        bool lfs = false;  // got a file that starts like an LFS pointer
+    };
+
+    explicit TarExtractor(std::vector<Target>& targets) : targets_(targets) {}
+
+    ~TarExtractor() { close_files(); }
+
+    TarExtractor(const TarExtractor&) = delete;
+    TarExtractor& operator=(const TarExtractor&) = delete;
+
+    bool feed(const unsigned char* data, std::size_t size) {
+        while (size > 0 && error_.empty() && !ended_) {
+            if (remaining_ == 0 && padding_ == 0) {
+                std::size_t take = std::min(size, sizeof(header_) - filled_);
+                std::memcpy(header_ + filled_, data, take);
+                filled_ += take;
+                data += take;
+                size -= take;
+                if (filled_ == sizeof(header_)) {
+                    filled_ = 0;
+                    start_entry();
+                }
+            } else if (remaining_ > 0) {
+                std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(size, remaining_));
+                entry_data(data, take);
+                data += take;
+                size -= take;
+                remaining_ -= take;
+                if (remaining_ == 0)
+                    end_entry();
+            } else {
+                std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(size, padding_));
+                data += take;
+                size -= take;
+                padding_ -= take;
+            }
+        }
+        return error_.empty();
+    }
+
+    // Checks the archive ended cleanly once the input is exhausted
+    bool finish() {
+        if (error_.empty() && (remaining_ > 0 || filled_ > 0))
+            error_ = "truncated tar archive";
+        close_files();
+        return error_.empty();
+    }
+
+    const std::string& error() const { return error_; }
+    const std::string& commit() const { return commit_; }
+    std::uintmax_t bytes() const { return bytes_; }
+
+private:
+    enum class Sink { Skip, Files, Meta };
+
+    static std::uint64_t parse_number(const char* field, std::size_t size) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(field);
+        std::uint64_t value = 0;
+        if (p[0] & 0x80) {  // GNU base-256 for values that do not fit in octal
+            value = p[0] & 0x7f;
+            for (std::size_t i = 1; i < size; i++)
+                value = value << 8 | p[i];
+            return value;
+        }
+        for (std::size_t i = 0; i < size && p[i]; i++) {
+            if (p[i] >= '0' && p[i] <= '7')
+                value = value * 8 + (p[i] - '0');
+        }
+        return value;
+    }
+
+    static std::string field(const char* data, std::size_t size) {
+        return std::string(data, strnlen(data, size));
+    }
+
+    void start_entry() {
+        const char* h = reinterpret_cast<const char*>(header_);
+        if (std::all_of(header_, header_ + sizeof(header_), [](unsigned char c) { return c == 0; })) {
+            ended_ = true;  // end-of-archive block; the rest is padding
+            return;
+        }
+        std::uint64_t sum = 0;
+        for (std::size_t i = 0; i < sizeof(header_); i++)
+            sum += i >= 148 && i < 156 ? ' ' : header_[i];
+        if (sum != parse_number(h + 148, 8)) {
+            error_ = "corrupt tar header";
+            return;
+        }
+
+        type_ = h[156];
+        std::uint64_t size = parse_number(h + 124, 12);
+        if (pax_size_ && type_ != 'x' && type_ != 'g') {
+            size = pax_size_;
+            pax_size_ = 0;
+        }
+        remaining_ = size;
+        padding_ = (512 - size % 512) % 512;
+        pointer_ = size <= LFS_POINTER_MAX;
+        head_.clear();
+        mode_ = static_cast<unsigned>(parse_number(h + 100, 8));
+        sink_ = Sink::Skip;
+
+        if (type_ == 'x' || type_ == 'g' || type_ == 'L' || type_ == 'K') {
+            sink_ = Sink::Meta;
+            meta_.clear();
+        } else {
+            std::string name = long_name_;
+            if (name.empty()) {
+                name = field(h, 100);
+                if (std::memcmp(h + 257, "ustar", 5) == 0 && h[345])
+                    name = field(h + 345, 155) + "/" + name;
+            }
+            std::string link = long_link_.empty() ? field(h + 157, 100) : long_link_;
+            long_name_.clear();
+            long_link_.clear();
+            place(name, link);
+        }
+        if (remaining_ == 0)
+            end_entry();
+    }
+
+    // Decides where the current entry goes, creating directories and symlinks
+    // right away and opening files for the data that follows
+    void place(const std::string& name, const std::string& link) {
+        std::size_t slash = name.find('/');
+        if (slash == std::string::npos)
+            return;  // the top-level directory itself
+        std::string rel = name.substr(slash + 1);
+        while (!rel.empty() && rel.back() == '/')
+            rel.pop_back();
+
+        for (auto& target : targets_) {
+            std::string sub;
+            if (rel == target.prefix)
+                sub = "";
+            else if (rel.compare(0, target.prefix.size() + 1, target.prefix + "/") == 0)
+                sub = rel.substr(target.prefix.size() + 1);
+            else
+                continue;
+            if (!safe_path(sub)) {
+                std::fprintf(stderr, "%s: skipping unsafe archive entry '%s'\n", PROGRAM_NAME,
+                             name.c_str());
+                continue;
+            }
+
+            if (!sub.empty() && (type_ == '5' ? filters_active() : !path_selected(sub)))
+                continue;  // filtered out; directories are created for the files kept
+
+            std::filesystem::path dest = target.output / sub;
+            std::error_code ec;
+            if (type_ == '5' || sub.empty()) {
+                std::filesystem::create_directories(dest, ec);
+            } else if (type_ == '0' || type_ == '\0' || type_ == '7') {
+                std::filesystem::create_directories(dest.parent_path(), ec);
+                std::FILE* file = ec ? nullptr : std::fopen(dest.string().c_str(), "wb");
+                if (!file) {
+                    error_ = "cannot write " + dest.string();
+                    return;
+                }
+                files_.emplace_back(file, dest);
+                owners_.push_back(&target);
+                sink_ = Sink::Files;
+            } else if (type_ == '2') {
+                std::filesystem::create_directories(dest.parent_path(), ec);
+                std::filesystem::create_symlink(link, dest, ec);
+                if (ec)
+                    std::fprintf(stderr, "%s: cannot create symlink %s: %s\n", PROGRAM_NAME,
+                                 dest.string().c_str(), ec.message().c_str());
+                symlinks_.push_back(dest.string());
+            } else {
+                continue;  // hard links and special files are not part of git trees
+            }
+            if (ec && type_ != '2') {
+                error_ = "cannot create " + dest.string() + ": " + ec.message();
+                return;
+            }
+            target.entries++;
+        }
+    }
+
+    // Rejects paths that could escape the output directory, including ones
+    // running through a symlink written earlier from the same archive
+    bool safe_path(const std::string& sub) const {
+        std::stringstream parts(sub);
+        std::string part;
+        while (std::getline(parts, part, '/')) {
+            if (part == "..")
+                return false;
+        }
+        for (const auto& target : targets_) {
+            std::string full = (target.output / sub).string();
+            for (const auto& link : symlinks_) {
+                if (full.compare(0, link.size() + 1, link + "/") == 0)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    void entry_data(const unsigned char* data, std::size_t size) {
+        if (sink_ == Sink::Meta) {
+            meta_.append(reinterpret_cast<const char*>(data), size);
+        } else if (sink_ == Sink::Files) {
+            if (pointer_)
+                head_.append(reinterpret_cast<const char*>(data), size);
+            for (const auto& file : files_) {
+                if (std::fwrite(data, 1, size, file.first) != size)
+                    error_ = "write failed: " + file.second.string();
+            }
+            bytes_ += size;
+        }
+    }
+
+    void end_entry() {
+        if (sink_ == Sink::Meta) {
+            if (type_ == 'L')
+                long_name_ = meta_.c_str();
+            else if (type_ == 'K')
+                long_link_ = meta_.c_str();
+            else
+                parse_pax();
+        }
+        if (sink_ == Sink::Files && pointer_ && head_.rfind(LFS_POINTER_START, 0) == 0) {
+            for (auto* target : owners_)
+                target->lfs = true;
+        }
+        close_files();
+    }
+
+    // pax records are "LENGTH KEY=VALUE\n"
+    void parse_pax() {
+        std::size_t pos = 0;
+        while (pos < meta_.size()) {
+            std::size_t space = meta_.find(' ', pos);
+            std::size_t length = std::strtoul(meta_.c_str() + pos, nullptr, 10);
+            if (space == std::string::npos || length == 0 || pos + length > meta_.size())
+                break;
+            std::string record = meta_.substr(space + 1, pos + length - space - 2);
+            pos += length;
+            std::size_t eq = record.find('=');
+            if (eq == std::string::npos)
+                continue;
+            std::string key = record.substr(0, eq), value = record.substr(eq + 1);
+            if (type_ == 'g' && key == "comment")
+                commit_ = value;  // git archive records the commit here
+            else if (type_ == 'x' && key == "path")
+                long_name_ = value;
+            else if (type_ == 'x' && key == "linkpath")
+                long_link_ = value;
+            else if (type_ == 'x' && key == "size")
+                pax_size_ = std::strtoull(value.c_str(), nullptr, 10);
+        }
+    }
+
+    void close_files() {
+        for (const auto& file : files_) {
+            if (std::fclose(file.first) != 0 && error_.empty())
+                error_ = "write failed: " + file.second.string();
+            if (mode_ & 0100) {
+                std::error_code ec;
+                std::filesystem::permissions(file.second,
+                                             std::filesystem::perms::owner_exec |
+                                                 std::filesystem::perms::group_exec |
+                                                 std::filesystem::perms::others_exec,
+                                             std::filesystem::perm_options::add, ec);
+            }
+        }
+        files_.clear();
+        owners_.clear();
+    }
+
+    std::vector<Target>& targets_;
+    unsigned char header_[512];
+    std::size_t filled_ = 0;
+    std::uint64_t remaining_ = 0;
+    std::uint64_t padding_ = 0;
+    char type_ = 0;
+    unsigned mode_ = 0;
+    Sink sink_ = Sink::Skip;
+    std::string meta_;
+    std::string long_name_;
+    std::string long_link_;
+    std::uint64_t pax_size_ = 0;
+    std::vector<std::pair<std::FILE*, std::filesystem::path>> files_;
+    std::vector<Target*> owners_;  // the targets files_ belong to
+    bool pointer_ = false;         // the entry is small enough to be an LFS pointer
+    std::string head_;             // its data, then
+    std::vector<std::string> symlinks_;
+    std::string commit_;
+    std::uintmax_t bytes_ = 0;
+    bool ended_ = false;
+    std::string error_;
+};
+
+// Downloads DIRS by streaming the repository tarball at REF, without git
+static bool download_directories_tarball(const std::string& owner,
+                                         const std::string& repo,
+                                         std::vector<DirRequest>& dirs,
+                                         const std::string& ref) {
+    std::string tag = ref;
+    if (tag.empty()) {
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: discovering default branch...\n", PROGRAM_NAME);
+        tag = resolve_default_branch(owner, repo);
+    }
+    std::string url = base_url(opt.tarball_base_url, "SIP_TARBALL_BASE_URL", "https://codeload.github.com") + "/" + owner + "/" + repo + "/tar.gz/" + tag;
+
+    std::vector<TarExtractor::Target> targets;
+    for (const auto& dir : dirs) {
+        std::string prefix = dir.path;
+        while (!prefix.empty() && prefix.back() == '/')
+            prefix.pop_back();
+        targets.push_back({prefix, std::filesystem::path(dir.output)});
+    }
+    // curl must not retry by itself: a restart after data was written would
+    // feed the stream again from its first byte. A transfer that failed
+    // before anything arrived is tried again here, on a fresh decoder.
+    std::vector<std::string> args = {"curl", chatty() ? "--progress-bar" : "-s"};
+    std::vector<std::string> auth = curl_auth_args(url);
+    args.insert(args.end(), auth.begin(), auth.end());
+    args.insert(args.end(), {"-f", "-L", "--connect-timeout", std::to_string(opt.timeout), "--speed-limit",
+                             "1000", "--speed-time", std::to_string(opt.timeout), url});
+
+    TraceSpan span("phase", "tarball download");
+    span.arg("url", url);
+    std::unique_ptr<ByteChannel> channel;
+    std::unique_ptr<TarExtractor> extractor;
+    std::unique_ptr<GzipDecoder> gzip;
+    int result = 0;
+    bool decoded = false;
+    std::uintmax_t received = 0;
+    for (int attempt = 0;; attempt++) {
+        channel = std::make_unique<ByteChannel>();
+        extractor = std::make_unique<TarExtractor>(targets);
+        gzip = std::make_unique<GzipDecoder>(*channel, [&extractor](const unsigned char* data, std::size_t size) {
+            return extractor->feed(data, size);
+        });
+
+        RunOptions options;
+        options.out = Stream::Capture;
+        if (chatty())
+            options.err = Stream::Inherit;
+        options.on_out = [&](const char* data, std::size_t size) {
+            received += size;
+            return channel->push(data, size);
+        };
+
+        decoded = false;
+        std::thread decoder([&]() {
+            decoded = gzip->run() && extractor->finish();
+            channel->close();
+        });
+        result = run_process(args, options).status;
+        channel->finish();
+        decoder.join();
+        // 22 is an HTTP error, which a retry does not change
+        if (result == 0 || result == 22 || received > 0 || attempt == 3)
+            break;
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    TarExtractor& tar = *extractor;
+    span.arg("bytes_written", static_cast<long long>(tar.bytes()));
+    span.finish();
+
+    bool ok = result == 0 && decoded;
+    if (result == 22) {
+        std::fprintf(stderr, "%s: tarball not found for '%s' (check repository/ref)\n",
+                     PROGRAM_NAME, tag.c_str());
+    } else if (!decoded && (received > 0 || result == 0)) {
+        std::fprintf(stderr, "%s: tarball extraction failed: %s\n", PROGRAM_NAME,
+                     !gzip->error().empty() && gzip->error() != "output rejected"
+                         ? gzip->error().c_str()
+                         : tar.error().c_str());
+    } else if (result != 0) {
+        std::fprintf(stderr, "%s: download failed (exit %d)\n", PROGRAM_NAME, result);
+    }
+
+    for (std::size_t i = 0; i < dirs.size(); i++) {
+        dirs[i].ok = ok && targets[i].entries > 0;
+        dirs[i].lfs = targets[i].lfs;
+        if (ok && !dirs[i].ok) {
+            std::fprintf(stderr, "%s: directory '%s' not found in tarball\n", PROGRAM_NAME,
+                         dirs[i].path.c_str());
+            dirs[i].missing = true;
+        }
+        if (!dirs[i].ok) {
+            std::error_code ec;
+            std::filesystem::remove_all(dirs[i].output, ec);
+        }
+    }
+    if (ok && opt.verbose) {
+        std::fprintf(stderr, "%s: extracted %ju bytes from tarball%s%s\n", PROGRAM_NAME, tar.bytes(),
+                     tar.commit().empty() ? "" : " of ", tar.commit().c_str());
+    }
+
+    ok = std::all_of(dirs.begin(), dirs.end(), [](const DirRequest& dir) { return dir.ok; });
+    if (ok && chatty())
+        std::puts("done.");
+    return ok;
+}
+
+// Git LFS: a file stored with LFS arrives, over raw requests and git alike,
+// as a small pointer naming its object's sha256 and size. Downloaded files,
+// and directories whose DirRequest::lfs is set, are scanned for pointers;
+// their objects are looked up with one call to the repository's LFS batch
+// API, downloaded at once over at most --jobs connections, checked against
+// the pointer's oid and size, and written over the pointer. --no-lfs keeps
+// the pointers.
+const std::size_t LFS_BATCH_SIZE = 100;       // objects per batch API call
+
+struct LfsObject {
+    std::string oid;  // sha256, hex
+    std::uint64_t size = 0;
+    std::vector<std::filesystem::path> files;  // pointers to this object
+    std::string href;                          // from the batch API
+    std::vector<std::string> headers;          // "Name: value", for href
+};
+
+// Parses TEXT as an LFS pointer; false if it is not one
+static bool parse_lfs_pointer(const std::string& text, std::string& oid, std::uint64_t& size) {
+    if (text.size() > LFS_POINTER_MAX || text.rfind(LFS_POINTER_START, 0) != 0)
+        return false;
+    std::istringstream lines(text);
+    std::string line;
+    bool sized = false;
+    oid.clear();
+    while (std::getline(lines, line)) {
+        if (line.rfind("oid sha256:", 0) == 0) {
+            oid = line.substr(11);
+        } else if (line.rfind("size ", 0) == 0) {
+            char* end = nullptr;
+            size = std::strtoull(line.c_str() + 5, &end, 10);
+            sized = end != line.c_str() + 5 && *end == '\0';
+        }
+    }
+    return sized && oid.size() == 64 && oid.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+// Reads the LFS pointer in FILE; false if FILE is not one
+static bool read_lfs_pointer(const std::filesystem::path& file, std::string& oid, std::uint64_t& size) {
+    std::error_code ec;
+    if (std::filesystem::file_size(file, ec) > LFS_POINTER_MAX || ec)
+        return false;
+    std::ifstream in(file, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return parse_lfs_pointer(text, oid, size);
+}
+
+// The LFS pointers among ROOTS and the files below them, one entry per object
+static std::vector<LfsObject> find_lfs_pointers(const std::vector<std::filesystem::path>& roots) {
+    std::vector<LfsObject> objects;
+    std::map<std::string, std::size_t> index;
+    auto check = [&](const std::filesystem::path& file) {
+        std::string oid;
+        std::uint64_t size = 0;
+        if (!read_lfs_pointer(file, oid, size))
+            return;
+        auto [it, added] = index.emplace(oid, objects.size());
+        if (added) {
+            objects.emplace_back();
+            objects.back().oid = oid;
+            objects.back().size = size;
+        }
+        objects[it->second].files.push_back(file);
+    };
+    for (const auto& root : roots) {
+        std::error_code ec;
+        if (std::filesystem::is_regular_file(std::filesystem::symlink_status(root, ec))) {
+            check(root);
+            continue;
+        }
+        for (auto it = std::filesystem::recursive_directory_iterator(root, ec);
+             !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_regular_file() && !it->is_symlink())
+                check(it->path());
+        }
+    }
+    return objects;
+}
+
+// Asks the LFS batch API of OWNER/REPO where to download OBJECTS, filling in
+// their href and headers. Objects the server reports errors for are named.
+static bool lfs_batch(const std::string& owner, const std::string& repo, std::vector<LfsObject>& objects) {
+    std::string url = git_remote_url(owner, repo) + "/info/lfs/objects/batch";
+    const std::vector<std::string> headers = {"Accept: application/vnd.git-lfs+json",
+                                              "Content-Type: application/vnd.git-lfs+json"};
+    bool ok = true;
+    for (std::size_t first = 0; first < objects.size(); first += LFS_BATCH_SIZE) {
+        std::size_t last = std::min(objects.size(), first + LFS_BATCH_SIZE);
+        std::string body = "{\"operation\":\"download\",\"transfers\":[\"basic\"],\"objects\":[";
+        for (std::size_t i = first; i < last; i++) {
+            body += (i == first ? "{\"oid\":\"" : ",{\"oid\":\"") + objects[i].oid +
+                    "\",\"size\":" + std::to_string(objects[i].size) + "}";
+        }
+        body += "]}";
+
+#ifdef SIP_WITH_LIBCURL
+        HttpRequest request(url);
+        request.post = body;
+        request.headers = headers;
+        HttpClient::instance().fetch({&request});
+        if (!request.ok()) {
+            std::fprintf(stderr, "%s: LFS batch request to %s failed: %s\n", PROGRAM_NAME, url.c_str(),
+                         request.error.empty() ? ("HTTP " + std::to_string(request.status)).c_str()
+                                               : request.error.c_str());
+            return false;
+        }
+        std::string answer = request.body;
+#else
+        std::vector<std::string> args = {"curl", "-s"};
+        std::vector<std::string> auth = curl_auth_args(url);
+        args.insert(args.end(), auth.begin(), auth.end());
+        for (const auto& header : headers)
+            args.insert(args.end(), {"-H", header});
+        args.insert(args.end(), {"-f", "-L", "--retry", "3", "--retry-delay", "1", "--max-time",
+                                 std::to_string(opt.timeout), "--data-binary", "@-", url});
+        RunOptions options;
+        options.out = Stream::Capture;
+        options.input = body;
+        RunResult result = run_process(args, options);
+        if (result.status != 0) {
+            std::fprintf(stderr, "%s: LFS batch request to %s failed (exit %d)\n", PROGRAM_NAME, url.c_str(),
+                         result.status);
+            return false;
+        }
+        std::string answer = result.out;
+#endif
+
+        JsonValue reply;
+        const char* p = answer.data();
+        const JsonValue* listed = parse_json(p, answer.data() + answer.size(), reply) ? reply.get("objects") : nullptr;
+        if (!listed) {
+            std::fprintf(stderr, "%s: malformed LFS batch response from %s\n", PROGRAM_NAME, url.c_str());
+            return false;
+        }
+        for (const auto& item : listed->items) {
+            const JsonValue* oid = item.get("oid");
+            auto object = std::find_if(objects.begin() + first, objects.begin() + last,
+                                       [&](const LfsObject& o) { return oid && o.oid == oid->text; });
+            if (object == objects.begin() + last)
+                continue;
+            const JsonValue* error = item.get("error");
+            const JsonValue* actions = item.get("actions");
+            const JsonValue* download = actions ? actions->get("download") : nullptr;
+            const JsonValue* href = download ? download->get("href") : nullptr;
+            if (error || !href) {
+                const JsonValue* message = error ? error->get("message") : nullptr;
+                std::fprintf(stderr, "%s: LFS object %s (%s): %s\n", PROGRAM_NAME, object->oid.c_str(),
+                             object->files[0].string().c_str(),
+                             message ? message->text.c_str() : "no download offered");
+                ok = false;
+                continue;
+            }
+            object->href = href->text;
+            if (const JsonValue* header = download->get("header")) {
+                for (std::size_t i = 0; i < header->keys.size(); i++)
+                    object->headers.push_back(header->keys[i] + ": " + header->items[i].text);
+            }
+        }
+        for (std::size_t i = first; i < last; i++) {
+            if (objects[i].href.empty() && ok) {
+                std::fprintf(stderr, "%s: LFS object %s (%s) missing from batch response\n", PROGRAM_NAME,
+                             objects[i].oid.c_str(), objects[i].files[0].string().c_str());
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+#ifndef SIP_WITH_LIBCURL
+// Quotes TEXT for a curl config file
+static std::string curl_config_quote(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+#endif
+
+// Replaces the LFS pointers among ROOTS (files or directories) downloaded
+// from OWNER/REPO with their objects. An object that cannot be fetched or
+// does not match its pointer leaves its pointers in place, with a warning
+// naming them; nothing else is undone. True when every pointer was resolved,
+// or there were none.
+static bool resolve_lfs(const std::string& owner,
+                        const std::string& repo,
+                        const std::vector<std::filesystem::path>& roots) {
+    std::vector<LfsObject> objects = find_lfs_pointers(roots);
+    if (objects.empty())
+        return true;
+    TraceSpan span("phase", "lfs");
+    std::uint64_t total = 0;
+    for (const auto& object : objects)
+        total += object.size;
+    span.arg("objects", static_cast<long long>(objects.size()));
+    span.arg("bytes", static_cast<long long>(total));
+    if (chatty())
+        std::printf("Fetching %zu LFS object%s (%llu bytes)...\n", objects.size(), objects.size() == 1 ? "" : "s",
+                    static_cast<unsigned long long>(total));
+    lfs_batch(owner, repo, objects);  // an object it has no download for keeps an empty href
+
+    // each object lands next to its first pointer, then replaces them all
+    auto temp_of = [](const LfsObject& object) {
+        std::filesystem::path temp = object.files[0];
+        return temp += ".sip-lfs";
+    };
+#ifdef SIP_WITH_LIBCURL
+    std::vector<HttpRequest> requests;
+    for (const auto& object : objects) {
+        if (object.href.empty())
+            continue;
+        requests.emplace_back(object.href, temp_of(object).string());
+        requests.back().headers = object.headers;
+        requests.back().send_token = false;
+        requests.back().stall_timeout = true;
+    }
+    std::vector<HttpRequest*> pending;
+    for (auto& request : requests)
+        pending.push_back(&request);
+    HttpClient::instance().fetch(pending);
+    for (const auto& request : requests) {
+        if (!request.ok()) {
+            std::fprintf(stderr, "%s: LFS download of %s failed: %s\n", PROGRAM_NAME, request.url.c_str(),
+                         request.error.empty() ? ("HTTP " + std::to_string(request.status)).c_str()
+                                               : request.error.c_str());
+        }
+    }
+#else
+    // the transfers go in a config on stdin, with the headers the batch API
+    // gave for each (which may carry credentials); a stalled one is dropped
+    // rather than capped by --max-time, as objects can be large
+    std::string config;
+    for (const auto& object : objects) {
+        if (object.href.empty())
+            continue;
+        if (!config.empty())
+            config += "next\n";
+        config += "url = " + curl_config_quote(object.href) + "\n";
+        config += "output = " + curl_config_quote(temp_of(object).string()) + "\n";
+        for (const auto& header : object.headers)
+            config += "header = " + curl_config_quote(header) + "\n";
+        config += "fail\nlocation\nretry = 3\nretry-delay = 1\nconnect-timeout = " + std::to_string(opt.timeout) +
+                  "\nspeed-limit = 1024\nspeed-time = " + std::to_string(opt.timeout) + "\n";
+    }
+    if (!config.empty()) {
+        std::vector<std::string> args = {"curl", chatty() ? "--progress-bar" : "-s", "--parallel",
+                                         "--parallel-max", std::to_string(opt.jobs), "--config", "-"};
+        RunOptions options;
+        options.input = config;
+        int result = run_process(args, options).status;
+        if (result != 0)
+            std::fprintf(stderr, "%s: LFS download failed (exit %d)\n", PROGRAM_NAME, result);
+    }
+#endif
+
+    // whatever arrived is checked object by object, so one failure costs
+    // only its own files
+    std::vector<char> verified(objects.size(), 0);
+    parallel_for(objects.size(), io_workers(), [&](std::size_t i) {
+        std::error_code ec;
+        std::filesystem::path temp = temp_of(objects[i]);
+        std::uintmax_t size = std::filesystem::file_size(temp, ec);
+        verified[i] = !objects[i].href.empty() && !ec && size == objects[i].size &&
+                      file_sha256(temp) == objects[i].oid;
+    });
+    std::vector<std::string> kept;
+    for (std::size_t n = 0; n < objects.size(); n++) {
+        const LfsObject& object = objects[n];
+        std::filesystem::path temp = temp_of(object);
+        std::error_code ec;
+        if (!verified[n]) {
+            std::error_code missing;
+            if (!object.href.empty() && std::filesystem::exists(temp, missing))
+                std::fprintf(stderr, "%s: LFS object %s (%s) does not match its pointer\n", PROGRAM_NAME,
+                             object.oid.c_str(), object.files[0].string().c_str());
+            std::filesystem::remove(temp, ec);
+            for (const auto& file : object.files)
+                kept.push_back(file.string());
+            continue;
+        }
+        for (std::size_t i = object.files.size(); i-- > 0;) {
+            const std::filesystem::path& file = object.files[i];
+            std::filesystem::perms mode = std::filesystem::status(file, ec).permissions();
+            CopyStats stats;
+            if (i > 0) {
+                std::filesystem::path part = file;
+                part += ".sip-lfs";
+                if (copy_file_fast(temp, part, stats, ec))
+                    std::filesystem::rename(part, file, ec);
+                if (ec)
+                    std::filesystem::remove(part, ec);
+            } else {
+                std::filesystem::rename(temp, file, ec);
+            }
+            if (!ec)
+                std::filesystem::permissions(file, mode, ec);
+            if (ec) {
+                std::fprintf(stderr, "%s: cannot write %s: %s\n", PROGRAM_NAME, file.string().c_str(),
+                             ec.message().c_str());
+                kept.push_back(file.string());
+                ec.clear();
+            }
+        }
+        std::filesystem::remove(temp, ec);
+    }
+    span.arg("unresolved", static_cast<long long>(kept.size()));
+    if (!kept.empty()) {
+        std::fprintf(stderr, "%s: warning: %zu file%s left as LFS pointer%s:\n", PROGRAM_NAME, kept.size(),
+                     kept.size() == 1 ? "" : "s", kept.size() == 1 ? "" : "s");
+        for (const auto& file : kept)
+            std::fprintf(stderr, "  %s\n", file.c_str());
+    }
+    return kept.empty();
+}
+
+// Downloads several directories of one repository at REF using a single
+// filtered clone whose sparse checkout covers all of them. Each entry's ok flag
+// reports its own outcome; returns true only if every directory was written.
+static bool download_directories_selective(const std::string& owner,
+                                           const std::string& repo,
+                                           std::vector<DirRequest>& dirs,
+                                           const std::string& ref) {
+    std::vector<DirRequest> pending;
+    for (const auto& dir : dirs) {
+        if (chatty())
+            std::printf("Downloading directory '%s'...\n", dir.path.c_str());
+        if (path_available_for_write(dir.output))
+            pending.push_back(dir);
+    }
+    if (pending.empty())
+        return false;
+
+    bool ok = opt.engine == Engine::Tarball   ? download_directories_tarball(owner, repo, pending, ref)
+              : opt.engine == Engine::Objects ? download_directories_objects(owner, repo, pending, ref)
+                                              : download_directories_sparse(owner, repo, pending, ref);
+    if (opt.lfs) {
+        // pointers that cannot be resolved are kept, with a warning
+        std::vector<std::filesystem::path> roots;
+        for (const auto& done : pending) {
+            if (done.ok && done.lfs)
+                roots.push_back(done.output);
+        }
+        resolve_lfs(owner, repo, roots);
+    }
+    if (!opt.store_dir.empty()) {
+        TraceSpan span("phase", "store");
+        for (const auto& done : pending) {
+            StoreStats stats;
+            if (done.stored)
+                continue;
+            if (done.ok)
+                store_tree(done.output, stats);
+            store_record(stats, done.output);
+        }
+    }
+    for (auto& dir : dirs) {
+        for (const auto& done : pending) {
+            if (done.output == dir.output) {
+                dir.ok = done.ok;
+                dir.missing = done.missing;
+            }
+        }
+    }
+    return ok && pending.size() == dirs.size();
+}
+
+// Downloads a specific directory from a GitHub repository using git sparse-checkout
+bool download_directory_selective(const std::string& owner,
+                                  const std::string& repo,
+                                  const std::string& path,
+                                  const std::string& ref,
+                                  const std::string& output) {
+    std::vector<DirRequest> dirs = {{path, output}};
+    return download_directories_selective(owner, repo, dirs, ref);
+}
+
+// --segments: a large file is fetched as byte ranges at once, each by its own
+// curl, and written in place into NAME.sip-part, preallocated to the full
+// size. Progress is saved to NAME.sip-state as it goes, so a run that is
+// interrupted (or whose segments keep failing) is resumed by the next one
+// from where each segment stopped. The raw URL names a branch, not a commit,
+// so the state also keeps the file's ETag (or Last-Modified): a run resumes
+// only when the server still reports the same one, and every range is asked
+// for with If-Range so that a file changing mid-download comes back whole
+// rather than spliced. The part becomes NAME once complete.
+struct Segment {
+    std::uint64_t start;
+    std::uint64_t end;   // exclusive
+    std::uint64_t done;  // bytes written from start
+};
+
+// download_segmented() result when the file is fetched as one stream instead
+const int NOT_SEGMENTED = -2;
+
+static bool write_segment_state(const std::filesystem::path& file,
+                                const std::string& url,
+                                const std::string& validator,
+                                std::uint64_t size,
+                                const std::vector<Segment>& segments) {
+    std::filesystem::path temp = file;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        out << "url " << url << "\nvalidator " << validator << "\nsize " << size << "\n";
+        for (const auto& segment : segments)
+            out << "segment " << segment.start << " " << segment.end << " " << segment.done << "\n";
+        if (!out)
+            return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, file, ec);
+    return !ec;
+}
+
+// Reads the segments saved for URL at SIZE with VALIDATOR; false if there are
+// none or they belong to another download or another version of the file
+static bool read_segment_state(const std::filesystem::path& file,
+                               const std::string& url,
+                               const std::string& validator,
+                               std::uint64_t size,
+                               std::vector<Segment>& segments) {
+    if (validator.empty())
+        return false;
+    std::ifstream in(file);
+    std::string key, saved_url, saved_validator;
+    std::uint64_t saved_size = 0;
+    std::vector<Segment> saved;
+    while (in >> key) {
+        if (key == "url") {
+            std::getline(in >> std::ws, saved_url);
+        } else if (key == "validator") {
+            std::getline(in >> std::ws, saved_validator);
+        } else if (key == "size") {
+            in >> saved_size;
+        } else if (key == "segment") {
+            Segment segment{0, 0, 0};
+            in >> segment.start >> segment.end >> segment.done;
+            saved.push_back(segment);
+        }
+    }
+    if (saved_url != url || saved_validator != validator || saved_size != size || saved.empty())
+        return false;
+    for (const auto& segment : saved) {
+        if (segment.start > segment.end || segment.end > size || segment.done > segment.end - segment.start)
+            return false;
+    }
+    segments = saved;
+    return true;
+}
+
+// The part file, written at explicit offsets by every segment at once
+class PartFile {
+public:
+    explicit PartFile(const std::filesystem::path& path) {
+#ifdef _WIN32
+        handle_ = CreateFileW(path.wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+#endif
+    }
+
+    ~PartFile() {
+#ifdef _WIN32
+        if (handle_ != INVALID_HANDLE_VALUE)
+            CloseHandle(handle_);
+#else
+        if (fd_ >= 0)
+            close(fd_);
+#endif
+    }
+
+    PartFile(const PartFile&) = delete;
+    PartFile& operator=(const PartFile&) = delete;
+
+#ifdef _WIN32
+    bool is_open() const { return handle_ != INVALID_HANDLE_VALUE; }
+#else
+    bool is_open() const { return fd_ >= 0; }
+#endif
+
+    bool write_at(const char* data, std::size_t size, std::uint64_t offset) {
+        while (size > 0) {
+#ifdef _WIN32
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD written = 0;
+            if (!WriteFile(handle_, data, static_cast<DWORD>(std::min<std::size_t>(size, 1 << 30)), &written,
+                           &overlapped))
+                return false;
+#else
+            ssize_t written = pwrite(fd_, data, size, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+#endif
+            data += written;
+            size -= static_cast<std::size_t>(written);
+            offset += static_cast<std::uint64_t>(written);
+        }
+        return true;
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Asks URL for its first byte. Returns the full size when the server answers
+// with a 206 and a Content-Range, and 0 when it ignores ranges, in which case
+// the transfer ends with the head rather than taking the whole file; EFFECTIVE
+// gets the URL after redirects and VALIDATOR the "If-Range: ..." header naming
+// this version of the file, or "" if the server gave neither ETag nor
+// Last-Modified. A failed request returns -1 with RESULT set to curl's exit
+// status (22 for an HTTP error). HTTP_STATUS gets the final response's status
+// either way. The token (see github_token()) goes with the first request
+// only: curl does not pass an Authorization header on to another host.
+static long long probe_ranges(const std::string& url,
+                              std::string& effective,
+                              std::string& validator,
+                              int& result,
+                              long& http_status) {
+    ResponseHead head;
+    // a body other than the one byte asked for is not wanted
+    auto on_head = [&](const ResponseHead& final_head) {
+        head = final_head;
+        return head.status >= 400 || head.status == 206;
+    };
+#ifdef SIP_WITH_LIBCURL
+    HttpRequest request(url);
+    request.range = "0-0";
+    request.on_head = on_head;
+    request.on_data = [](const char*, std::size_t) { return true; };
+    HttpClient::instance().fetch({&request});
+    http_status = request.status;
+    result = request.ok() ? 0 : request.status >= 400 ? 22 : -1;
+    if (result < 0)
+        std::fprintf(stderr, "%s: download failed: %s\n", PROGRAM_NAME, request.error.c_str());
+    if (!request.effective_url.empty())
+        effective = request.effective_url;
+#else
+    std::vector<std::string> args = curl_auth_args(url);
+    args.insert(args.begin(), {"curl", "-s"});
+    args.insert(args.end(), {"-f", "-L", "--retry", "3", "--retry-delay", "1", "--max-time",
+                             std::to_string(opt.timeout), "-r", "0-0", "-D", "-", "-w", "\n%{url_effective}", url});
+    // heads, then the byte and the final URL after it
+    CurlHeadReader reader;
+    std::string tail;
+    reader.on_head = on_head;
+    reader.on_body = [&](const char* data, std::size_t size) {
+        tail.append(data, size);
+        return true;
+    };
+    RunOptions options;
+    options.out = Stream::Capture;
+    options.on_out = [&](const char* data, std::size_t size) { return reader.feed(data, size); };
+    RunResult probe = run_process(args, options);
+    http_status = head.status;
+    // a head that stopped the transfer is an answer, whatever curl made of it
+    bool stopped = head.status >= 200 && head.status < 400 && head.status != 206;
+    result = stopped ? 0 : probe.status;
+    if (result == 0 && tail.find('\n') != std::string::npos)
+        effective = tail.substr(tail.rfind('\n') + 1);
+#endif
+    if (result != 0)
+        return -1;
+    // If-Range takes only a strong ETag
+    validator = !head.etag.empty() && head.etag.rfind("W/", 0) != 0 ? "If-Range: " + head.etag
+                : !head.last_modified.empty()                       ? "If-Range: " + head.last_modified
+                                                                    : "";
+    unsigned long long first = 0, last = 0, size = 0;
+    bool ranged = head.status == 206 &&
+                  std::sscanf(head.content_range.c_str(), "bytes %llu-%llu/%llu", &first, &last, &size) == 3;
+    return ranged ? static_cast<long long>(size) : 0;
+}
+
+// Downloads URL to OUTPUT in up to opt.segments ranges at once. Returns 0 on
+// success, curl's exit status when the first request fails (with its HTTP
+// status in HTTP_STATUS), -1 when a segment failed (reported here), and
+// NOT_SEGMENTED when the server ignores ranges, stops honoring them midway
+// or the file is too small to split.
+static int download_segmented(const std::string& url, const std::string& output, long& http_status) {
+    std::string effective = url;
+    std::string validator;
+    int result = 0;
+    long long size = probe_ranges(url, effective, validator, result, http_status);
+    if (size < 0)
+        return result;
+    // a redirect usually leads to a CDN, which must not see the token
+    const char* token = url_origin(effective) == url_origin(url) ? github_token(url) : nullptr;
+    std::uint64_t count = std::min<std::uint64_t>(static_cast<std::uint64_t>(opt.segments),
+                                                  static_cast<std::uint64_t>(size) / MIN_SEGMENT_SIZE);
+    if (count < 2) {
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: %s, fetching as one stream\n", PROGRAM_NAME,
+                         size == 0 ? "no range support" : "file too small to split");
+        return NOT_SEGMENTED;
+    }
+
+    TraceSpan span("phase", "segmented download");
+    std::filesystem::path part = output + ".sip-part";
+    std::filesystem::path state = output + ".sip-state";
+    std::vector<Segment> segments;
+    std::error_code ec;
+    bool resumed = std::filesystem::exists(part, ec) && std::filesystem::file_size(part, ec) == static_cast<std::uintmax_t>(size) &&
+                   read_segment_state(state, url, validator, size, segments);
+    if (!resumed) {
+        segments.clear();
+        std::uint64_t step = (size + count - 1) / count;
+        for (std::uint64_t start = 0; start < static_cast<std::uint64_t>(size); start += step)
+            segments.push_back({start, std::min<std::uint64_t>(start + step, size), 0});
+        std::filesystem::remove(part, ec);
+        std::ofstream(part, std::ios::binary).close();
+        std::filesystem::resize_file(part, static_cast<std::uintmax_t>(size), ec);
+        if (ec || !write_segment_state(state, url, validator, size, segments)) {
+            std::fprintf(stderr, "%s: cannot prepare %s: %s\n", PROGRAM_NAME, part.string().c_str(),
+                         ec ? ec.message().c_str() : "cannot write state");
+            return -1;
+        }
+    }
+    std::uint64_t before = 0;
+    for (const auto& segment : segments)
+        before += segment.done;
+    span.arg("segments", static_cast<long long>(segments.size()));
+    span.arg("resumed_bytes", static_cast<long long>(before));
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: %lld bytes in %zu segments%s\n", PROGRAM_NAME, size, segments.size(),
+                     resumed ? (", resuming after " + std::to_string(before) + " bytes").c_str() : "");
+
+    PartFile file(part);
+    if (!file.is_open()) {
+        std::fprintf(stderr, "%s: cannot write %s\n", PROGRAM_NAME, part.string().c_str());
+        return -1;
+    }
+    // progress is saved every SAVE_EVERY bytes and when a segment ends
+    const std::uint64_t SAVE_EVERY = 1 << 20;
+    std::mutex mutex;
+    std::uint64_t unsaved = 0;
+    bool write_failed = false;
+    bool range_ignored = false;
+    auto save = [&]() {
+        write_segment_state(state, url, validator, size, segments);
+        unsaved = 0;
+    };
+
+    parallel_for(segments.size(), segments.size(), [&](std::size_t i) {
+        for (int attempt = 0; attempt < 4; attempt++) {
+            std::uint64_t offset;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (segments[i].done == segments[i].end - segments[i].start || write_failed || range_ignored)
+                    return;
+                offset = segments[i].start + segments[i].done;
+            }
+            if (attempt > 0)
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            // anything but a 206 for this very range means the file changed or
+            // the server stopped honoring ranges: the transfer ends at the head
+            auto on_head = [&, offset](const ResponseHead& head) {
+                if (head.status >= 400 || head.range_from(offset, static_cast<std::uint64_t>(size)))
+                    return true;
+                std::lock_guard<std::mutex> lock(mutex);
+                range_ignored = true;
+                return false;
+            };
+            auto on_body = [&](const char* data, std::size_t bytes) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (range_ignored)
+                    return false;
+                std::uint64_t left = segments[i].end - segments[i].start - segments[i].done;
+                bytes = static_cast<std::size_t>(std::min<std::uint64_t>(bytes, left));
+                if (!file.write_at(data, bytes, segments[i].start + segments[i].done)) {
+                    write_failed = true;
+                    return false;
+                }
+                segments[i].done += bytes;
+                unsaved += bytes;
+                if (unsaved >= SAVE_EVERY)
+                    save();
+                return true;
+            };
+            std::string range = std::to_string(offset) + "-" + std::to_string(segments[i].end - 1);
+#ifdef SIP_WITH_LIBCURL
+            // segments share the client's connections, multiplexed where the
+            // server offers HTTP/2
+            HttpRequest request(effective);
+            request.send_token = token != nullptr;
+            if (!validator.empty())
+                request.headers = {validator};
+            request.range = range;
+            request.stall_timeout = true;
+            request.on_head = on_head;
+            request.on_data = on_body;
+            HttpClient::instance().fetch({&request});
+#else
+            // a stalled transfer is dropped and resumed, rather than capped
+            // by --max-time as a single stream is
+            std::vector<std::string> args = {"curl", "-s"};
+            if (token)
+                args.insert(args.end(), {"-H", std::string("Authorization: Bearer ") + token});
+            if (!validator.empty())
+                args.insert(args.end(), {"-H", validator});
+            args.insert(args.end(), {"-f", "--connect-timeout", std::to_string(opt.timeout), "--speed-limit",
+                                     "1024", "--speed-time", std::to_string(opt.timeout), "-r", range, "-D", "-",
+                                     effective});
+            CurlHeadReader reader;
+            reader.on_head = on_head;
+            reader.on_body = on_body;
+            RunOptions options;
+            options.out = Stream::Capture;
+            options.on_out = [&](const char* data, std::size_t bytes) { return reader.feed(data, bytes); };
+            run_process(args, options);
+#endif
+            std::lock_guard<std::mutex> lock(mutex);
+            save();
+        }
+    });
+
+    std::uint64_t after = 0;
+    for (const auto& segment : segments)
+        after += segment.done;
+    span.arg("bytes", static_cast<long long>(after - before));
+    if (range_ignored) {
+        if (chatty() || opt.verbose)
+            std::fprintf(stderr, "%s: server did not answer a range as asked (the file changed, or ranges are "
+                         "no longer honored); fetching as one stream\n", PROGRAM_NAME);
+        std::filesystem::remove(part, ec);
+        std::filesystem::remove(state, ec);
+        return NOT_SEGMENTED;
+    }
+    if (write_failed || after != static_cast<std::uint64_t>(size)) {
+        std::fprintf(stderr, "%s: %s; run again to resume (%llu of %lld bytes saved in %s)\n", PROGRAM_NAME,
+                     write_failed ? ("cannot write " + part.string()).c_str() : "download incomplete",
+                     static_cast<unsigned long long>(after), size, part.string().c_str());
+        return -1;
+    }
+    std::filesystem::rename(part, output, ec);
+    if (ec) {
+        std::fprintf(stderr, "%s: cannot create %s: %s\n", PROGRAM_NAME, output.c_str(), ec.message().c_str());
+        return -1;
+    }
+    std::filesystem::remove(state, ec);
+    return 0;
+}
+
+// -o - for a file: the download goes to stdout as it arrives, hashed for
+// --sha256. With LFS on, a body no larger than a pointer is held back until
+// it is complete, and a pointer is sent as its object instead.
+class StdoutFile {
+public:
+    bool write(const char* data, std::size_t size) {
+        if (holding_) {
+            if (held_.size() + size <= LFS_POINTER_MAX) {
+                held_.append(data, size);
+                return true;
+            }
+            holding_ = false;
+            if (!emit(held_.data(), held_.size()))
+                return false;
+            held_.clear();
+        }
+        return emit(data, size);
+    }
+
+    // Sends what is held back, flushes and checks --sha256, once the download
+    // of OWNER/REPO is complete. Failures are reported here; bytes already
+    // sent cannot be taken back, so a mismatch is only an exit status.
+    bool finish(const std::string& owner, const std::string& repo) {
+        std::string oid;
+        std::uint64_t size = 0;
+        bool ok = true;
+        if (holding_ && parse_lfs_pointer(held_, oid, size)) {
+            std::string temp_dir = create_temp_dir();
+            if (temp_dir.empty()) {
+                std::fprintf(stderr, "%s: failed to create temp directory\n", PROGRAM_NAME);
+                return false;
+            }
+            std::filesystem::path file = std::filesystem::path(temp_dir) / "pointer";
+            std::ofstream(file, std::ios::binary).write(held_.data(), static_cast<std::streamsize>(held_.size()));
+            resolve_lfs(owner, repo, {file});  // the pointer itself is sent if it fails
+            std::ifstream in(file, std::ios::binary);
+            char buffer[1 << 16];
+            while (ok && (in.read(buffer, sizeof buffer) || in.gcount() > 0))
+                ok = emit(buffer, static_cast<std::size_t>(in.gcount()));
+            std::error_code ec;
+            std::filesystem::remove_all(temp_dir, ec);
+        } else {
+            ok = emit(held_.data(), held_.size());
+        }
+        if (std::fflush(stdout) != 0 || failed_) {
+            std::fprintf(stderr, "%s: write to stdout failed\n", PROGRAM_NAME);
+            return false;
+        }
+        if (ok && !opt.sha256.empty()) {
+            std::string digest = sha_.hex();
+            if (digest != opt.sha256) {
+                std::fprintf(stderr, "%s: stdout: sha256 mismatch (expected %s, got %s)\n", PROGRAM_NAME,
+                             opt.sha256.c_str(), digest.c_str());
+                return false;
+            }
+        }
+        return ok;
+    }
+
+private:
+    bool emit(const char* data, std::size_t size) {
+        sha_.update(data, size);
+        if (std::fwrite(data, 1, size, stdout) != size)
+            failed_ = true;
+        return !failed_;
+    }
+
+    bool holding_ = opt.lfs;
+    bool failed_ = false;
+    std::string held_;
+    Sha256 sha_;
+};
+
+// Downloads a single file from a GitHub repository using curl. NOT_FOUND, if
+// given, is set when the server answered 404; other HTTP errors (401, 403,
+// a 5xx that outlasted the retries) are reported as failures.
+bool download_file(const std::string& owner,
+                   const std::string& repo,
+                   const std::string& path,
+                   const std::string& branch,
+                   const std::string& output,
+                   bool* not_found = nullptr) {
+    if (chatty())
+        std::printf("Downloading '%s'...\n", path.c_str());
+
+    // "-" is stdout, where curl writes as the bytes arrive
+    if (output != "-" && !path_available_for_write(output)) return false;
+
+    std::string ref = branch;
+    if (ref.empty()) {
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: discovering default branch...\n", PROGRAM_NAME);
+        ref = resolve_default_branch(owner, repo);
+        if (opt.verbose)
+            std::fprintf(stderr, "%s: using default branch: %s\n", PROGRAM_NAME, ref.c_str());
+    }
+
+    std::string url = raw_file_url(owner, repo, ref, path);
+    TraceSpan span("phase", "file download");
+    span.arg("url", url);
+
+    StdoutFile stdout_file;
+    if (output == "-") {
+        std::fflush(stdout);
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    long http_status = 0;
+    int result = opt.segments > 1 && output != "-" ? download_segmented(url, output, http_status) : NOT_SEGMENTED;
+    if (result == NOT_SEGMENTED) {
+#ifdef SIP_WITH_LIBCURL
+        HttpRequest request(url, output);
+        if (output == "-")
+            request.on_data = [&](const char* data, std::size_t size) { return stdout_file.write(data, size); };
+        HttpClient::instance().fetch({&request});
+        http_status = request.status;
+        result = request.ok() ? 0 : request.status >= 400 ? 22 : -1;
+        if (result < 0)
+            std::fprintf(stderr, "%s: download failed: %s\n", PROGRAM_NAME, request.error.c_str());
+#else
+        std::vector<std::string> args = {"curl", chatty() ? "--progress-bar" : "-s"};
+        std::vector<std::string> auth = curl_auth_args(url);
+        args.insert(args.end(), auth.begin(), auth.end());
+
+        // transient failures (timeouts, 5xx) are retried; a 404 is final.
+        // The final status is written where the body is not.
+        args.insert(args.end(), {"-f", "-L", "--retry", "3", "--retry-delay", "1", "--max-time",
+                                 std::to_string(opt.timeout), "-w",
+                                 output == "-" ? "%{stderr}%{http_code}" : "%{http_code}", "-o", output, url});
+
+        RunOptions options;
+        if (output == "-") {
+            options.out = Stream::Capture;
+            options.err = Stream::Capture;
+            options.on_out = [&](const char* data, std::size_t size) { return stdout_file.write(data, size); };
+        } else {
+            options.out = Stream::Capture;
+        }
+        RunResult fetched = run_process(args, options);
+        result = fetched.status;
+        http_status = std::atol(rtrim(output == "-" ? fetched.err : fetched.out).c_str());
+#endif
+    }
+    if (result == 0 && output == "-")
+        return stdout_file.finish(owner, repo);
+    if (result == 0 && opt.lfs)
+        resolve_lfs(owner, repo, {output});
+    if (result == 0 && !opt.sha256.empty()) {
+        std::string digest = file_sha256(output);
+        if (digest != opt.sha256) {
+            std::fprintf(stderr, "%s: %s: sha256 mismatch (expected %s, got %s)\n", PROGRAM_NAME,
+                         output.c_str(), opt.sha256.c_str(), digest.empty() ? "unreadable" : digest.c_str());
+            std::error_code ec;
+            std::filesystem::remove(output, ec);
+            return false;
+        }
+    }
+    if (result == 0) {
+        std::error_code ec;
+        span.arg("bytes", static_cast<long long>(std::filesystem::file_size(output, ec)));
+        if (!opt.store_dir.empty()) {
+            StoreStats stats;
+            store_file(output, "", stats);
+            store_record(stats, output);
+        }
+        if (chatty())
+            std::puts("done.");
+        return true;
+    }
+
+    if (result == 22 && http_status == 404) {
+        if (not_found)
+            *not_found = true;  // the caller decides whether this is an error
+        else
+            std::fprintf(stderr, "%s: file not found (check path/branch)\n", PROGRAM_NAME);
+    } else if (result == 22 && http_status > 0) {
+        std::fprintf(stderr, "%s: download failed (HTTP %ld%s)\n", PROGRAM_NAME, http_status,
+                     http_status == 401 || http_status == 403 ? "; check GITHUB_TOKEN" : "");
+    } else if (result >= 0) {
+        std::fprintf(stderr, "%s: download failed (exit %d)\n", PROGRAM_NAME, result);
+    }
+    return false;
+}
+
+// Clones an entire GitHub repository
+bool clone_repository(const std::string& owner,
+                      const std::string& repo,
+                      const std::string& /* path */,
+                      const std::string& ref,
+                      const std::string& output) {
+    if (chatty())
+        std::printf("Cloning into '%s'...\n", output.c_str());
+
+    if (!path_available_for_write(output)) return false;
+
+    if (!opt.cache_dir.empty())
+        return clone_repository_cached(owner, repo, ref, output);
+
+    std::string url = git_remote_url(owner, repo);
+    std::vector<std::string> auth = git_auth_args();
+    
+    // a commit cannot be cloned by name: the repository is initialized and the
+    // commit fetched directly, without cloning the default branch first
+    std::string sha, kind;
+    if (!ref.empty() && looks_like_commit_sha(ref) && !resolve_ref(owner, repo, ref, sha, kind))
+        return false;
+    if (kind == "commit") {
+        std::vector<std::string> fetch_args = {"-C", output};
+        fetch_args.insert(fetch_args.end(), auth.begin(), auth.end());
+        fetch_args.insert(fetch_args.end(), {"-c", "http.lowSpeedLimit=1000", "-c", "http.lowSpeedTime=10",
+                                             "fetch", "--depth", "1", chatty() ? "--progress" : "-q", "origin",
+                                             sha});
+        int result = run_git({"init", "-q", output}).status;
+        if (result == 0)
+            result = run_git({"-C", output, "remote", "add", "origin", url}).status;
+        if (result == 0)
+            result = run_git(fetch_args).status;
+        if (result != 0) {
+            std::fprintf(stderr, "%s: failed to fetch commit %s (exit %d)\n", PROGRAM_NAME, ref.c_str(),
+                         result);
+            std::error_code ec;
+            std::filesystem::remove_all(output, ec);
+            return false;
+        }
+        std::vector<std::string> checkout_args = {"-C", output};
+        std::vector<std::string> workers = git_checkout_args();
+        checkout_args.insert(checkout_args.end(), workers.begin(), workers.end());
+        checkout_args.insert(checkout_args.end(), {"checkout", "-q", "--detach", "FETCH_HEAD"});
+        result = run_git(checkout_args).status;
+        if (result != 0) {
+            std::fprintf(stderr, "%s: failed to checkout commit %s (exit %d)\n", PROGRAM_NAME, ref.c_str(),
+                         result);
+            std::error_code ec;
+            std::filesystem::remove_all(output, ec);
+            return false;
+        }
+        if (chatty())
+            std::puts("done.");
+        return true;
+    }
+
+    std::vector<std::string> args = auth;
+    std::vector<std::string> workers = git_checkout_args();
+    args.insert(args.end(), workers.begin(), workers.end());
+    args.insert(args.end(), {"-c", "http.lowSpeedLimit=1000", "-c", "http.lowSpeedTime=10", "clone",
+                             "--depth", "1"});
+
+    if (chatty())
+        args.push_back("--progress");
+
+    if (!ref.empty())
+        args.insert(args.end(), {"--branch", ref});
+
+    args.insert(args.end(), {url, output});
+
+    int result = run_git(args).status;
+    if (result != 0) {
+        if (result == 128) {
+            std::fprintf(stderr, "%s: repo not found or private\n", PROGRAM_NAME);
+        } else {
+            std::fprintf(stderr, "%s: clone failed (exit %d)\n", PROGRAM_NAME, result);
+        }
+        return false;
+    }
+
+    if (chatty())
+        std::puts("done.");
+    return true;
+}
+
+static bool output_to_cwd() {
+    return opt.output_dir == "./" || opt.output_dir == ".";
+}
+
+// Default destinations when none is given: a directory lands under its own
+// name, a file keeps its relative path in the current directory or its name
+// under --output-dir, and a clone is named after the repository.
+static std::string default_dir_output(const std::string& dir_path) {
+    std::string name = std::filesystem::path(dir_path).filename().string();
+    return output_to_cwd() ? name : (std::filesystem::path(opt.output_dir) / name).string();
+}
+
+static std::string default_file_output(const std::string& path) {
+    return output_to_cwd() ? path
+                           : (std::filesystem::path(opt.output_dir) /
+                              std::filesystem::path(path).filename())
+                                 .string();
+}
+
+static std::string default_clone_output(const std::string& repo) {
+    return output_to_cwd() ? repo : opt.output_dir;
+}
+
+// A blob-less repository to read objects from, with no working tree: the
+// cache repository of OWNER/REPO, held under its lock, or else a temporary
+// one that is removed again. Errors are reported here; check ok().
+class ObjectRepo {
+public:
+    ObjectRepo(const std::string& owner, const std::string& repo) {
+        std::string url = git_remote_url(owner, repo);
+        if (!opt.cache_dir.empty()) {
+            if (!prepare_cache_dir(owner))
+                return;
+            std::string git_dir = cache_repo_path(owner, repo);
+            lock_ = std::make_unique<CacheLock>(git_dir + ".lock");
+            if (!lock_->held()) {
+                std::fprintf(stderr, "%s: failed to lock cache %s\n", PROGRAM_NAME, git_dir.c_str());
+                return;
+            }
+            bool exists = std::filesystem::exists(std::filesystem::path(git_dir) / "HEAD");
+            if (!(exists ? point_remote_at(git_dir, url) : init_partial_repo(git_dir, url))) {
+                std::fprintf(stderr, "%s: failed to %s cache repository\n", PROGRAM_NAME, exists ? "update" : "create");
+                return;
+            }
+            git_dir_ = git_dir;
+        } else {
+            temp_dir_ = create_temp_dir();
+            std::string git_dir = temp_dir_.empty() ? "" : (std::filesystem::path(temp_dir_) / "repo.git").string();
+            if (git_dir.empty() || !init_partial_repo(git_dir, url)) {
+                std::fprintf(stderr, "%s: failed to create temp repository\n", PROGRAM_NAME);
+                return;
+            }
+            git_dir_ = git_dir;
+        }
+    }
+
+    ~ObjectRepo() {
+        std::error_code ec;
+        if (!temp_dir_.empty()) {
+            std::filesystem::remove_all(temp_dir_, ec);
+        } else if (!git_dir_.empty()) {
+            cache_touch(git_dir_);
+            lock_.reset();
+            cache_evict(git_dir_);
+        }
+    }
+
+    ObjectRepo(const ObjectRepo&) = delete;
+    ObjectRepo& operator=(const ObjectRepo&) = delete;
+
+    bool ok() const { return !git_dir_.empty(); }
+    const std::string& git_dir() const { return git_dir_; }
+
+private:
+    std::string temp_dir_;
+    std::string git_dir_;
+    std::unique_ptr<CacheLock> lock_;
+};
+
+// Fetches the commits in WANT that GIT_DIR lacks, trees only, in one request
+static bool fetch_commit_trees(const std::string& git_dir, const std::vector<std::string>& want) {
+    std::string gd = "--git-dir=" + git_dir;
+    std::vector<std::string> args = git_auth_args();
+    args.insert(args.end(), {gd, "-c", "http.lowSpeedLimit=1000", "-c", "http.lowSpeedTime=10", "fetch",
+                             "--no-tags", "--no-write-fetch-head", "--depth", "1", "--filter=blob:none",
+                             chatty() ? "--progress" : "-q", "origin"});
+    std::size_t base = args.size();
+    for (const auto& commit : want) {
+        if (git_output({gd, "rev-list", "-n1", "--no-walk", "--missing=print", commit}) != commit)
+            args.push_back(commit);
+    }
+    if (args.size() == base)
+        return true;
+    int result = run_git(args).status;
+    if (result != 0)
+        std::fprintf(stderr, "%s: fetch failed (exit %d)\n", PROGRAM_NAME, result);
+    return result == 0;
+}
+
+// Receivers for stream_blobs(): begin(index, size) opens the blob OIDS[index],
+// data(bytes, count) takes its content piece by piece and end() closes it.
+// Each returns false once it has recorded an error of its own, which stops
+// the stream.
+struct BlobStream {
+    std::function<bool(std::size_t, std::uint64_t)> begin;
+    std::function<bool(const char*, std::size_t)> data;
+    std::function<bool()> end;
+};
+
+// Passes the blobs OIDS of GIT_DIR, in order, through STREAM as they come out
+// of a single `git cat-file --batch`, so no blob is held in memory whole.
+// Malformed output and a failing git are reported here.
+static bool stream_blobs(const std::string& git_dir, const std::vector<std::string>& oids, const BlobStream& stream) {
+    if (oids.empty())
+        return true;
+    // cat-file --batch answers "<oid> blob <size>\n<content>\n" per input line
+    std::string input;
+    for (const auto& oid : oids)
+        input += oid + "\n";
+    std::size_t index = 0;
+    std::string header;
+    std::uint64_t remaining = 0;
+    bool in_body = false;
+    bool stopped = false;
+    std::string error;
+
+    RunOptions options;
+    options.out = Stream::Capture;
+    options.input = input;
+    options.on_out = [&](const char* data, std::size_t size) {
+        while (size > 0 && !stopped) {
+            if (!in_body) {
+                const char* newline = static_cast<const char*>(std::memchr(data, '\n', size));
+                std::size_t take = newline ? static_cast<std::size_t>(newline - data) + 1 : size;
+                header.append(data, take);
+                data += take;
+                size -= take;
+                if (!newline)
+                    continue;
+                std::istringstream fields(header);
+                std::string oid, type;
+                fields >> oid >> type >> remaining;
+                header.clear();
+                if (index >= oids.size() || type != "blob") {
+                    error = "unexpected cat-file output for " + oid;
+                    stopped = true;
+                    break;
+                }
+                in_body = true;
+                stopped = !stream.begin(index, remaining);
+                remaining += 1;  // the newline after the content
+            } else {
+                std::size_t take = static_cast<std::size_t>(std::min<std::uint64_t>(size, remaining));
+                std::size_t content = remaining - take == 0 ? take - 1 : take;
+                if (content && !stream.data(data, content))
+                    stopped = true;
+                data += take;
+                size -= take;
+                remaining -= take;
+                if (remaining == 0 && !stopped) {
+                    in_body = false;
+                    index++;
+                    stopped = !stream.end();
+                }
+            }
+        }
+        return !stopped;
+    };
+    int result = run_git({"--git-dir=" + git_dir, "cat-file", "--batch"}, options).status;
+    if (stopped && error.empty())
+        return false;
+    if (error.empty() && (result != 0 || index != oids.size()))
+        error = "cat-file failed (exit " + std::to_string(result) + ")";
+    if (!error.empty()) {
+        std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, error.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --sync: a destination written by sip is recorded in a sidecar file next to
+// it (".NAME.sip") naming the repository, path, commit and the object id of
+// the path. A later --sync run resolves the ref; when the commit moved, it
+// fetches the trees of both commits, diffs them, and applies only the changed
+// entries. Blobs come from one batched fetch and are written as they stream
+// out of a single cat-file --batch.
+struct SyncState {
+    std::string repo;    // OWNER/REPO
+    std::string path;
+    std::string commit;
+    std::string object;  // tree or blob id of path at commit
+    std::string kind;    // "tree" or "blob"
+};
+
+// One changed entry, from diff-tree --raw
+struct SyncChange {
+    char status;           // A, M, T, D or R
+    std::string mode;      // new mode
+    std::string oid;       // new blob id
+    std::string path;      // relative to the synced root
+    std::string old_path;  // source of a rename
+};
+
+static std::filesystem::path sync_state_file(std::string output) {
+    while (output.size() > 1 && (output.back() == '/' || output.back() == '\\'))
+        output.pop_back();
+    std::filesystem::path out(output);
+    return out.parent_path() / ("." + out.filename().string() + ".sip");
+}
+
+static bool read_sync_state(const std::filesystem::path& file, SyncState& state) {
+    std::ifstream in(file);
+    std::string key, value;
+    while (in >> key && std::getline(in >> std::ws, value)) {
+        if (key == "repo")
+            state.repo = value;
+        else if (key == "path")
+            state.path = value;
+        else if (key == "commit")
+            state.commit = value;
+        else if (key == "object")
+            state.object = value;
+        else if (key == "kind")
+            state.kind = value;
+    }
+    return !state.commit.empty() && !state.object.empty();
+}
+
+static bool write_sync_state(const std::filesystem::path& file, const SyncState& state) {
+    std::filesystem::path temp = file;
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        out << "repo " << state.repo << "\npath " << state.path << "\ncommit " << state.commit
+            << "\nobject " << state.object << "\nkind " << state.kind << "\n";
+        if (!out) {
+            std::fprintf(stderr, "%s: cannot write %s\n", PROGRAM_NAME, temp.string().c_str());
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, file, ec);
+    if (ec) {
+        std::fprintf(stderr, "%s: cannot write %s: %s\n", PROGRAM_NAME, file.string().c_str(),
+                     ec.message().c_str());
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+// Writes the blobs of FILES from GIT_DIR straight into their destinations as
+// they stream out of one `git cat-file --batch`, replacing whatever is there.
+// Executables get their x bits and links are created as links. With STATS,
+// each file written also goes into the --store.
+static bool write_blob_files(const std::string& git_dir, const std::vector<BlobFile>& files, StoreStats* stats) {
+    std::vector<std::string> oids;
+    for (const auto& entry : files)
+        oids.push_back(entry.oid);
+    const BlobFile* entry = nullptr;
+    std::FILE* file = nullptr;
+    std::string link_target;
+    std::string error;
+
+    BlobStream stream;
+    stream.begin = [&](std::size_t i, std::uint64_t) {
+        entry = &files[i];
+        std::error_code ec;
+        std::filesystem::create_directories(entry->dest.parent_path(), ec);
+        if (std::filesystem::is_symlink(entry->dest, ec) || std::filesystem::exists(entry->dest, ec))
+            std::filesystem::remove_all(entry->dest, ec);
+        link_target.clear();
+        if (entry->mode != "120000") {
+            file = std::fopen(entry->dest.string().c_str(), "wb");
+            if (!file)
+                error = "cannot write " + entry->dest.string();
+        }
+        return error.empty();
+    };
+    stream.data = [&](const char* data, std::size_t size) {
+        if (!file)
+            link_target.append(data, size);
+        else if (std::fwrite(data, 1, size, file) != size)
+            error = "write failed";
+        return error.empty();
+    };
+    stream.end = [&]() {
+        std::error_code ec;
+        if (entry->mode == "120000") {
+            std::filesystem::create_symlink(link_target, entry->dest, ec);
+        } else if (file) {
+            if (std::fclose(file) != 0)
+                error = "write failed: " + entry->dest.string();
+            file = nullptr;
+            if (entry->mode == "100755")
+                std::filesystem::permissions(entry->dest,
+                                             std::filesystem::perms::owner_exec |
+                                                 std::filesystem::perms::group_exec |
+                                                 std::filesystem::perms::others_exec,
+                                             std::filesystem::perm_options::add, ec);
+            if (stats && !ec)
+                store_file(entry->dest, entry->oid, *stats);
+        }
+        if (ec && error.empty())
+            error = "cannot create " + entry->dest.string() + ": " + ec.message();
+        return error.empty();
+    };
+    bool ok = stream_blobs(git_dir, oids, stream);
+    if (file)
+        std::fclose(file);
+    if (!error.empty())
+        std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, error.c_str());
+    return ok && error.empty();
+}
+
+// --trees=path: instead of every tree of the commit, only the trees along
+// each requested path are fetched, one level per request for all paths at
+// once (`--filter=tree:0` returns just the trees asked for), and then each
+// directory's own subtree with its trees alone. The cost of a deep path in a
+// large repository follows the subtree, not the repository. Trees already in
+// the cached repository are not fetched again.
+//
+// Fetches those trees of COMMIT into GIT_DIR; TREES[i] receives the tree id
+// of DIRS[i], or DIRS[i] is marked missing.
+static bool fetch_path_trees(const std::string& git_dir,
+                             const std::string& commit,
+                             std::vector<DirRequest>& dirs,
+                             std::vector<std::string>& trees) {
+    std::string gd = "--git-dir=" + git_dir;
+    // whether OID and what FILTER would fetch with it are present; unlike
+    // cat-file, rev-list --missing=print never fetches what it lacks
+    auto present = [&](const std::string& oid, const char* filter) {
+        std::string listed = git_output({gd, "rev-list", "--objects", "--no-walk", "--missing=print",
+                                         std::string("--filter=") + filter, oid});
+        return !listed.empty() && listed[0] != '?' && listed.find("\n?") == std::string::npos;
+    };
+    int fetches = 0;
+    auto fetch = [&](const std::vector<std::string>& oids, const char* filter, bool shallow) {
+        std::vector<std::string> args = git_auth_args();
+        args.insert(args.end(), {gd, "-c", "http.lowSpeedLimit=1000", "-c", "http.lowSpeedTime=10", "fetch",
+                                 "--no-tags", "--no-write-fetch-head", std::string("--filter=") + filter,
+                                 chatty() ? "--progress" : "-q"});
+        if (shallow)
+            args.insert(args.end(), {"--depth", "1"});
+        args.push_back("origin");
+        args.insert(args.end(), oids.begin(), oids.end());
+        fetches++;
+        int result = run_git(args).status;
+        if (result != 0)
+            std::fprintf(stderr, "%s: tree fetch failed (exit %d)\n", PROGRAM_NAME, result);
+        return result == 0;
+    };
+
+    TraceSpan walk("phase", "tree walk");
+    walk.arg("commit", commit);
+    // the commit and its root tree, without anything below
+    if (git_output({gd, "rev-list", "-n1", "--no-walk", "--missing=print", commit}) != commit &&
+        !fetch({commit}, "tree:1", true))
+        return false;
+    std::string root = git_output({gd, "rev-parse", commit + "^{tree}"});
+    if (!present(root, "tree:0") && !fetch({root}, "tree:0", false))
+        return false;
+
+    // TREES[i] is where DIRS[i] has got to, PARTS[i] the components left,
+    // last first
+    trees.assign(dirs.size(), root);
+    std::vector<std::vector<std::string>> parts(dirs.size());
+    for (std::size_t i = 0; i < dirs.size(); i++) {
+        std::istringstream components(dirs[i].path);
+        for (std::string part; std::getline(components, part, '/');) {
+            if (!part.empty())
+                parts[i].push_back(part);
+        }
+        std::reverse(parts[i].begin(), parts[i].end());
+    }
+    for (bool advanced = true; advanced;) {
+        advanced = false;
+        // on the path only the tree itself is wanted; the requested
+        // directory gets all trees below it as well
+        std::set<std::string> path_trees, subtrees;
+        for (std::size_t i = 0; i < dirs.size(); i++) {
+            if (dirs[i].missing || parts[i].empty())
+                continue;
+            advanced = true;
+            // "<mode> <type> <oid>\t<name>\0", the name unquoted
+            std::string entry = git_output({gd, "ls-tree", "-z", trees[i], "--", parts[i].back()});
+            entry = entry.substr(0, entry.find('\0'));
+            std::size_t tab = entry.find('\t');
+            if (tab == std::string::npos || tab < 12 || entry.compare(7, 5, "tree ") != 0 ||
+                entry.substr(tab + 1) != parts[i].back()) {
+                std::fprintf(stderr, "%s: directory '%s' not found in repository\n", PROGRAM_NAME,
+                             dirs[i].path.c_str());
+                dirs[i].missing = true;
+                continue;
+            }
+            trees[i] = entry.substr(12, tab - 12);
+            parts[i].pop_back();
+            if (!present(trees[i], parts[i].empty() ? "blob:none" : "tree:0"))
+                (parts[i].empty() ? subtrees : path_trees).insert(trees[i]);
+        }
+        if ((!path_trees.empty() && !fetch({path_trees.begin(), path_trees.end()}, "tree:0", false)) ||
+            (!subtrees.empty() && !fetch({subtrees.begin(), subtrees.end()}, "blob:none", false)))
+            return false;
+    }
+    walk.arg("fetches", static_cast<long long>(fetches));
+    return true;
+}
+
+// Downloads DIRS, whose outputs are known to be free, into a bare object
+// store: the cached repository, or a temporary one. This serves
+// --engine=objects, where `ls-tree -r` lists each directory and every blob
+// is written from one `git cat-file --batch` straight into its output file,
+// with no index, work tree or copy. It also serves --trees=path with the git
+// engine, where each directory is checked out from a temporary index.
+static bool download_directories_objects(const std::string& owner,
+                                         const std::string& repo,
+                                         std::vector<DirRequest>& dirs,
+                                         const std::string& ref) {
+    std::string want = ref.empty() ? resolve_default_branch(owner, repo) : ref;
+    std::string commit, kind;
+    if (!resolve_ref(owner, repo, want, commit, kind))
+        return false;
+    ObjectRepo objects(owner, repo);
+    if (!objects.ok())
+        return false;
+    std::string gd = "--git-dir=" + objects.git_dir();
+
+    std::vector<std::string> trees;
+    if (opt.trees == Trees::Path) {
+        if (!fetch_path_trees(objects.git_dir(), commit, dirs, trees))
+            return false;
+    } else {
+        if (!fetch_commit_trees(objects.git_dir(), {commit}))
+            return false;
+        for (auto& dir : dirs) {
+            trees.push_back(git_output({gd, "rev-parse", "--verify", "-q", commit + ":" + dir.path}));
+            dir.missing = trees.back().empty() || git_output({gd, "cat-file", "-t", trees.back()}) != "tree";
+            if (dir.missing)
+                std::fprintf(stderr, "%s: directory '%s' not found in repository\n", PROGRAM_NAME,
+                             dir.path.c_str());
+        }
+    }
+
+    // LISTINGS[i] holds the selected files of DIRS[i]
+    std::vector<std::vector<TreeBlob>> listings(dirs.size());
+    std::vector<std::string> wanted;
+    std::set<std::string> needed;
+    bool listed = opt.engine == Engine::Objects || filters_active();
+    for (std::size_t i = 0; i < dirs.size(); i++) {
+        if (dirs[i].missing)
+            continue;
+        wanted.push_back(trees[i]);
+        if (listed)
+            listings[i] = selected_blobs({gd}, trees[i]);
+        for (const auto& blob : listings[i])
+            needed.insert(blob.oid);
+    }
+    bool fetched = prefetch_blobs({gd}, wanted, listed ? &needed : nullptr);
+    if (fetched)
+        mark_lfs_dirs({gd}, commit, dirs);
+
+    std::string index_dir = opt.engine == Engine::Objects || !fetched ? "" : create_temp_dir();
+    bool prepared = fetched && (opt.engine == Engine::Objects || !index_dir.empty());
+    bool ok = prepared;
+    std::vector<BlobFile> files;
+    for (std::size_t i = 0; i < dirs.size(); i++) {
+        if (!prepared || dirs[i].missing) {
+            ok = false;
+            continue;
+        }
+        std::error_code ec;
+        if (!std::filesystem::create_directories(dirs[i].output, ec)) {
+            std::fprintf(stderr, "%s: cannot create %s: %s\n", PROGRAM_NAME, dirs[i].output.c_str(),
+                         ec.message().c_str());
+            ok = false;
+        } else if (opt.engine == Engine::Objects) {
+            dirs[i].ok = true;
+            for (const auto& blob : listings[i])
+                files.push_back({std::filesystem::path(dirs[i].output) / blob.path, blob.mode, blob.oid});
+        } else {
+            if (opt.verbose)
+                std::fprintf(stderr, "%s: checking out '%s'...\n", PROGRAM_NAME, dirs[i].path.c_str());
+            std::string index = (std::filesystem::path(index_dir) / "index").string();
+            dirs[i].ok = cache_checkout(objects.git_dir(), trees[i], dirs[i].output, index);
+            ok = ok && dirs[i].ok;
+        }
+    }
+    // LFS rewrites files after this, so with --lfs the store takes them later
+    bool store = !opt.store_dir.empty() && !opt.lfs && !files.empty();
+    StoreStats stats;
+    if (store) {
+        TraceSpan span("phase", "store");
+        files = store_serve_files(files, stats);
+        span.arg("files_linked", static_cast<long long>(stats.linked.load()));
+    }
+    if (!files.empty()) {
+        TraceSpan span("phase", "write blobs");
+        span.arg("files", static_cast<long long>(files.size()));
+        if (!write_blob_files(objects.git_dir(), files, store ? &stats : nullptr)) {
+            for (auto& dir : dirs)
+                dir.ok = false;
+            ok = false;
+        }
+    }
+    if (store) {
+        for (auto& dir : dirs)
+            dir.stored = dir.ok;
+        store_record(stats, dirs.size() == 1 ? dirs[0].output : std::to_string(dirs.size()) + " directories");
+    }
+    for (const auto& dir : dirs) {
+        std::error_code ec;
+        if (!dir.ok)
+            std::filesystem::remove_all(dir.output, ec);
+    }
+    if (!index_dir.empty()) {
+        std::error_code ec;
+        std::filesystem::remove_all(index_dir, ec);
+    }
+    if (ok && chatty())
+        std::puts("done.");
+    return ok;
+}
+
+// Writes the new content of WANTED below ROOT. Blobs already in the --store
+// are linked from there; the rest that GIT_DIR lacks are prefetched first,
+// and NEW_TREE and OLD_TREE bound the search for them.
+static bool sync_write_blobs(const std::string& git_dir,
+                             const std::filesystem::path& root,
+                             const std::vector<const SyncChange*>& wanted,
+                             const std::string& new_tree,
+                             const std::string& old_tree) {
+    StoreStats stats;
+    std::vector<BlobFile> files;
+    for (const auto* change : wanted)
+        files.push_back({root / change->path, change->mode, change->oid});
+    if (!opt.store_dir.empty())
+        files = store_serve_files(files, stats);
+    if (files.empty()) {
+        if (!opt.store_dir.empty())
+            store_record(stats, root.string());
+        return true;
+    }
+    std::string gd = "--git-dir=" + git_dir;
+    std::set<std::string> needed;
+    for (const auto& entry : files)
+        needed.insert(entry.oid);
+
+    std::vector<std::string> revs = {new_tree};
+    if (!old_tree.empty())
+        revs.push_back("^" + old_tree);
+    if (!prefetch_blobs({gd}, revs, &needed))
+        return false;
+
+    // each blob is written to its entry as it streams out of git
+    bool ok = write_blob_files(git_dir, files, opt.store_dir.empty() ? nullptr : &stats);
+    if (!ok)
+        return false;
+    if (!opt.store_dir.empty())
+        store_record(stats, root.string());
+    return true;
+}
+
+// Removes DIR and its parents up to ROOT while they are empty
+static void prune_empty_dirs(std::filesystem::path dir, const std::filesystem::path& root) {
+    std::error_code ec;
+    while (dir != root && dir.string().size() > root.string().size() &&
+           std::filesystem::is_empty(dir, ec) && !ec) {
+        std::filesystem::remove(dir, ec);
+        dir = dir.parent_path();
+    }
+}
+
+// Brings OUTPUT up to date with PATH at REF, writing only what changed since
+// the commit recorded in its sidecar, or everything when there is none
+static bool sync_path(const std::string& owner,
+                      const std::string& repo,
+                      std::string path,
+                      const std::string& ref,
+                      const std::string& dir_output,
+                      const std::string& file_output) {
+    while (!path.empty() && path.back() == '/')
+        path.pop_back();
+    if (chatty())
+        std::printf("Syncing '%s'...\n", path.c_str());
+
+    // one ls-remote (or a ref-cache hit) is all an unchanged ref costs
+    std::string want = ref.empty() ? "HEAD" : ref;
+    std::string commit, kind;
+    if (!resolve_ref(owner, repo, want, commit, kind))
+        return false;
+
+    // the sidecar decides which of the two possible destinations is ours
+    SyncState old_state;
+    std::string output;
+    for (const auto& candidate : {dir_output, file_output}) {
+        SyncState state;
+        if (!candidate.empty() && read_sync_state(sync_state_file(candidate), state) &&
+            state.repo == owner + "/" + repo && state.path == path) {
+            old_state = state;
+            output = candidate;
+            break;
+        }
+    }
+    if (!old_state.commit.empty() && !std::filesystem::exists(output)) {
+        old_state = SyncState();  // output was removed: start over
+    } else if (old_state.commit == commit) {
+        if (chatty())
+            std::printf("'%s' is up to date at %s.\n", output.c_str(), commit.substr(0, 12).c_str());
+        return true;
+    }
+
+    TraceSpan span("phase", "sync");
+    span.arg("commit", commit);
+    ObjectRepo objects(owner, repo);
+    if (!objects.ok())
+        return false;
+    const std::string& git_dir = objects.git_dir();
+    auto finish = [&](bool ok) {
+        if (ok && chatty())
+            std::puts("done.");
+        return ok;
+    };
+
+    std::string gd = "--git-dir=" + git_dir;
+    std::vector<std::string> commits = {commit};
+    if (!old_state.commit.empty())
+        commits.push_back(old_state.commit);
+    if (!fetch_commit_trees(git_dir, commits))
+        return finish(false);
+
+    // "<mode> <type> <oid>\t<path>" for the path itself
+    std::string entry = git_output({gd, "ls-tree", "--full-tree", commit, "--", path});
+    std::istringstream fields(entry);
+    SyncState state{owner + "/" + repo, path, commit, "", ""};
+    std::string mode;
+    fields >> mode >> state.kind >> state.object;
+    if (state.kind != "tree" && state.kind != "blob") {
+        std::fprintf(stderr, "%s: '%s' not found in %s/%s at %s\n", PROGRAM_NAME, path.c_str(),
+                     owner.c_str(), repo.c_str(), want.c_str());
+        return finish(false);
+    }
+    if (output.empty())
+        output = state.kind == "tree" ? dir_output : file_output;
+    if (old_state.commit.empty() && std::filesystem::exists(output)) {
+        std::fprintf(stderr, "%s: %s has no sync record; remove it to sync afresh\n", PROGRAM_NAME,
+                     output.c_str());
+        return finish(false);
+    }
+    if (old_state.commit.empty() && !path_available_for_write(output))
+        return finish(false);
+    if (!old_state.kind.empty() && old_state.kind != state.kind) {
+        std::fprintf(stderr, "%s: '%s' changed between file and directory; remove %s to sync afresh\n",
+                     PROGRAM_NAME, path.c_str(), output.c_str());
+        return finish(false);
+    }
+
+    std::vector<SyncChange> changes;
+    std::filesystem::path root = output;
+    if (state.object == old_state.object) {
+        // commit moved, path did not
+    } else if (state.kind == "blob") {
+        root = root.parent_path();
+        changes.push_back({'M', mode, state.object, std::filesystem::path(output).filename().string(), ""});
+    } else {
+        std::vector<std::string> args = {gd, "diff-tree", "-r", "-z", "--raw", "-M100%",
+                                         old_state.object.empty() ? std::string("4b825dc642cb6eb9a060e54bf8d69288fbee4904")
+                                                                  : old_state.object,
+                                         state.object};
+        RunOptions options;
+        options.out = Stream::Capture;
+        RunResult diff = run_git(args, options);
+        if (diff.status != 0) {
+            std::fprintf(stderr, "%s: diff failed (exit %d)\n", PROGRAM_NAME, diff.status);
+            return finish(false);
+        }
+        // ":<old mode> <new mode> <old oid> <new oid> <status>\0<path>\0[<new path>\0]"
+        std::size_t pos = 0;
+        const std::string& out = diff.out;
+        while (pos < out.size() && out[pos] == ':') {
+            std::size_t end = out.find('\0', pos);
+            std::istringstream meta(out.substr(pos + 1, end - pos - 1));
+            std::string old_mode, new_mode, old_oid, new_oid, status;
+            meta >> old_mode >> new_mode >> old_oid >> new_oid >> status;
+            pos = end + 1;
+            end = out.find('\0', pos);
+            SyncChange change{status[0], new_mode, new_oid, out.substr(pos, end - pos), ""};
+            pos = end + 1;
+            if (change.status == 'R') {
+                end = out.find('\0', pos);
+                change.old_path = change.path;
+                change.path = out.substr(pos, end - pos);
+                pos = end + 1;
+            }
+            if (filters_active()) {
+                // a rename across the filter boundary is an add or a delete
+                bool now = path_selected(change.path);
+                bool before = change.status == 'R' ? path_selected(change.old_path) : now;
+                if (!now && !before)
+                    continue;
+                if (change.status == 'R' && !before)
+                    change.status = 'A';
+                else if (change.status == 'R' && !now)
+                    change = {'D', old_mode, old_oid, change.old_path, ""};
+            }
+            if (new_mode != "160000" || change.status == 'D')
+                changes.push_back(change);
+        }
+    }
+
+    // deletions and renames first, so paths they free can be reused
+    std::error_code ec;
+    std::filesystem::create_directories(root, ec);
+    std::size_t removed = 0, renamed = 0;
+    std::vector<const SyncChange*> writes;
+    for (const auto& change : changes) {
+        if (change.status == 'D') {
+            std::filesystem::remove(root / change.path, ec);
+            prune_empty_dirs((root / change.path).parent_path(), root);
+            removed++;
+        } else if (change.status == 'R') {
+            std::filesystem::path to = root / change.path;
+            std::filesystem::create_directories(to.parent_path(), ec);
+            std::filesystem::rename(root / change.old_path, to, ec);
+            bool exec = (std::filesystem::status(to, ec).permissions() & std::filesystem::perms::owner_exec) !=
+                        std::filesystem::perms::none;
+            if (ec || exec != (change.mode == "100755")) {
+                // the old file is gone, or its mode changed; a chmod could
+                // reach a --store object through a hardlink, so write it anew
+                std::filesystem::remove(to, ec);
+                writes.push_back(&change);
+            }
+            prune_empty_dirs((root / change.old_path).parent_path(), root);
+            renamed++;
+        } else {
+            writes.push_back(&change);
+        }
+    }
+    if (!sync_write_blobs(git_dir, root, writes, state.object,
+                          state.kind == "tree" ? old_state.object : ""))
+        return finish(false);
+    if (opt.verbose)
+        std::fprintf(stderr, "%s: synced %s: %zu written, %zu removed, %zu renamed\n", PROGRAM_NAME,
+                     output.c_str(), writes.size(), removed, renamed);
+    span.arg("written", static_cast<long long>(writes.size()));
+    span.arg("removed", static_cast<long long>(removed));
+    span.arg("renamed", static_cast<long long>(renamed));
+
+    return finish(write_sync_state(sync_state_file(output), state));
+}
+
+// -o -: a directory (or the whole repository) is written to stdout as a tar
+// stream built from objects alone. The trees come from a blob-less fetch,
+// the blobs from one batched fetch, and each blob passes from cat-file
+// straight into the stream; nothing is checked out or written to disk
+// besides the object store itself.
+class TarWriter {
+public:
+    TarWriter(std::FILE* out, long long mtime) : out_(out), mtime_(mtime) {}
+
+    // Starts an entry of SIZE content bytes: TYPE '0' is a file, '2' a
+    // symlink to LINK and '5' a directory. Names and link targets too long
+    // for ustar, and sizes from 8 GiB, go into a pax header first.
+    bool begin(const std::string& name, char type, unsigned mode, std::uint64_t size,
+               const std::string& link = "") {
+        std::string records;
+        if (name.size() > 100)
+            records += pax_record("path", name);
+        if (link.size() > 100)
+            records += pax_record("linkpath", link);
+        if (size > MAX_OCTAL)
+            records += pax_record("size", std::to_string(size));
+        if (!records.empty() && !(header("././@PaxHeader", 'x', 0644, records.size(), "") &&
+                                  write(records.data(), records.size()) && end(records.size())))
+            return false;
+        return header(name, type, mode, size, link);
+    }
+
+    bool write(const char* data, std::size_t size) {
+        return std::fwrite(data, 1, size, out_) == size;
+    }
+
+    // Pads an entry of SIZE content bytes to a whole block
+    bool end(std::uint64_t size) {
+        static const char zeros[512] = {};
+        return write(zeros, static_cast<std::size_t>((512 - size % 512) % 512));
     }
 
-    return "main";
-}
+    // Two zero blocks close the archive
+    bool finish() {
+        static const char zeros[1024] = {};
+        return write(zeros, sizeof(zeros));
+    }
 
-bool check_dependencies(void) {
-#ifdef _WIN32
-    bool curl_ok = (system("curl --version >nul 2>&1") == 0);
-    bool git_ok = (system("git --version >nul 2>&1") == 0);
-#else
-    bool curl_ok = (system("curl --version >/dev/null 2>&1") == 0);
-    bool git_ok = (system("git --version >/dev/null 2>&1") == 0);
-#endif
+private:
+    static constexpr std::uint64_t MAX_OCTAL = 077777777777ULL;
 
-    if (!curl_ok) {
-        fprintf(stderr, "%s: curl not found - please install curl\n", PROGRAM_NAME);
-        return false;
+    // "<length> <key>=<value>\n", where length counts its own digits
+    static std::string pax_record(const std::string& key, const std::string& value) {
+        std::string body = " " + key + "=" + value + "\n";
+        std::size_t length = body.size() + 1;
+        while (std::to_string(length).size() + body.size() != length)
+            length = std::to_string(length).size() + body.size();
+        return std::to_string(length) + body;
     }
-    if (!git_ok) {
-        fprintf(stderr, "%s: git not found - please install git\n", PROGRAM_NAME);
-        return false;
+
+    bool header(const std::string& name, char type, unsigned mode, std::uint64_t size, const std::string& link) {
+        char block[512] = {};
+        std::memcpy(block, name.data(), std::min<std::size_t>(name.size(), 100));
+        std::snprintf(block + 100, 8, "%07o", mode & 07777);
+        std::snprintf(block + 108, 8, "%07o", 0u);
+        std::snprintf(block + 116, 8, "%07o", 0u);
+        std::snprintf(block + 124, 12, "%011llo", static_cast<unsigned long long>(size > MAX_OCTAL ? 0 : size));
+        std::snprintf(block + 136, 12, "%011llo", static_cast<unsigned long long>(mtime_) & MAX_OCTAL);
+        std::memset(block + 148, ' ', 8);
+        block[156] = type;
+        std::memcpy(block + 157, link.data(), std::min<std::size_t>(link.size(), 100));
+        std::memcpy(block + 257, "ustar", 6);
+        std::memcpy(block + 263, "00", 2);
+        unsigned sum = 0;
+        for (unsigned char c : block)
+            sum += c;
+        std::snprintf(block + 148, 8, "%06o", sum & 0777777u);
+        return write(block, sizeof(block));
     }
-    return true;
-}
 
-// Downloads a specific directory from a GitHub repository using git sparse-checkout
-bool download_directory_selective(const std::string& owner,
-                                  const std::string& repo,
-                                  const std::string& path,
-                                  const std::string& output) {
-    if (!opt_quiet)
-        std::printf("Downloading directory '%s'...\n", path.c_str());
+    std::FILE* out_;
+    long long mtime_;
+};
 
-    if (!path_available_for_write(output)) return false;
+// Streams PATH at REF (the whole repository when PATH is empty) to stdout as
+// a tar of entries under NAME/, through `zstd` for --compress=zstd. With LFS
+// on, blobs small enough to be pointers are held back; the pointers among
+// them are resolved together once the rest is out, and their objects close
+// the archive. MISSING, when given, is set if PATH is not a directory at REF.
+static bool stream_tree(const std::string& owner,
+                        const std::string& repo,
+                        const std::string& path,
+                        const std::string& ref,
+                        const std::string& name,
+                        bool* missing = nullptr) {
+    std::string want = ref.empty() ? resolve_default_branch(owner, repo) : ref;
+    std::string commit, kind;
+    if (!resolve_ref(owner, repo, want, commit, kind))
+        return false;
 
-    std::string temp_dir = create_temp_dir();
-    if (temp_dir.empty()) {
-        std::fprintf(stderr, "%s: failed to create temp directory\n", PROGRAM_NAME);
+    TraceSpan span("phase", "tar stream");
+    span.arg("commit", commit);
+    ObjectRepo objects(owner, repo);
+    if (!objects.ok() || !fetch_commit_trees(objects.git_dir(), {commit}))
+        return false;
+    std::string gd = "--git-dir=" + objects.git_dir();
+    std::string tree = path.empty() ? commit + "^{tree}" : commit + ":" + path;
+    if (git_output({gd, "cat-file", "-t", tree}) != "tree") {
+        std::fprintf(stderr, "%s: directory '%s' not found in repository\n", PROGRAM_NAME, path.c_str());
+        if (missing)
+            *missing = true;
         return false;
     }
-
-    std::string git_url = "https://github.com/" + owner + "/" + repo + ".git";
-    
-    const char* token = std::getenv("GITHUB_TOKEN");
-    std::string auth_config = token ? ("-c http.extraHeader=" + 
-                                      quote_arg(std::string("Authorization: Bearer ") + token) + " ") : "";
-    
-    std::string clone_cmd = make_git_command(auth_config + 
-                           "-c http.lowSpeedLimit=1000 -c http.lowSpeedTime=10 " +
-                           "clone --filter=blob:none --no-checkout --depth 1 ");
-    if (!opt_quiet)
-        clone_cmd += "--progress ";
-    clone_cmd += quote_arg(git_url) + " " + quote_arg(temp_dir);
-    if (!opt_verbose) clone_cmd += dev_null();
-
-    if (opt_verbose)
-        std::fprintf(stderr, "%s: cloning repository...\n", PROGRAM_NAME);
-    
-    int result = std::system(clone_cmd.c_str());
-    if (result != 0) {
-        int exit_code = exit_status_of(result);
-        std::fprintf(stderr, "%s: clone failed (exit %d)\n", PROGRAM_NAME, exit_code);
-        std::filesystem::remove_all(temp_dir);
+    std::vector<TreeBlob> blobs = selected_blobs({gd}, tree);
+    std::vector<std::string> oids;
+    std::set<std::string> needed;
+    for (const auto& blob : blobs) {
+        oids.push_back(blob.oid);
+        needed.insert(blob.oid);
+    }
+    if (!prefetch_blobs({gd}, {tree}, &needed))
         return false;
+    // entries carry the commit time, as with git archive
+    long long mtime = std::atoll(git_output({gd, "show", "-s", "--format=%ct", commit}).c_str());
+
+    std::fflush(stdout);
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    // the tar goes to stdout, or to the stdin of a zstd that writes there
+    bool streamed = false;
+    bool ok = true;
+    auto write_tar = [&](std::FILE* out) {
+        TarWriter tar(out, mtime);
+        std::set<std::string> dirs;
+        const TreeBlob* blob = nullptr;
+        std::uint64_t blob_size = 0;
+        std::string link_target;
+        bool holding = false;
+        std::string held;
+        std::vector<std::pair<const TreeBlob*, std::string>> pointers;
+        ok = tar.begin(name + "/", '5', 0755, 0);
+        BlobStream stream;
+        stream.begin = [&](std::size_t index, std::uint64_t size) {
+            blob = &blobs[index];
+            blob_size = size;
+            // ls-tree -r lists paths in order, so each directory is seen before
+            // anything inside it
+            for (std::size_t slash = blob->path.find('/'); ok && slash != std::string::npos;
+                 slash = blob->path.find('/', slash + 1)) {
+                if (dirs.insert(blob->path.substr(0, slash)).second)
+                    ok = tar.begin(name + "/" + blob->path.substr(0, slash + 1), '5', 0755, 0);
+            }
+            link_target.clear();
+            held.clear();
+            holding = opt.lfs && blob->mode != "120000" && size <= LFS_POINTER_MAX;
+            if (ok && blob->mode != "120000" && !holding)
+                ok = tar.begin(name + "/" + blob->path, '0', blob->mode == "100755" ? 0755 : 0644, size);
+            return ok;
+        };
+        stream.data = [&](const char* data, std::size_t size) {
+            if (blob->mode == "120000")
+                link_target.append(data, size);
+            else if (holding)
+                held.append(data, size);
+            else
+                ok = tar.write(data, size);
+            return ok;
+        };
+        stream.end = [&]() {
+            std::string lfs_oid;
+            std::uint64_t lfs_size = 0;
+            if (blob->mode == "120000")
+                ok = tar.begin(name + "/" + blob->path, '2', 0777, 0, link_target);
+            else if (holding && parse_lfs_pointer(held, lfs_oid, lfs_size))
+                pointers.push_back({blob, held});
+            else if (holding)
+                ok = tar.begin(name + "/" + blob->path, '0', blob->mode == "100755" ? 0755 : 0644, blob_size) &&
+                     tar.write(held.data(), held.size()) && tar.end(blob_size);
+            else
+                ok = tar.end(blob_size);
+            return ok;
+        };
+        streamed = ok && stream_blobs(objects.git_dir(), oids, stream);
+        if (streamed && !pointers.empty()) {
+            std::string temp_dir = create_temp_dir();
+            if (temp_dir.empty())
+                std::fprintf(stderr, "%s: failed to create temp directory\n", PROGRAM_NAME);
+            std::vector<std::filesystem::path> files;
+            for (std::size_t i = 0; !temp_dir.empty() && i < pointers.size(); i++) {
+                files.push_back(std::filesystem::path(temp_dir) / std::to_string(i));
+                std::ofstream(files.back(), std::ios::binary)
+                    .write(pointers[i].second.data(), static_cast<std::streamsize>(pointers[i].second.size()));
+            }
+            streamed = !temp_dir.empty();
+            if (streamed)
+                resolve_lfs(owner, repo, files);  // an unresolved pointer goes in as it is
+            for (std::size_t i = 0; streamed && ok && i < files.size(); i++) {
+                const TreeBlob* pointer = pointers[i].first;
+                std::error_code ec;
+                std::uint64_t size = std::filesystem::file_size(files[i], ec);
+                ok = !ec && tar.begin(name + "/" + pointer->path, '0', pointer->mode == "100755" ? 0755 : 0644,
+                                      size);
+                std::ifstream in(files[i], std::ios::binary);
+                char buffer[1 << 16];
+                while (ok && (in.read(buffer, sizeof buffer) || in.gcount() > 0))
+                    ok = tar.write(buffer, static_cast<std::size_t>(in.gcount()));
+                ok = ok && tar.end(size);
+            }
+            std::error_code ec;
+            if (!temp_dir.empty())
+                std::filesystem::remove_all(temp_dir, ec);
+        }
+        if (streamed)
+            ok = tar.finish() && std::fflush(out) == 0;
+    };
+
+    if (opt.compress == Compress::Zstd) {
+        RunOptions options;
+        options.out = Stream::Inherit;
+        options.err = Stream::Inherit;
+        options.feed = write_tar;
+        int result = run_process({"zstd", "-q", "-c"}, options).status;
+        if (result != 0 && streamed && ok) {
+            std::fprintf(stderr, "%s: zstd failed (exit %d)\n", PROGRAM_NAME, result);
+            ok = false;
+        }
+    } else {
+        write_tar(stdout);
     }
+    if (!ok)
+        std::fprintf(stderr, "%s: write to %s failed\n", PROGRAM_NAME,
+                     opt.compress == Compress::Zstd ? "zstd" : "stdout");
+    span.arg("files", static_cast<long long>(blobs.size()));
+    return streamed && ok;
+}
 
-    std::string sparse_init_cmd = make_git_command("-C " + quote_arg(temp_dir) + 
-                                 " sparse-checkout init --cone");
-    if (!opt_verbose) sparse_init_cmd += dev_null();
+// Key under which the ref cache remembers that PATH at REF is a directory
+static std::string path_kind_key(const std::string& ref, const std::string& path) {
+    return "tree:" + (ref.empty() ? std::string("HEAD") : ref) + ":" + path;
+}
 
-    if (opt_verbose)
-        std::fprintf(stderr, "%s: initializing sparse checkout...\n", PROGRAM_NAME);
-    
-    result = std::system(sparse_init_cmd.c_str());
-    if (result != 0) {
-        int exit_code = exit_status_of(result);
-        std::fprintf(stderr, "%s: sparse-checkout init failed (exit %d)\n", PROGRAM_NAME, exit_code);
-        std::filesystem::remove_all(temp_dir);
-        return false;
+// Fetches PATH the way the command line does: no path clones the repository,
+// a trailing slash selects a directory, anything else is tried as a file first.
+// An empty dest selects the default location under --output-dir.
+static bool fetch_target(const std::string& owner,
+                         const std::string& repo,
+                         const std::string& path,
+                         const std::string& ref,
+                         const std::string& dest) {
+    TraceSpan span("target", owner + "/" + repo + " " + (path.empty() ? "." : path));
+    if (ref.size())
+        span.arg("ref", ref);
+    if (path.empty()) {
+        if (opt.sync) {
+            std::fprintf(stderr, "%s: --sync needs a PATH\n", PROGRAM_NAME);
+            return false;
+        }
+        if (output_to_stdout())
+            return stream_tree(owner, repo, "", ref, repo);
+        // clone whole repo - use repo name as default destination
+        return clone_repository(owner, repo, "", ref, dest.empty() ? default_clone_output(repo) : dest);
     }
 
-    std::string sparse_set_cmd = make_git_command("-C " + quote_arg(temp_dir) + 
-                                " sparse-checkout set -- " + quote_arg(path));
-    if (!opt_verbose) sparse_set_cmd += dev_null();
+    bool is_dir = path.back() == '/';
+    std::string dir_path = is_dir ? path.substr(0, path.length() - 1) : path;
+    if (opt.sync) {
+        return sync_path(owner, repo, path, ref, dest.empty() ? default_dir_output(dir_path) : dest,
+                         dest.empty() ? default_file_output(path) : dest);
+    }
+    // seen as a directory before: skip the file request that would 404
+    // (--sha256 names a file, so it always asks for one)
+    std::string known;
+    bool kind_cached = !is_dir && opt.sha256.empty() && ref_cache_get(owner, repo, path_kind_key(ref, path), known);
+    is_dir = is_dir || kind_cached;
 
-    if (opt_verbose)
-        std::fprintf(stderr, "%s: setting sparse checkout pattern...\n", PROGRAM_NAME);
-    
-    result = std::system(sparse_set_cmd.c_str());
-    if (result != 0) {
-        int exit_code = exit_status_of(result);
-        std::fprintf(stderr, "%s: sparse-checkout set failed (exit %d)\n", PROGRAM_NAME, exit_code);
-        std::filesystem::remove_all(temp_dir);
+    if (!is_dir) {
+        // single file; a 404 comes back after one round trip and means the
+        // path may be a directory, any other failure ends the attempt
+        std::string output_file = output_to_stdout() ? "-" : dest.empty() ? default_file_output(path) : dest;
+        bool not_found = false;
+        if (download_file(owner, repo, path, ref, output_file, &not_found))
+            return true;
+        if (!not_found)
+            return false;
+        if (chatty())
+            std::fprintf(stderr, "%s: trying as directory...\n", PROGRAM_NAME);
+    }
+    if (!opt.sha256.empty()) {
+        std::fprintf(stderr, "%s: --sha256 checks a file, and '%s' is a directory\n", PROGRAM_NAME,
+                     dir_path.c_str());
         return false;
     }
 
-    if (!opt_branch.empty()) {
-        if (opt_verbose)
-            std::fprintf(stderr, "%s: fetching reference '%s'...\n", PROGRAM_NAME, opt_branch.c_str());
-        
-        // try tag first
-        std::string fetch_tag_cmd = make_git_command("-C " + quote_arg(temp_dir) + " " + auth_config + 
-                                   "fetch --depth 1 origin tag " + quote_arg(opt_branch));
-        if (!opt_verbose) fetch_tag_cmd += dev_null();
-        
-        result = std::system(fetch_tag_cmd.c_str());
-        if (result != 0) {
-            // try branch
-            std::string fetch_branch_cmd = make_git_command("-C " + quote_arg(temp_dir) + " " + auth_config + 
-                                          "fetch --depth 1 origin " + quote_arg(opt_branch) + ":" + quote_arg(opt_branch));
-            if (!opt_verbose) fetch_branch_cmd += dev_null();
-            
-            result = std::system(fetch_branch_cmd.c_str());
-            if (result != 0 && looks_like_commit_sha(opt_branch)) {
-                // try direct SHA fetch
-                std::string fetch_sha_cmd = make_git_command("-C " + quote_arg(temp_dir) + " " + auth_config + 
-                                           "fetch --depth 1 origin " + quote_arg(opt_branch));
-                if (!opt_verbose) fetch_sha_cmd += dev_null();
-                
-                result = std::system(fetch_sha_cmd.c_str());
-            }
-        }
-        
-        if (result != 0) {
-            int exit_code = exit_status_of(result);
-            std::fprintf(stderr, "%s: fetch failed for '%s' (exit %d)\n", PROGRAM_NAME, opt_branch.c_str(), exit_code);
-            std::filesystem::remove_all(temp_dir);
+    // a remembered kind goes stale when the path is replaced by a file: forget
+    // it and start over with the file request
+    auto retry_as_file = [&]() {
+        ref_cache_drop(owner, repo, path_kind_key(ref, path));
+        if (chatty())
+            std::fprintf(stderr, "%s: trying as file...\n", PROGRAM_NAME);
+        return fetch_target(owner, repo, path, ref, dest);
+    };
+    if (output_to_stdout()) {
+        bool missing = false;
+        if (stream_tree(owner, repo, dir_path, ref, std::filesystem::path(dir_path).filename().string(), &missing))
+            return true;
+        return missing && kind_cached ? retry_as_file() : false;
+    }
+    std::vector<DirRequest> dirs = {{dir_path, dest.empty() ? default_dir_output(dir_path) : dest}};
+    if (download_directories_selective(owner, repo, dirs, ref)) {
+        if (path.back() != '/')
+            ref_cache_put(owner, repo, path_kind_key(ref, path), "tree");
+        return true;
+    }
+    if (dirs[0].missing && kind_cached)
+        return retry_as_file();
+    // a missing directory will not appear in a full clone, and a whole-repo
+    // fallback per entry would be wasteful in a batch
+    if (dirs[0].missing || path.back() != '/' || !chatty())
+        return false;
+    std::fprintf(stderr, "%s: trying full repo clone...\n", PROGRAM_NAME);
+    return clone_repository(owner, repo, "", ref, default_clone_output(repo));
+}
+
+struct ManifestEntry {
+    int line;
+    std::string spec;  // the OWNER/REPO column as written, for the report
+    std::string owner;
+    std::string repo;
+    std::string path;
+    std::string ref;
+    std::string dest;
+    bool ok;
+    double seconds;
+};
+
+// Reads manifest lines of the form "OWNER/REPO PATH [REF] [DEST]". Blank lines
+// and '#' comments are skipped; a REF of "-" keeps the default branch so that
+// DEST can still be given.
+static bool read_manifest(const std::string& file, std::vector<ManifestEntry>& entries) {
+    std::ifstream in_file;
+    if (file != "-") {
+        in_file.open(file);
+        if (!in_file) {
+            std::fprintf(stderr, "%s: cannot read manifest: %s\n", PROGRAM_NAME, file.c_str());
             return false;
         }
+    }
+    std::istream& in = file == "-" ? std::cin : in_file;
 
-        std::string checkout_cmd = make_git_command("-C " + quote_arg(temp_dir) + " checkout " + quote_arg(opt_branch));
-        if (!opt_verbose) checkout_cmd += dev_null();
-        
-        if (opt_verbose)
-            std::fprintf(stderr, "%s: checking out '%s'...\n", PROGRAM_NAME, opt_branch.c_str());
-        
-        result = std::system(checkout_cmd.c_str());
-        if (result != 0) {
-            int exit_code = exit_status_of(result);
-            std::fprintf(stderr, "%s: checkout failed for '%s' (exit %d)\n", PROGRAM_NAME, opt_branch.c_str(), exit_code);
-            std::filesystem::remove_all(temp_dir);
-            return false;
+    std::string text;
+    int line_no = 0;
+    bool valid = true;
+    while (std::getline(in, text)) {
+        line_no++;
+        auto hash = text.find('#');
+        if (hash != std::string::npos)
+            text.erase(hash);
+
+        std::istringstream fields(text);
+        std::vector<std::string> cols;
+        std::string col;
+        while (fields >> col)
+            cols.push_back(col);
+        if (cols.empty())
+            continue;
+
+        ManifestEntry entry{line_no, cols[0], "", "", "", "", "", false, 0.0};
+        std::string url_path, url_branch;
+        if (cols.size() > 4 || !parse_github_url(cols[0], entry.owner, entry.repo, url_path, url_branch)) {
+            std::fprintf(stderr, "%s: %s:%d: expected OWNER/REPO PATH [REF] [DEST]\n", PROGRAM_NAME,
+                         file.c_str(), line_no);
+            valid = false;
+            continue;
         }
-    } else {
-        // No specific branch - just checkout default with sparse rules
-        std::string checkout_cmd = make_git_command("-C " + quote_arg(temp_dir) + " checkout");
-        if (!opt_verbose) checkout_cmd += dev_null();
-        
-        if (opt_verbose)
-            std::fprintf(stderr, "%s: checking out default branch...\n", PROGRAM_NAME);
-        
-        result = std::system(checkout_cmd.c_str());
-        if (result != 0) {
-            int exit_code = exit_status_of(result);
-            std::fprintf(stderr, "%s: checkout failed (exit %d)\n", PROGRAM_NAME, exit_code);
-            std::filesystem::remove_all(temp_dir);
-            return false;
+        entry.path = cols.size() > 1 ? cols[1] : url_path;
+        if (cols.size() > 2 && cols[2] != "-")
+            entry.ref = cols[2];
+        else if (!url_branch.empty() && url_branch != "master" && url_branch != "main")
+            entry.ref = url_branch;
+        else
+            entry.ref = opt.branch;
+        if (cols.size() > 3)
+            entry.dest = cols[3];
+        entries.push_back(entry);
+    }
+    return valid;
+}
+
+// Runs ENTRIES on a pool of opt.jobs workers and prints a per-entry report
+// once all of them have finished. Directory entries for the same repo and ref
+// are grouped into one job that shares a single clone and sparse checkout;
+// files and whole-repo clones are individual jobs, as is every entry under
+// --sync, which works from each destination's own record.
+static bool run_entries(std::vector<ManifestEntry>& entries) {
+    std::vector<std::vector<std::size_t>> jobs;
+    std::map<std::string, std::size_t> dir_groups;
+    for (std::size_t i = 0; i < entries.size(); i++) {
+        const ManifestEntry& entry = entries[i];
+        if (!opt.sync && !entry.path.empty() && entry.path.back() == '/') {
+            std::string key = entry.owner + "/" + entry.repo + "@" + entry.ref;
+            auto it = dir_groups.find(key);
+            if (it != dir_groups.end()) {
+                jobs[it->second].push_back(i);
+                continue;
+            }
+            dir_groups.emplace(key, jobs.size());
         }
+        jobs.push_back({i});
     }
 
-    std::filesystem::path src_path = std::filesystem::path(temp_dir) / path;
-    std::filesystem::path dest_path = std::filesystem::current_path() / output;
-    
-    if (opt_verbose)
-        std::fprintf(stderr, "%s: copying files...\n", PROGRAM_NAME);
-    
-    std::error_code copy_ec;
-    std::filesystem::copy(src_path, dest_path, 
-                         std::filesystem::copy_options::recursive, 
-                         copy_ec);
+    auto run_job = [&entries](const std::vector<std::size_t>& job) {
+        auto start = std::chrono::steady_clock::now();
+        const ManifestEntry& first = entries[job.front()];
+        if (job.size() == 1) {
+            entries[job.front()].ok = fetch_target(first.owner, first.repo, first.path, first.ref, first.dest);
+        } else {
+            TraceSpan span("target", first.owner + "/" + first.repo + " (" + std::to_string(job.size()) +
+                                         " directories)");
+            std::vector<DirRequest> dirs;
+            for (std::size_t i : job) {
+                std::string dir_path = entries[i].path.substr(0, entries[i].path.length() - 1);
+                dirs.push_back({dir_path, entries[i].dest.empty() ? default_dir_output(dir_path) : entries[i].dest});
+            }
+            download_directories_selective(first.owner, first.repo, dirs, first.ref);
+            for (std::size_t k = 0; k < job.size(); k++)
+                entries[job[k]].ok = dirs[k].ok;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (std::size_t i : job)
+            entries[i].seconds = seconds;
+    };
 
-    std::error_code ec;
-    std::filesystem::remove_all(temp_dir, ec);
-    if (ec && opt_verbose) {
-        std::fprintf(stderr, "%s: warning: failed to remove temp dir: %s\n", PROGRAM_NAME,
-                     ec.message().c_str());
-    }
+    batch_mode = true;
+    parallel_for(jobs.size(), static_cast<std::size_t>(opt.jobs), [&](std::size_t i) { run_job(jobs[i]); });
+    batch_mode = false;
 
-    if (copy_ec) {
-        std::fprintf(stderr, "%s: copy failed: %s\n", PROGRAM_NAME, copy_ec.message().c_str());
-        return false;
+    std::size_t failed = 0;
+    for (const auto& entry : entries) {
+        if (!entry.ok)
+            failed++;
+        if (opt.quiet && entry.ok)
+            continue;
+        std::fprintf(opt.quiet ? stderr : stdout, "%-6s %s %s%s%s (%.2fs)\n", entry.ok ? "ok" : "FAILED",
+                     entry.spec.c_str(), entry.path.empty() ? "." : entry.path.c_str(),
+                     entry.ref.empty() ? "" : "@", entry.ref.c_str(), entry.seconds);
     }
+    if (!opt.quiet || failed)
+        std::fprintf(opt.quiet ? stderr : stdout, "%s: %zu of %zu entries succeeded\n", PROGRAM_NAME,
+                     entries.size() - failed, entries.size());
+    return failed == 0;
+}
 
-    if (!opt_quiet)
-        std::puts("done.");
-    return true;
+static bool run_manifest(const std::string& file) {
+    std::vector<ManifestEntry> entries;
+    if (!read_manifest(file, entries))
+        return false;
+    return run_entries(entries);
 }
 
-// Downloads a single file from a GitHub repository using curl
-bool download_file(const std::string& owner,
-                   const std::string& repo,
-                   const std::string& path,
-                   const std::string& output) {
-    if (!opt_quiet)
-        std::printf("Downloading '%s'...\n", path.c_str());
+// --- daemon mode ---
+//
+// `sip --daemon=SOCKET` listens on a Unix socket and runs each request inside
+// the daemon process itself, one at a time. What a run builds up in memory
+// stays warm between requests: the built-in HTTP transport's connections,
+// TLS sessions and DNS cache (make WITH_LIBCURL=1), and the default-branch
+// memo (kept for --ref-ttl). The object cache is always on, so partial
+// clones and the ref cache are shared as well; a request for a repository
+// that another has just fetched finds the commit already there. Without the
+// built-in transport, transfers are still curl and git children.
+//
+// `sip --connect=SOCKET ARGS...` sends its arguments, working directory, a few
+// environment variables and its stdin/stdout/stderr (SCM_RIGHTS). The daemon
+// puts them in place of its own for the request, parses ARGS from fresh
+// Options, as a normal invocation would, and answers with the exit status.
+// Requests arriving meanwhile wait in the socket's backlog.
 
-    if (!path_available_for_write(output)) return false;
+static const char* const daemon_env[] = {"GITHUB_TOKEN",         "SIP_TOKEN_ORIGINS", "SIP_GIT_BASE_URL",
+                                         "SIP_RAW_BASE_URL",     "SIP_TARBALL_BASE_URL",
+                                         "SIP_API_BASE_URL",     "SIP_STORE_DIR"};
 
-    std::string ref = opt_branch;
-    if (ref.empty()) {
-        if (opt_verbose)
-            std::fprintf(stderr, "%s: discovering default branch...\n", PROGRAM_NAME);
-        ref = discover_default_branch(owner, repo);
-        if (opt_verbose)
-            std::fprintf(stderr, "%s: using default branch: %s\n", PROGRAM_NAME, ref.c_str());
+static int run_cli(int argc, char** argv, const Options& defaults);
+
+static bool serving_request = false;  // run_cli() is running a daemon request
+
+#ifndef _WIN32
+static bool write_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= static_cast<std::size_t>(n);
     }
+    return true;
+}
 
-    std::string url =
-        "https://raw.githubusercontent.com/" + owner + "/" + repo + "/" + ref + "/" + path;
+static bool read_all(int fd, char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
 
-    std::string cmd = "curl ";
-    if (!opt_quiet)
-        cmd += "--progress-bar ";
-    else
-        cmd += "-s ";
-    
-    const char* token = std::getenv("GITHUB_TOKEN");
-    if (token) {
-        cmd += "-H " + quote_arg(std::string("Authorization: Bearer ") + token) + " ";
+static bool socket_address(const std::string& path, sockaddr_un& addr) {
+    addr = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        std::fprintf(stderr, "%s: socket path too long: %s\n", PROGRAM_NAME, path.c_str());
+        return false;
     }
-    
-    cmd += "-f -L --retry 3 --retry-all-errors --retry-delay 1 --max-time " +
-           std::to_string(opt_timeout) + " -o " + quote_arg(output) + " " + quote_arg(url);
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
 
-    if (!opt_verbose) {
-        cmd += dev_null();
+// Client side of --connect. Returns the request's exit status, or -1 when no
+// daemon answers at PATH so that the caller can run the request itself.
+static int run_client(const std::string& path, const std::vector<std::string>& args) {
+    sockaddr_un addr;
+    if (!socket_address(path, addr))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) {
+        std::fprintf(stderr, "%s: no daemon at %s (%s), running locally\n", PROGRAM_NAME, path.c_str(),
+                     std::strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
     }
 
-    if (opt_verbose)
-        std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, cmd.c_str());
+    // payload: NUL-terminated working directory, then "E"NAME=VALUE and
+    // "A"ARG strings; its length travels with the descriptors
+    std::error_code ec;
+    std::string payload = std::filesystem::current_path(ec).string();
+    payload.push_back('\0');
+    for (const char* name : daemon_env) {
+        if (const char* value = std::getenv(name)) {
+            payload += std::string("E") + name + "=" + value;
+            payload.push_back('\0');
+        }
+    }
+    for (const auto& arg : args) {
+        payload += "A" + arg;
+        payload.push_back('\0');
+    }
 
-    int result = std::system(cmd.c_str());
-    if (result == 0) {
-        if (!opt_quiet)
-            std::puts("done.");
-        return true;
+    std::uint32_t size = static_cast<std::uint32_t>(payload.size());
+    iovec iov = {&size, sizeof size};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof fds)] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+    if (sendmsg(fd, &msg, 0) != static_cast<ssize_t>(sizeof size) ||
+        !write_all(fd, payload.data(), payload.size())) {
+        std::fprintf(stderr, "%s: cannot send request to daemon: %s\n", PROGRAM_NAME, std::strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
     }
 
-    int exit_code = exit_status_of(result);
-    if (exit_code == 22) {
-        std::fprintf(stderr, "%s: file not found (check path/branch)\n", PROGRAM_NAME);
-    } else {
-        std::fprintf(stderr, "%s: download failed (exit %d)\n", PROGRAM_NAME, exit_code);
+    // the answer is the exit status in decimal, sent when the request is done
+    std::string answer;
+    char buffer[32];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof buffer)) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0)
+            answer.append(buffer, static_cast<std::size_t>(n));
     }
-    return false;
+    close(fd);
+    if (answer.empty()) {
+        std::fprintf(stderr, "%s: daemon closed the connection\n", PROGRAM_NAME);
+        return EXIT_FAILURE;
+    }
+    return std::atoi(answer.c_str());
 }
 
-// Clones an entire GitHub repository
-bool clone_repository(const std::string& owner,
-                      const std::string& repo,
-                      const std::string& /* path */,
-                      const std::string& output) {
-    if (!opt_quiet)
-        std::printf("Cloning into '%s'...\n", output.c_str());
+// What a request borrows from the daemon and gives back when it is done
+struct DaemonHome {
+    Options defaults;                          // the daemon's cache settings, the rest fresh
+    int fds[3] = {-1, -1, -1};                 // the daemon's stdin, stdout and stderr
+    int cwd = -1;                              // its working directory
+    std::map<std::string, std::string> env;  // its values of daemon_env
+};
 
-    if (!path_available_for_write(output)) return false;
+// Sets the daemon_env variables to VALUES, unsetting those it lacks
+static void set_daemon_env(const std::map<std::string, std::string>& values) {
+    for (const char* name : daemon_env) {
+        auto it = values.find(name);
+        if (it == values.end())
+            unsetenv(name);
+        else
+            setenv(name, it->second.c_str(), 1);
+    }
+}
 
-    std::string url = "https://github.com/" + owner + "/" + repo + ".git";
-    
-    const char* token = std::getenv("GITHUB_TOKEN");
-    std::string auth_config = token ? ("-c http.extraHeader=" + 
-                                      quote_arg(std::string("Authorization: Bearer ") + token) + " ") : "";
-    
-    bool is_sha = !opt_branch.empty() && looks_like_commit_sha(opt_branch);
-    
-    std::string cmd = make_git_command(auth_config + 
-                     "-c http.lowSpeedLimit=1000 -c http.lowSpeedTime=10 clone --depth 1 ");
+// Reads one request from CONN and runs it in this process with the client's
+// descriptors, directory and environment, then puts HOME's back
+static int serve_request(int conn, const DaemonHome& home) {
+    std::uint32_t size = 0;
+    iovec iov = {&size, sizeof size};
+    int fds[3];
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof fds)] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != static_cast<ssize_t>(sizeof size) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof fds))
+        return EXIT_FAILURE;
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+    std::string payload(size <= (1u << 20) ? size : 0, '\0');
+    bool complete = size <= (1u << 20) && read_all(conn, &payload[0], size);
 
-    if (!opt_quiet)
-        cmd += "--progress ";
-    
-    // don't use --branch with commit SHAs
-    if (!opt_branch.empty() && !is_sha)
-        cmd += "--branch " + quote_arg(opt_branch) + " ";
-    
-    cmd += quote_arg(url) + " " + quote_arg(output);
+    std::fflush(nullptr);
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    std::vector<std::string> fields;
+    for (std::size_t start = 0, end; complete && start < payload.size(); start = end + 1) {
+        end = payload.find('\0', start);
+        if (end == std::string::npos)
+            end = payload.size();
+        fields.push_back(payload.substr(start, end - start));
+    }
+    int status = EXIT_FAILURE;
+    if (!complete) {
+        std::fprintf(stderr, "%s: daemon received an incomplete request\n", PROGRAM_NAME);
+    } else if (fields.empty() || chdir(fields[0].c_str()) != 0) {
+        std::fprintf(stderr, "%s: daemon cannot enter the working directory\n", PROGRAM_NAME);
+    } else {
+        std::map<std::string, std::string> env;
+        std::vector<std::string> args = {PROGRAM_NAME};
+        for (std::size_t i = 1; i < fields.size(); i++) {
+            std::size_t eq = fields[i].find('=');
+            if (fields[i][0] == 'E' && eq != std::string::npos)
+                env[fields[i].substr(1, eq - 1)] = fields[i].substr(eq + 1);
+            else if (fields[i][0] == 'A')
+                args.push_back(fields[i].substr(1));
+        }
+        std::vector<char*> argv;
+        for (auto& arg : args)
+            argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+        set_daemon_env(env);
+        reset_run_stats();
+        serving_request = true;
+        try {
+            status = run_cli(static_cast<int>(args.size()), argv.data(), home.defaults);
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, e.what());
+        }
+        serving_request = false;
+    }
 
-    if (!opt_verbose)
-        cmd += dev_null();
+    std::fflush(nullptr);
+    std::clearerr(stdin);
+    std::cin.clear();
+    for (int i = 0; i < 3; i++)
+        dup2(home.fds[i], i);
+    if (fchdir(home.cwd) != 0)
+        std::fprintf(stderr, "%s: cannot return to the daemon's directory\n", PROGRAM_NAME);
+    set_daemon_env(home.env);
+    opt = home.defaults;
+    return status;
+}
+
+// --daemon: serves requests on opt.daemon until killed
+static int run_daemon() {
+    DaemonHome home;
+    if (opt.cache_dir.empty())
+        opt.cache_dir = default_cache_dir();
+    if (opt.cache_dir.empty()) {
+        std::fprintf(stderr, "%s: cannot determine cache directory, use --cache-dir\n", PROGRAM_NAME);
+        return EXIT_FAILURE;
+    }
+    // requests run in their clients' directories
+    home.defaults.cache_dir = std::filesystem::absolute(opt.cache_dir).string();
+    home.defaults.cache_size = opt.cache_size;
+    home.cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (int i = 0; i < 3; i++)
+        home.fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    for (const char* name : daemon_env) {
+        if (const char* value = std::getenv(name))
+            home.env[name] = value;
+    }
+    sockaddr_un addr;
+    if (!socket_address(opt.daemon, addr))
+        return EXIT_FAILURE;
+    if (home.cwd < 0 || std::find(home.fds, home.fds + 3, -1) != home.fds + 3) {
+        std::fprintf(stderr, "%s: cannot keep the daemon's descriptors: %s\n", PROGRAM_NAME,
+                     std::strerror(errno));
+        return EXIT_FAILURE;
+    }
 
-    if (opt_verbose)
-        std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, cmd.c_str());
+    // a socket file nobody answers on is left over from an earlier daemon
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0) {
+        std::fprintf(stderr, "%s: a daemon is already listening on %s\n", PROGRAM_NAME, opt.daemon.c_str());
+        close(probe);
+        return EXIT_FAILURE;
+    }
+    if (probe >= 0)
+        close(probe);
+    unlink(opt.daemon.c_str());
 
-    int result = std::system(cmd.c_str());
-    if (result != 0) {
-        int exit_code = exit_status_of(result);
-        if (exit_code == 128) {
-            std::fprintf(stderr, "%s: repo not found or private\n", PROGRAM_NAME);
-        } else {
-            std::fprintf(stderr, "%s: clone failed (exit %d)\n", PROGRAM_NAME, exit_code);
-        }
-        return false;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t old_mask = umask(0077);  // only this user may connect
+    bool bound = listener >= 0 && bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0;
+    umask(old_mask);
+    if (!bound || listen(listener, 64) != 0) {
+        std::fprintf(stderr, "%s: cannot listen on %s: %s\n", PROGRAM_NAME, opt.daemon.c_str(),
+                     std::strerror(errno));
+        return EXIT_FAILURE;
     }
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
 
-    if (is_sha) {
-        std::string sha_cmd = make_git_command("-C " + quote_arg(output) + " " + auth_config +
-                             "fetch --depth 1 origin " + quote_arg(opt_branch));
-        if (!opt_verbose) sha_cmd += dev_null();
-        
-        if (opt_verbose)
-            std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, sha_cmd.c_str());
-        
-        result = std::system(sha_cmd.c_str());
-        if (result != 0) {
-            int exit_code = exit_status_of(result);
-            std::fprintf(stderr, "%s: failed to fetch commit %s (exit %d)\n", 
-                        PROGRAM_NAME, opt_branch.c_str(), exit_code);
-            return false;
-        }
+    if (!opt.quiet)
+        std::printf("%s: listening on %s (cache: %s)\n", PROGRAM_NAME, opt.daemon.c_str(),
+                    home.defaults.cache_dir.c_str());
+    std::fflush(stdout);
+    bool verbose = opt.verbose;
+    opt = home.defaults;
 
-        std::string checkout_cmd = make_git_command("-C " + quote_arg(output) + " checkout " + quote_arg(opt_branch));
-        if (!opt_verbose) checkout_cmd += dev_null();
-        
-        if (opt_verbose)
-            std::fprintf(stderr, "%s: %s\n", PROGRAM_NAME, checkout_cmd.c_str());
-        
-        result = std::system(checkout_cmd.c_str());
-        if (result != 0) {
-            int exit_code = exit_status_of(result);
-            std::fprintf(stderr, "%s: failed to checkout commit %s (exit %d)\n", 
-                        PROGRAM_NAME, opt_branch.c_str(), exit_code);
-            return false;
+    for (unsigned long served = 1;; served++) {
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            std::fprintf(stderr, "%s: accept failed: %s\n", PROGRAM_NAME, std::strerror(errno));
+            return EXIT_FAILURE;
         }
+        fcntl(conn, F_SETFD, FD_CLOEXEC);
+        auto start = std::chrono::steady_clock::now();
+        int status = serve_request(conn, home);
+        if (verbose)
+            std::fprintf(stderr, "%s: request %lu exited %d after %.3fs\n", PROGRAM_NAME, served, status,
+                         std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        std::string answer = std::to_string(status) + "\n";
+        write_all(conn, answer.data(), answer.size());
+        close(conn);
     }
+}
+#else
+static int run_client(const std::string&, const std::vector<std::string>&) {
+    std::fprintf(stderr, "%s: --connect is not supported on Windows, running locally\n", PROGRAM_NAME);
+    return -1;
+}
 
-    if (!opt_quiet)
-        std::puts("done.");
-    return true;
+static int run_daemon() {
+    std::fprintf(stderr, "%s: --daemon is not supported on Windows\n", PROGRAM_NAME);
+    return EXIT_FAILURE;
 }
+#endif
 
 int main(int argc, char** argv) {
-    if (!check_dependencies()) {
-        std::exit(EXIT_FAILURE);
+#ifndef _WIN32
+    // a child that exits early must not take sip down while its stdin is fed
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+    // --connect forwards everything else to a daemon; it is handled before
+    // option parsing so that the daemon sees the arguments exactly as given
+    std::string socket_path;
+    std::vector<std::string> forwarded;
+    std::vector<char*> local_argv = {argv[0]};
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--connect" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (arg.rfind("--connect=", 0) == 0) {
+            socket_path = arg.substr(std::strlen("--connect="));
+        } else {
+            forwarded.push_back(arg);
+            local_argv.push_back(argv[i]);
+        }
     }
+    if (socket_path.empty())
+        return run_cli(argc, argv, Options());
+    int status = run_client(socket_path, forwarded);
+    if (status >= 0)
+        return status;
+    local_argv.push_back(nullptr);
+    return run_cli(static_cast<int>(local_argv.size()) - 1, local_argv.data(), Options());
+}
+
+// Parses one command line on top of DEFAULTS and runs it. Errors return a
+// status rather than exiting, so that a --daemon survives a bad request.
+static int run_cli(int argc, char** argv, const Options& defaults) {
+    opt = defaults;
+#ifdef __GLIBC__
+    optind = 0;  // a full getopt reset, for the daemon's second request on
+#else
+    optind = 1;
+#endif
+    if (const char* cache_env = std::getenv("SIP_CACHE_DIR"); cache_env && opt.cache_dir.empty())
+        opt.cache_dir = cache_env;
+    if (const char* store_env = std::getenv("SIP_STORE_DIR"))
+        opt.store_dir = store_env;
+    char store_command = 0;  // 'G' for --store-gc, 'A' for --store-stats
 
     static const struct option long_options[] = {{"output-dir", required_argument, nullptr, 'o'},
                                                  {"branch", required_argument, nullptr, 'b'},
                                                  {"timeout", required_argument, nullptr, 't'},
                                                  {"quiet", no_argument, nullptr, 'q'},
                                                  {"verbose", no_argument, nullptr, 'v'},
+                                                 {"manifest", required_argument, nullptr, 'm'},
+                                                 {"jobs", required_argument, nullptr, 'j'},
+                                                 {"path", required_argument, nullptr, 'p'},
+                                                 {"cache", no_argument, nullptr, 'C'},
+                                                 {"cache-dir", required_argument, nullptr, 'D'},
+                                                 {"cache-size", required_argument, nullptr, 'S'},
+                                                 {"ref-ttl", required_argument, nullptr, 'T'},
+                                                 {"refresh", no_argument, nullptr, 'R'},
+                                                 {"engine", required_argument, nullptr, 'E'},
+                                                 {"strategy", required_argument, nullptr, 'Z'},
+                                                 {"compress", required_argument, nullptr, 'z'},
+                                                 {"segments", required_argument, nullptr, 'N'},
+                                                 {"sha256", required_argument, nullptr, 'H'},
+                                                 {"no-lfs", no_argument, nullptr, 'L'},
+                                                 {"trees", required_argument, nullptr, 'W'},
+                                                 {"git-base-url", required_argument, nullptr, 'g'},
+                                                 {"raw-base-url", required_argument, nullptr, 'r'},
+                                                 {"tarball-base-url", required_argument, nullptr, 'u'},
+                                                 {"trace", required_argument, nullptr, 'X'},
+                                                 {"sync", no_argument, nullptr, 'Y'},
+                                                 {"store", required_argument, nullptr, 'K'},
+                                                 {"store-links", no_argument, nullptr, 'k'},
+                                                 {"store-gc", no_argument, nullptr, 'G'},
+                                                 {"store-stats", no_argument, nullptr, 'A'},
+                                                 {"daemon", required_argument, nullptr, 'Q'},
+                                                 {"prefetch-batch", required_argument, nullptr, 'B'},
+                                                 {"include", required_argument, nullptr, 'I'},
+                                                 {"exclude", required_argument, nullptr, 'U'},
                                                  {"help", no_argument, nullptr, 'h'},
                                                  {"version", no_argument, nullptr, 'V'},
                                                  {nullptr, 0, nullptr, 0}};
 
     int c;
-    while ((c = getopt_long(argc, argv, "o:b:t:qvhV", long_options, nullptr)) != -1) {
+    while ((c = getopt_long(argc, argv, "o:b:t:qvm:j:p:hV", long_options, nullptr)) != -1) {
         switch (c) {
             case 'o':
-                opt_output_dir = optarg;
+                opt.output_dir = optarg;
                 break;
             case 'b':
-                opt_branch = optarg;
+                opt.branch = optarg;
                 break;
             case 't': {
                 char* endptr;
                 long timeout = std::strtol(optarg, &endptr, 10);
                 if (*endptr != '\0' || timeout <= 0 || timeout > INT_MAX) {
                     std::fprintf(stderr, "%s: invalid timeout value '%s' (must be a positive integer)\n", PROGRAM_NAME, optarg);
-                    std::exit(EXIT_FAILURE);
+                    return EXIT_FAILURE;
+                }
+                opt.timeout = static_cast<int>(timeout);
+            } break;
+            case 'm':
+                opt.manifest = optarg;
+                break;
+            case 'j': {
+                char* endptr;
+                long jobs = std::strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || jobs <= 0 || jobs > 256) {
+                    std::fprintf(stderr, "%s: invalid jobs value '%s' (must be 1-256)\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                opt.jobs = static_cast<int>(jobs);
+                opt.jobs_set = true;
+            } break;
+            case 'C':
+                opt.cache_dir = default_cache_dir();
+                if (opt.cache_dir.empty()) {
+                    std::fprintf(stderr, "%s: cannot determine cache directory, use --cache-dir\n", PROGRAM_NAME);
+                    return EXIT_FAILURE;
                 }
-                opt_timeout = static_cast<int>(timeout);
+                break;
+            case 'D':
+                opt.cache_dir = optarg;
+                break;
+            case 'S':
+                if (!parse_size(optarg, opt.cache_size)) {
+                    std::fprintf(stderr, "%s: invalid cache size '%s'\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T': {
+                char* endptr;
+                long ttl = std::strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || ttl < 0) {
+                    std::fprintf(stderr, "%s: invalid ref TTL '%s' (must be seconds, 0 disables)\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                opt.ref_ttl = ttl;
+            } break;
+            case 'R':
+                opt.refresh = true;
+                break;
+            case 'I':
+            case 'U':
+                if (*optarg == '\0') {
+                    std::fprintf(stderr, "%s: empty --%s glob\n", PROGRAM_NAME, c == 'I' ? "include" : "exclude");
+                    return EXIT_FAILURE;
+                }
+                (c == 'I' ? opt.includes : opt.excludes).push_back(optarg);
+                break;
+            case 'B': {
+                char* endptr;
+                long batch = std::strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || batch < 0) {
+                    std::fprintf(stderr, "%s: invalid prefetch batch '%s' (must be a count, 0 disables)\n",
+                                 PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                opt.prefetch_batch = batch;
+            } break;
+            case 'X':
+                opt.trace = optarg;
+                break;
+            case 'Y':
+                opt.sync = true;
+                break;
+            case 'K':
+                opt.store_dir = optarg;
+                break;
+            case 'k':
+                opt.store_links = true;
+                break;
+            case 'G':
+                store_command = 'G';
+                break;
+            case 'A':
+                store_command = 'A';
+                break;
+            case 'Q':
+                opt.daemon = optarg;
+                break;
+            case 'E':
+                if (std::strcmp(optarg, "git") == 0) {
+                    opt.engine = Engine::Git;
+                } else if (std::strcmp(optarg, "tarball") == 0) {
+                    opt.engine = Engine::Tarball;
+                } else if (std::strcmp(optarg, "objects") == 0) {
+                    opt.engine = Engine::Objects;
+                } else {
+                    std::fprintf(stderr, "%s: invalid engine '%s' (must be git, tarball or objects)\n", PROGRAM_NAME,
+                                 optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'g':
+                opt.git_base_url = optarg;
+                break;
+            case 'r':
+                opt.raw_base_url = optarg;
+                break;
+            case 'u':
+                opt.tarball_base_url = optarg;
+                break;
+            case 'z':
+                if (std::strcmp(optarg, "none") == 0) {
+                    opt.compress = Compress::None;
+                } else if (std::strcmp(optarg, "zstd") == 0) {
+                    opt.compress = Compress::Zstd;
+                } else {
+                    std::fprintf(stderr, "%s: invalid compression '%s' (must be none or zstd)\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N': {
+                char* endptr;
+                long segments = std::strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || segments <= 0 || segments > 64) {
+                    std::fprintf(stderr, "%s: invalid segments value '%s' (must be 1-64)\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                opt.segments = static_cast<int>(segments);
             } break;
+            case 'H':
+                opt.sha256 = optarg;
+                std::transform(opt.sha256.begin(), opt.sha256.end(), opt.sha256.begin(),
+                               [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                if (opt.sha256.size() != 64 || opt.sha256.find_first_not_of("0123456789abcdef") != std::string::npos) {
+                    std::fprintf(stderr, "%s: invalid sha256 '%s' (must be 64 hex digits)\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                opt.lfs = false;
+                break;
+            case 'W':
+                if (std::strcmp(optarg, "all") == 0) {
+                    opt.trees = Trees::All;
+                } else if (std::strcmp(optarg, "path") == 0) {
+                    opt.trees = Trees::Path;
+                } else {
+                    std::fprintf(stderr, "%s: invalid trees '%s' (must be all or path)\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'Z':
+                if (std::strcmp(optarg, "path") == 0) {
+                    opt.strategy = Strategy::Path;
+                } else if (std::strcmp(optarg, "auto") == 0) {
+                    opt.strategy = Strategy::Auto;
+                } else {
+                    std::fprintf(stderr, "%s: invalid strategy '%s' (must be path or auto)\n", PROGRAM_NAME, optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                if (*optarg == '\0') {
+                    std::fprintf(stderr, "%s: empty --path\n", PROGRAM_NAME);
+                    return EXIT_FAILURE;
+                }
+                opt.paths.push_back(optarg);
+                break;
             case 'q':
-                opt_quiet = true;
+                opt.quiet = true;
                 break;
             case 'v':
-                opt_verbose = true;
+                opt.verbose = true;
                 break;
             case 'h':
-                usage(EXIT_SUCCESS);
-                break;
+                return usage(EXIT_SUCCESS);
             case 'V':
-                print_version();
-                break;
+                return print_version();
             default:
-                usage(EXIT_FAILURE);
+                return usage(EXIT_FAILURE);
         }
     }
 
-    if (opt_quiet && opt_verbose) {
+    if (opt.quiet && opt.verbose) {
         std::fprintf(stderr, "%s: --quiet and --verbose are mutually exclusive\n", PROGRAM_NAME);
-        std::exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
+    }
+
+    // auto sizes directories from the whole commit's trees
+    if (opt.trees == Trees::Path && (opt.engine == Engine::Tarball || opt.strategy == Strategy::Auto)) {
+        std::fprintf(stderr, "%s: --trees=path needs --engine=git or objects and --strategy=path\n", PROGRAM_NAME);
+        return EXIT_FAILURE;
+    }
+    // the cache and the other engines always fetch the way they do
+    if (opt.strategy == Strategy::Auto && (opt.engine != Engine::Git || !opt.cache_dir.empty())) {
+        std::fprintf(stderr, "%s: --strategy=auto needs --engine=git and no object cache\n", PROGRAM_NAME);
+        return EXIT_FAILURE;
+    }
+
+    if (!opt.daemon.empty()) {
+        if (serving_request) {
+            std::fprintf(stderr, "%s: a daemon request cannot start another daemon\n", PROGRAM_NAME);
+            return EXIT_FAILURE;
+        }
+        if (optind < argc || !opt.manifest.empty() || store_command) {
+            std::fprintf(stderr, "%s: --daemon takes no requests of its own\n", PROGRAM_NAME);
+            return usage(EXIT_FAILURE);
+        }
+        return run_daemon();
+    }
+
+    if (store_command) {
+        if (opt.store_dir.empty()) {
+            std::fprintf(stderr, "%s: --store-gc and --store-stats need --store=DIR\n", PROGRAM_NAME);
+            return EXIT_FAILURE;
+        }
+        bool ok = store_command == 'G' ? store_gc() : store_print_stats();
+        if (!write_trace())
+            ok = false;
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (!opt.manifest.empty()) {
+        if (!opt.sha256.empty()) {
+            std::fprintf(stderr, "%s: --sha256 takes a single file, not a manifest\n", PROGRAM_NAME);
+            return usage(EXIT_FAILURE);
+        }
+        if (output_to_stdout()) {
+            std::fprintf(stderr, "%s: -o - takes a single PATH, not a manifest\n", PROGRAM_NAME);
+            return usage(EXIT_FAILURE);
+        }
+        if (optind < argc) {
+            std::fprintf(stderr, "%s: --manifest takes no OWNER/REPO arguments\n", PROGRAM_NAME);
+            return usage(EXIT_FAILURE);
+        }
+        bool ok = run_manifest(opt.manifest);
+        report_process_stats();
+        if (!write_trace())
+            ok = false;
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
     if (optind >= argc) {
         std::fprintf(stderr, "%s: missing repository\n", PROGRAM_NAME);
-        usage(EXIT_FAILURE);
+        return usage(EXIT_FAILURE);
     }
 
     std::string repo_arg = argv[optind++];
@@ -684,72 +7707,44 @@ int main(int argc, char** argv) {
 
     if (!parse_github_url(repo_arg, owner, repo, path, url_branch)) {
         std::fprintf(stderr, "%s: invalid GitHub URL or repo format\n", PROGRAM_NAME);
-        std::exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
     }
     
     // if branch was extracted from URL and no -b option given, use URL branch
     // but skip common default branch names that should be auto-detected
-    if (!url_branch.empty() && opt_branch.empty() && 
+    if (!url_branch.empty() && opt.branch.empty() && 
         url_branch != "master" && url_branch != "main") {
-        opt_branch = url_branch;
+        opt.branch = url_branch;
     }
 
-    if (path.empty() && optind < argc) {
-        path = argv[optind++];
+    std::vector<std::string> paths;
+    if (!path.empty())
+        paths.push_back(path);
+    while (optind < argc)
+        paths.push_back(argv[optind++]);
+    paths.insert(paths.end(), opt.paths.begin(), opt.paths.end());
+    if (output_to_stdout() && (paths.size() > 1 || opt.sync)) {
+        std::fprintf(stderr, "%s: -o - takes a single PATH, without --sync\n", PROGRAM_NAME);
+        return usage(EXIT_FAILURE);
     }
-
-    if (optind < argc) {
-        std::fprintf(stderr, "%s: too many arguments\n", PROGRAM_NAME);
-        usage(EXIT_FAILURE);
+    if (!opt.sha256.empty() && paths.size() != 1) {
+        std::fprintf(stderr, "%s: --sha256 takes a single PATH\n", PROGRAM_NAME);
+        return usage(EXIT_FAILURE);
     }
 
-    bool success = false;
-
-    if (path.empty()) {
-        // clone whole repo - use repo name as default destination
-        std::string dest = opt_output_dir;
-        if (opt_output_dir == "./" || opt_output_dir == ".") {
-            dest = repo;
-        }
-        success = clone_repository(owner, repo, "", dest);
-    } else if (path.back() == '/') {
-        // directory download
-        std::string dir_path = path.substr(0, path.length() - 1);
-        std::string output_path = (opt_output_dir == "./" || opt_output_dir == ".")
-                                      ? std::filesystem::path(dir_path).filename().string()
-                                      : (std::filesystem::path(opt_output_dir) /
-                                         std::filesystem::path(dir_path).filename())
-                                            .string();
-
-        success = download_directory_selective(owner, repo, dir_path, output_path);
-        if (!success && !opt_quiet) {
-            std::fprintf(stderr, "%s: trying full repo clone...\n", PROGRAM_NAME);
-            std::string dest = opt_output_dir;
-            if (opt_output_dir == "./" || opt_output_dir == ".") dest = repo;
-            success = clone_repository(owner, repo, "", dest);
-        }
+    bool success;
+    if (paths.size() <= 1) {
+        success = fetch_target(owner, repo, paths.empty() ? "" : paths[0], opt.branch, "");
     } else {
-        // single file
-        std::string output_file =
-            (opt_output_dir == "./" || opt_output_dir == ".")
-                ? path
-                : (std::filesystem::path(opt_output_dir) / std::filesystem::path(path).filename())
-                      .string();
-
-        success = download_file(owner, repo, path, output_file);
-
-        // maybe it's actually a directory?
-        if (!success) {
-            if (!opt_quiet)
-                std::fprintf(stderr, "%s: trying as directory...\n", PROGRAM_NAME);
-            std::string output_path = (opt_output_dir == "./" || opt_output_dir == ".")
-                                          ? std::filesystem::path(path).filename().string()
-                                          : (std::filesystem::path(opt_output_dir) /
-                                             std::filesystem::path(path).filename())
-                                                .string();
-            success = download_directory_selective(owner, repo, path, output_path);
-        }
+        // several paths: one sparse checkout for the directories, files in parallel
+        std::vector<ManifestEntry> entries;
+        for (const auto& p : paths)
+            entries.push_back({0, owner + "/" + repo, owner, repo, p, opt.branch, "", false, 0.0});
+        success = run_entries(entries);
     }
+    report_process_stats();
+    if (!write_trace())
+        success = false;
 
     return success ? EXIT_SUCCESS : EXIT_FAILURE;
-}
\ No newline at end of file
+}